@@ -0,0 +1,728 @@
+// Benchmarks for loveme's internal hot paths.
+// Build: make bench
+// Usage: bench/bench [--files N] [--file-bytes N] [--output-kb N] [--output FILE]
+//                    [--only NAME] [--dir PATH] [--keep]
+#define main loveme_main
+#include "../loveme.c"
+#undef main
+
+#define BENCH_REPS 5
+#define BENCH_APPLY_FILES 20
+#define BENCH_IGNORE_RULES 20000
+#define BENCH_IGNORE_PATHS 5000 // matched per repetition; the linear matcher is slow
+#define BENCH_PACKAGES 40
+
+typedef struct {
+    int files;
+    int file_bytes;      // content of each synthetic code file
+    int output_kb;       // size of the synthetic model output
+    char output[PATH_MAX_LEN / 2]; // recorded model output to use instead
+    char only[32];       // run just this benchmark
+    char dir[PATH_MAX_LEN / 2];
+    int keep;
+} BenchOptions;
+
+// Allocation counting: malloc and friends are interposed for the whole
+// process (glibc), so allocations made inside libc count as well
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static uint64_t bench_allocs, bench_alloc_bytes;
+
+void *malloc(size_t n) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench_alloc_bytes, n, __ATOMIC_RELAXED);
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench_alloc_bytes, n * size, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench_alloc_bytes, n, __ATOMIC_RELAXED);
+    return __libc_realloc(p, n);
+}
+
+typedef struct {
+    double ms[BENCH_REPS];
+    uint64_t allocs, bytes; // over all repetitions
+} BenchRun;
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int bench_enabled(const BenchOptions *opt, const char *name) {
+    return !opt->only[0] || strcmp(opt->only, name) == 0;
+}
+
+static void bench_start(BenchRun *run, int rep) {
+    if (rep == 0) run->allocs = bench_allocs, run->bytes = bench_alloc_bytes;
+    run->ms[rep] = now_ms();
+}
+
+static void bench_stop(BenchRun *run, int rep) {
+    run->ms[rep] = now_ms() - run->ms[rep];
+    if (rep == BENCH_REPS - 1) {
+        run->allocs = bench_allocs - run->allocs;
+        run->bytes = bench_alloc_bytes - run->bytes;
+    }
+}
+
+// One line per benchmark: median time per operation, allocations per
+// operation and the process's peak RSS so far
+static void bench_report(const char *name, const char *detail, const BenchRun *run, double ops) {
+    double ms[BENCH_REPS];
+    memcpy(ms, run->ms, sizeof(ms));
+    qsort(ms, BENCH_REPS, sizeof(double), cmp_double);
+    double per = ops * BENCH_REPS;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("%-9s %-24s %12.0f ns/op  %9.1f allocs/op  %10.1f KB/op  best %8.2f ms  peak RSS %ld MB\n",
+           name, detail, ms[BENCH_REPS / 2] * 1e6 / ops, run->allocs / per,
+           run->bytes / per / 1024.0, ms[0], ru.ru_maxrss / 1024);
+}
+
+// Deterministic synthetic source: numbered one-line functions
+static void bench_code(Buffer *b, int file, size_t bytes) {
+    for (int k = 0; b->len < bytes; k++) {
+        buffer_append_fmt(b, "int fn_%d_%d(int x) { return x + %d; }\n", file, k, k);
+    }
+}
+
+static int bench_write_file(const char *path, const char *data, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    ssize_t n = write(fd, data, len);
+    close(fd);
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+// Synthetic repo: 10x10x10 directories, files spread over the leaves,
+// one in five files not code, plus an ignored node_modules tree
+static int bench_make_tree(const BenchOptions *opt) {
+    const char *exts[] = {".c", ".h", ".py", ".js", ".png"};
+    char path[PATH_MAX_LEN];
+    int per_leaf = opt->files / 1000 + 1, made = 0;
+    Buffer code;
+    buffer_init(&code);
+    
+    if (mkdir(opt->dir, 0755) != 0 && errno != EEXIST) return -1;
+    snprintf(path, sizeof(path), "%s/node_modules", opt->dir);
+    mkdir(path, 0755);
+    for (int i = 0; i < 100; i++) {
+        snprintf(path, sizeof(path), "%s/node_modules/m%d.js", opt->dir, i);
+        close(open(path, O_WRONLY | O_CREAT, 0644));
+    }
+    
+    for (int a = 0; a < 10; a++) {
+        for (int b = 0; b < 10; b++) {
+            for (int c = 0; c < 10 && made < opt->files; c++) {
+                snprintf(path, sizeof(path), "%s/d%d", opt->dir, a);
+                mkdir(path, 0755);
+                snprintf(path, sizeof(path), "%s/d%d/s%d", opt->dir, a, b);
+                mkdir(path, 0755);
+                snprintf(path, sizeof(path), "%s/d%d/s%d/l%d", opt->dir, a, b, c);
+                if (mkdir(path, 0755) != 0 && errno != EEXIST) return -1;
+                for (int f = 0; f < per_leaf && made < opt->files; f++, made++) {
+                    char file[PATH_MAX_LEN + 32];
+                    snprintf(file, sizeof(file), "%s/f%d%s", path, f, exts[f % 5]);
+                    buffer_clear(&code);
+                    if (f % 5 != 4) bench_code(&code, made, (size_t)opt->file_bytes);
+                    if (bench_write_file(file, code.data, code.len) != 0) return -1;
+                }
+            }
+        }
+    }
+    buffer_free(&code);
+    return 0;
+}
+
+static uint64_t bench_list_hash(const FileList *list) {
+    uint64_t h = HASH_SEED;
+    for (int i = 0; i < list->count; i++) {
+        h = hash_bytes(list->files[i].path, strlen(list->files[i].path) + 1, h);
+    }
+    return h;
+}
+
+// The walker this replaced: snprintf + stat() for every entry
+static int bench_legacy_walk(const char *path, int depth) {
+    if (depth > SCAN_MAX_DEPTH) return 0;
+    DIR *d = opendir(path);
+    if (!d) return 0;
+    
+    int count = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        if (ent->d_name[0] == '.' || should_ignore(ent->d_name)) continue;
+        char full[PATH_MAX_LEN];
+        if (path_join(full, sizeof(full), path, ent->d_name) != 0) continue;
+        struct stat st;
+        if (stat(full, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            count += 1 + bench_legacy_walk(full, depth + 1);
+        } else if (S_ISREG(st.st_mode) && is_code_file(ent->d_name)) {
+            count++;
+        }
+    }
+    closedir(d);
+    return count;
+}
+
+static void bench_walk(const BenchOptions *opt) {
+    int thread_counts[] = {1, 0};
+    uint64_t expect = 0;
+    BenchRun run;
+    int entries = 0;
+    
+    for (int r = 0; r < BENCH_REPS; r++) {
+        bench_start(&run, r);
+        entries = bench_legacy_walk(opt->dir, 0);
+        bench_stop(&run, r);
+    }
+    bench_report("walk", "legacy", &run, 1);
+    
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        scan_threads = thread_counts[t];
+        int deterministic = 1;
+        
+        for (int r = 0; r < BENCH_REPS; r++) {
+            FileList list = {0};
+            bench_start(&run, r);
+            scan_directory(opt->dir, &list, opt->dir, 0);
+            bench_stop(&run, r);
+            
+            uint64_t h = bench_list_hash(&list);
+            if (expect == 0) expect = h;
+            if (h != expect) deterministic = 0;
+            entries = list.count;
+            file_list_free(&list);
+        }
+        
+        char detail[64];
+        snprintf(detail, sizeof(detail), "threads=%s %s", thread_counts[t] ? "1" : "auto",
+                 deterministic ? "stable" : "DIFFERS");
+        bench_report("walk", detail, &run, 1);
+    }
+    scan_threads = 0;
+    
+    // Cold start with a saved index: re-stat instead of walking
+    FileList none = {0}, saved = {0};
+    repo_index_full_scan(opt->dir, &saved, &none);
+    repo_index_save(opt->dir, &saved);
+    int ok = 1;
+    for (int r = 0; r < BENCH_REPS; r++) {
+        FileList list = {0};
+        int64_t root_stamp = 0;
+        bench_start(&run, r);
+        if (repo_index_load(opt->dir, &list, &root_stamp) != 0 ||
+            repo_index_revalidate(opt->dir, &list, root_stamp) != 0) {
+            ok = 0;
+        }
+        bench_stop(&run, r);
+        if (bench_list_hash(&list) != bench_list_hash(&saved)) ok = 0;
+        file_list_free(&list);
+    }
+    bench_report("walk", ok ? "index revalidate" : "index revalidate DIFFERS", &run, 1);
+    file_list_free(&saved);
+    printf("          (%d entries)\n", entries);
+}
+
+// Synthetic ignore file in the mix of large monorepos: names, anchored
+// paths, extensions, globs, negations and comments. The last lines prune
+// a tenth of the tree and one leaf in every tenth of the rest.
+static void bench_make_ignore(Buffer *b, int rules) {
+    for (int i = 0; i < rules; i++) {
+        switch (i % 8) {
+        case 0: buffer_append_fmt(b, "gen_%d\n", i); break;
+        case 1: buffer_append_fmt(b, "/vendor/pkg_%d/\n", i); break;
+        case 2: buffer_append_fmt(b, "*.out%d\n", i); break;
+        case 3: buffer_append_fmt(b, "f%d_*.c\n", i); break;
+        case 4: buffer_append_fmt(b, "**/cache_%d/**\n", i); break;
+        case 5: buffer_append_fmt(b, "# generated %d\n", i); break;
+        case 6: buffer_append_fmt(b, "d%d/s%d/l%d/f%d.py\n", i % 10, i % 7, i % 9, i); break;
+        case 7: buffer_append_fmt(b, "!keep_%d\n", i); break;
+        }
+    }
+    buffer_append(b, "d9/\n**/s3/l7/\n");
+}
+
+// Reference matcher: every rule of the level in reverse, no tables
+static int bench_ignore_linear(const IgnoreLevel *lv, const char *path, const char *name, int is_dir) {
+    const char *sub = path + lv->base_len;
+    for (int i = lv->count - 1; i >= 0; i--) {
+        const IgnoreRule *r = &lv->rules[i];
+        if (r->dir_only && !is_dir) continue;
+        if (ignore_glob(r->pat, r->anchored ? sub : name)) return !r->negate;
+    }
+    return -1;
+}
+
+// Compiling a large ignore file, matching every path of the tree against
+// it through the tables and linearly, and walking with it in place
+static void bench_ignore(const BenchOptions *opt) {
+    Buffer text;
+    buffer_init(&text);
+    bench_make_ignore(&text, BENCH_IGNORE_RULES);
+    
+    BenchRun run;
+    IgnoreLevel *lv = NULL;
+    for (int r = 0; r < BENCH_REPS; r++) {
+        if (lv) ignore_level_free(lv);
+        char *copy = strdup(text.data);
+        if (!copy) die("strdup");
+        bench_start(&run, r);
+        lv = ignore_level_compile(copy, NULL, 0);
+        bench_stop(&run, r);
+    }
+    char detail[64];
+    snprintf(detail, sizeof(detail), "compile %d rules", lv->count);
+    bench_report("ignore", detail, &run, 1);
+    
+    FileList list = {0};
+    scan_directory(opt->dir, &list, opt->dir, 0);
+    int paths = list.count < BENCH_IGNORE_PATHS ? list.count : BENCH_IGNORE_PATHS;
+    int agree = 1, ignored = 0;
+    for (int i = 0; i < list.count; i++) {
+        const char *path = list.files[i].path, *slash = strrchr(path, '/');
+        const char *name = slash ? slash + 1 : path;
+        if (ignore_level_match(lv, path, name, list.files[i].is_dir) !=
+            bench_ignore_linear(lv, path, name, list.files[i].is_dir)) agree = 0;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        for (int r = 0; r < BENCH_REPS; r++) {
+            bench_start(&run, r);
+            ignored = 0;
+            for (int i = 0; i < paths; i++) {
+                const char *path = list.files[i].path, *slash = strrchr(path, '/');
+                const char *name = slash ? slash + 1 : path;
+                int m = pass ? ignore_level_match(lv, path, name, list.files[i].is_dir)
+                             : bench_ignore_linear(lv, path, name, list.files[i].is_dir);
+                ignored += m > 0;
+            }
+            bench_stop(&run, r);
+        }
+        snprintf(detail, sizeof(detail), "match %s %s", pass ? "compiled" : "linear", agree ? "same" : "DIFFERS");
+        bench_report("ignore", detail, &run, paths ? paths : 1);
+    }
+    printf("          (%d of %d paths ignored)\n", ignored, paths);
+    file_list_free(&list);
+    ignore_level_free(lv);
+    
+    char path[PATH_MAX_LEN];
+    snprintf(path, sizeof(path), "%s/.gitignore", opt->dir);
+    if (bench_write_file(path, text.data, text.len) == 0) {
+        int entries = 0;
+        for (int r = 0; r < BENCH_REPS; r++) {
+            FileList walked = {0};
+            bench_start(&run, r);
+            scan_directory(opt->dir, &walked, opt->dir, 0);
+            bench_stop(&run, r);
+            entries = walked.count;
+            file_list_free(&walked);
+        }
+        snprintf(detail, sizeof(detail), "walk with it, %d left", entries);
+        bench_report("ignore", detail, &run, 1);
+        unlink(path);
+    }
+    buffer_free(&text);
+}
+
+// Context packing: the first run loads the index from disk, later runs
+// are the incremental path taken before every prompt
+static void bench_context(const BenchOptions *opt) {
+    Config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    snprintf(cfg.workdir, sizeof(cfg.workdir), "%s", opt->dir);
+    cfg.max_total = DEFAULT_MAX_TOTAL;
+    cfg.max_file = DEFAULT_MAX_FILE;
+    cfg.ctx_size = 32768;
+    cfg.n_predict = 4096;
+    snprintf(cfg.focus_file, sizeof(cfg.focus_file), "d0/s0/l0");
+    
+    Buffer ctx;
+    buffer_init(&ctx);
+    double start = now_ms();
+    build_repo_context(&cfg, &ctx, 1, context_budget(&cfg));
+    printf("context   %-24s %12.2f ms (cold, %zu bytes)\n", "first build", now_ms() - start, ctx.len);
+    
+    BenchRun run;
+    for (int r = 0; r < BENCH_REPS; r++) {
+        buffer_clear(&ctx);
+        bench_start(&run, r);
+        build_repo_context(&cfg, &ctx, 1, context_budget(&cfg));
+        bench_stop(&run, r);
+    }
+    bench_report("context", "warm", &run, 1);
+    buffer_free(&ctx);
+}
+
+static void bench_remove_tree(const char *path);
+
+// Monorepo shape: packages with identical vendored headers and template
+// package.json files, plus one file of their own. Copies go into the
+// context once, the others as aliases.
+static void bench_dedup(const BenchOptions *opt) {
+    char root[PATH_MAX_LEN], path[PATH_MAX_LEN + 64];
+    snprintf(root, sizeof(root), "%s_dedup", opt->dir);
+    mkdir(root, 0755);
+    Buffer common, own;
+    buffer_init(&common);
+    buffer_init(&own);
+    bench_code(&common, -1, 4096);
+    const char *manifest = "{\n  \"name\": \"pkg\",\n  \"version\": \"1.0.0\",\n  \"main\": \"index.js\"\n}\n";
+    for (int i = 0; i < BENCH_PACKAGES; i++) {
+        snprintf(path, sizeof(path), "%s/p%d", root, i);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/p%d/common.h", root, i);
+        bench_write_file(path, common.data, common.len);
+        snprintf(path, sizeof(path), "%s/p%d/package.json", root, i);
+        bench_write_file(path, manifest, strlen(manifest));
+        snprintf(path, sizeof(path), "%s/p%d/own.h", root, i);
+        buffer_clear(&own);
+        bench_code(&own, i, 256);
+        bench_write_file(path, own.data, own.len);
+    }
+    
+    Config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    snprintf(cfg.workdir, sizeof(cfg.workdir), "%s", root);
+    cfg.max_total = DEFAULT_MAX_TOTAL;
+    cfg.max_file = DEFAULT_MAX_FILE;
+    cfg.ctx_size = 65536;
+    cfg.n_predict = 4096;
+    
+    Buffer ctx;
+    buffer_init(&ctx);
+    build_repo_context(&cfg, &ctx, 1, context_budget(&cfg)); // index and hash the copies
+    BenchRun run;
+    for (int r = 0; r < BENCH_REPS; r++) {
+        buffer_clear(&ctx);
+        prompt_stats.aliased_files = 0;
+        bench_start(&run, r);
+        build_repo_context(&cfg, &ctx, 1, context_budget(&cfg));
+        bench_stop(&run, r);
+    }
+    size_t all = (size_t)BENCH_PACKAGES * (common.len + strlen(manifest));
+    char detail[64];
+    snprintf(detail, sizeof(detail), "%d aliases, %zu KB not %zu", prompt_stats.aliased_files, ctx.len / 1024,
+             (ctx.len + all - common.len - strlen(manifest)) / 1024);
+    bench_report("context", detail, &run, 1);
+    
+    buffer_free(&ctx);
+    buffer_free(&common);
+    buffer_free(&own);
+    if (!opt->keep) bench_remove_tree(root);
+}
+
+static void bench_buffer(void) {
+    enum { N = 1000000 };
+    BenchRun run;
+    Buffer b;
+    
+    for (int r = 0; r < BENCH_REPS; r++) {
+        buffer_init(&b);
+        bench_start(&run, r);
+        for (int i = 0; i < N; i++) buffer_append(&b, "token ");
+        bench_stop(&run, r);
+        buffer_free(&b);
+    }
+    bench_report("buffer", "append 6 bytes", &run, N);
+    
+    for (int r = 0; r < BENCH_REPS; r++) {
+        buffer_init(&b);
+        bench_start(&run, r);
+        for (int i = 0; i < N; i++) buffer_append_n(&b, "0123456789abcdef", 16);
+        bench_stop(&run, r);
+        buffer_free(&b);
+    }
+    bench_report("buffer", "append_n 16 bytes", &run, N);
+    
+    for (int r = 0; r < BENCH_REPS; r++) {
+        buffer_init(&b);
+        bench_start(&run, r);
+        for (int i = 0; i < N; i++) buffer_append_fmt(&b, "%s:%d ", "file.c", i);
+        bench_stop(&run, r);
+        buffer_free(&b);
+    }
+    bench_report("buffer", "append_fmt", &run, N);
+}
+
+// Content classifier on a full sample of code and of a minified bundle
+static void bench_classify(void) {
+    enum { N = 20000 };
+    Buffer code, minified;
+    buffer_init(&code);
+    buffer_init(&minified);
+    bench_code(&code, 0, CLASSIFY_SAMPLE);
+    for (int k = 0; minified.len < CLASSIFY_SAMPLE; k++) buffer_append_fmt(&minified, "function f%d(a){return a+%d};", k, k);
+    
+    const Buffer *samples[] = {&code, &minified};
+    const char *names[] = {"8 KB code", "8 KB minified"};
+    for (int k = 0; k < 2; k++) {
+        BenchRun run;
+        int verdict = 0;
+        for (int r = 0; r < BENCH_REPS; r++) {
+            bench_start(&run, r);
+            for (int i = 0; i < N; i++) verdict += classify_sample((const unsigned char *)samples[k]->data, CLASSIFY_SAMPLE);
+            bench_stop(&run, r);
+        }
+        bench_report("classify", names[k], &run, N);
+        if (verdict != N * BENCH_REPS * (k ? CONTENT_MINIFIED : CONTENT_TEXT)) printf("          (unexpected verdict)\n");
+    }
+    buffer_free(&code);
+    buffer_free(&minified);
+}
+
+// Synthetic model output: the echoed prompt, prose, a fenced example and
+// SEARCH/REPLACE edits against the apply scratch files, then timings.
+// Returns the number of rounds; round r edits line 3r+1 of each file.
+static int bench_make_output(Buffer *out, size_t bytes) {
+    buffer_append(out, "<|user|>\nRename the helpers and explain.\n<|endofuser|>\n\n<|assistant|>\n");
+    int round = 0;
+    for (; out->len < bytes; round++) {
+        buffer_append(out, "Here is the plan. The helpers get clearer names, and the callers follow. "
+                           "Nothing else changes.\n\n```c\nint example(void) { return 0; }\n```\n\n");
+        for (int f = 0; f < BENCH_APPLY_FILES && out->len < bytes; f++) {
+            int k = round * 3 + 1;
+            buffer_append_fmt(out, "<<<FILE: f%d.c>>>\n<<<SEARCH>>>\nint fn_%d_%d(int x) { return x + %d; }\n"
+                              "<<<REPLACE>>>\nint fn_%d_%d(int x) { return x - %d; }\n<<<END>>>\n",
+                              f, f, k, k, f, k, k);
+        }
+    }
+    buffer_append(out, "\n[end of text]\n\nllama_print_timings:        load time =  1000.00 ms\n");
+    return round;
+}
+
+static void bench_response(const BenchOptions *opt, const Buffer *raw) {
+    BenchRun run;
+    Buffer clean;
+    buffer_init(&clean);
+    char detail[64];
+    snprintf(detail, sizeof(detail), "%zu KB", raw->len / 1024);
+    
+    for (int r = 0; r < BENCH_REPS; r++) {
+        bench_start(&run, r);
+        extract_clean_response(raw->data, &clean);
+        bench_stop(&run, r);
+    }
+    bench_report("extract", detail, &run, 1);
+    
+    // The incremental parser, fed the way the CLI pipe delivers output
+    snprintf(detail, sizeof(detail), "%zu KB in 256 B reads", raw->len / 1024);
+    Buffer grow;
+    buffer_init(&grow);
+    for (int r = 0; r < BENCH_REPS; r++) {
+        ResponseParser rp;
+        response_parser_init(&rp);
+        buffer_clear(&grow);
+        bench_start(&run, r);
+        response_parser_reset(&rp, 0);
+        for (size_t off = 0; off < raw->len; off += 256) {
+            buffer_append_n(&grow, raw->data + off, raw->len - off < 256 ? raw->len - off : 256);
+            response_parser_feed(&rp, &grow, 0);
+        }
+        response_parser_finish(&rp, &grow);
+        bench_stop(&run, r);
+        response_parser_free(&rp);
+    }
+    bench_report("stream", detail, &run, 1);
+    buffer_free(&grow);
+    
+    int changes = 0;
+    snprintf(detail, sizeof(detail), "%zu KB", clean.len / 1024);
+    for (int r = 0; r < BENCH_REPS; r++) {
+        FileChange *fc = NULL;
+        int n = 0;
+        bench_start(&run, r);
+        parse_file_changes(clean.data, &fc, &n);
+        arena_reset(&turn_arena);
+        bench_stop(&run, r);
+        changes = n;
+    }
+    bench_report("parse", detail, &run, 1);
+    printf("          (%d file changes)\n", changes);
+    buffer_free(&clean);
+    (void)opt;
+}
+
+// Apply: hunks against BENCH_APPLY_FILES files, restored between runs
+static void bench_apply(const BenchOptions *opt, const Buffer *raw, int rounds) {
+    char dir[PATH_MAX_LEN];
+    snprintf(dir, sizeof(dir), "%s/apply", opt->dir);
+    mkdir(dir, 0755);
+    Config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    snprintf(cfg.workdir, sizeof(cfg.workdir), "%s", dir);
+    
+    Buffer clean, code;
+    buffer_init(&clean);
+    buffer_init(&code);
+    extract_clean_response(raw->data, &clean);
+    
+    BenchRun run;
+    int applied = 0, total = 0;
+    for (int r = 0; r < BENCH_REPS; r++) {
+        for (int f = 0; f < BENCH_APPLY_FILES; f++) {
+            char path[PATH_MAX_LEN + 32];
+            snprintf(path, sizeof(path), "%s/f%d.c", dir, f);
+            buffer_clear(&code);
+            bench_code(&code, f, (size_t)opt->file_bytes * 8 + (size_t)rounds * 3 * 48);
+            bench_write_file(path, code.data, code.len);
+        }
+        FileChange *fc = NULL;
+        int n = 0;
+        if (parse_file_changes(clean.data, &fc, &n) != 0) break;
+        bench_start(&run, r);
+        applied = apply_file_changes(&cfg, fc, n);
+        bench_stop(&run, r);
+        total = n;
+        arena_reset(&turn_arena);
+    }
+    char detail[64];
+    snprintf(detail, sizeof(detail), "%d/%d files", applied, total);
+    bench_report("apply", detail, &run, 1);
+    buffer_free(&clean);
+    buffer_free(&code);
+    
+    // A DIFF block keeps its ---/+++ header: parsed once, as one hunk
+    char path[PATH_MAX_LEN + 32];
+    snprintf(path, sizeof(path), "%s/diff.c", dir);
+    bench_write_file(path, "int a;\nint b;\nint c;\n", 21);
+    const char *reply = "<<<FILE: diff.c>>>\n<<<DIFF>>>\n--- a/diff.c\n+++ b/diff.c\n"
+                        "@@ -1,3 +1,3 @@\n int a;\n-int b;\n+int bb;\n int c;\n<<<END>>>\n";
+    FileChange *fc = NULL;
+    int n = 0;
+    if (parse_file_changes(reply, &fc, &n) != 0 || n != 1 || fc[0].num_hunks != 1 ||
+        apply_file_changes(&cfg, fc, n) != 1) {
+        printf("          (headered DIFF block: %d changes, %d hunks, %s)\n",
+               n, n > 0 ? fc[0].num_hunks : 0, n > 0 && fc[0].error[0] ? fc[0].error : "not applied");
+    }
+    arena_reset(&turn_arena);
+}
+
+// One request without the model: build the prompt, stream the reply
+// through the parser and extract its changes, then end the turn
+static void bench_turn(const BenchOptions *opt, const Buffer *raw) {
+    Config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    snprintf(cfg.workdir, sizeof(cfg.workdir), "%s", opt->dir);
+    snprintf(cfg.mode, sizeof(cfg.mode), "edit");
+    cfg.max_total = DEFAULT_MAX_TOTAL;
+    cfg.max_file = DEFAULT_MAX_FILE;
+    cfg.ctx_size = 32768;
+    cfg.n_predict = 4096;
+    
+    Buffer prompt, grow;
+    buffer_init(&prompt);
+    buffer_init(&grow);
+    build_enhanced_prompt(&cfg, "Rename the helpers", &prompt); // load the index
+    
+    BenchRun run;
+    int changes = 0;
+    for (int r = 0; r < BENCH_REPS; r++) {
+        bench_start(&run, r);
+        buffer_clear(&prompt);
+        build_enhanced_prompt(&cfg, "Rename the helpers", &prompt);
+        
+        ResponseParser rp;
+        response_parser_init(&rp);
+        buffer_clear(&grow);
+        for (size_t off = 0; off < raw->len; off += 4096) {
+            buffer_append_n(&grow, raw->data + off, raw->len - off < 4096 ? raw->len - off : 4096);
+            response_parser_feed(&rp, &grow, 0);
+        }
+        response_parser_finish(&rp, &grow);
+        
+        FileChange *fc = NULL;
+        int n = 0;
+        parse_file_changes(rp.clean.data, &fc, &n);
+        changes = n;
+        response_parser_free(&rp);
+        arena_reset(&turn_arena);
+        bench_stop(&run, r);
+    }
+    char detail[64];
+    snprintf(detail, sizeof(detail), "%zu KB prompt, %d changes", prompt.len / 1024, changes);
+    bench_report("turn", detail, &run, 1);
+    buffer_free(&prompt);
+    buffer_free(&grow);
+}
+
+static void bench_remove_tree(const char *path) {
+    char cmd[PATH_MAX_LEN + 16];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", path);
+    if (system(cmd) != 0) fprintf(stderr, "failed to remove %s\n", path);
+}
+
+int main(int argc, char **argv) {
+    BenchOptions opt = { .files = 100000, .file_bytes = 512, .output_kb = 256 };
+    snprintf(opt.dir, sizeof(opt.dir), "/tmp/loveme_bench_%d", getpid());
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) opt.files = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--file-bytes") == 0 && i + 1 < argc) opt.file_bytes = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--output-kb") == 0 && i + 1 < argc) opt.output_kb = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) strncpy(opt.output, argv[++i], sizeof(opt.output) - 1);
+        else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc) strncpy(opt.only, argv[++i], sizeof(opt.only) - 1);
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) strncpy(opt.dir, argv[++i], sizeof(opt.dir) - 1);
+        else if (strcmp(argv[i], "--keep") == 0) opt.keep = 1;
+        else {
+            fprintf(stderr, "Usage: %s [--files N] [--file-bytes N] [--output-kb N] [--output FILE]\n"
+                            "          [--only walk|ignore|context|buffer|classify|response|apply|turn] [--dir PATH] [--keep]\n", argv[0]);
+            return 2;
+        }
+    }
+    
+    // Keep the index, symbol and undo caches out of the real home directory
+    char home[PATH_MAX_LEN];
+    snprintf(home, sizeof(home), "%s/home", opt.dir);
+    mkdir(opt.dir, 0755);
+    mkdir(home, 0755);
+    setenv("HOME", home, 1);
+    
+    if (bench_enabled(&opt, "walk") || bench_enabled(&opt, "ignore") || bench_enabled(&opt, "context") ||
+        bench_enabled(&opt, "turn")) {
+        printf("Generating %d files of %d bytes under %s...\n", opt.files, opt.file_bytes, opt.dir);
+        if (bench_make_tree(&opt) != 0) {
+            perror("bench_make_tree");
+            return 1;
+        }
+    }
+    
+    Buffer raw;
+    buffer_init(&raw);
+    int rounds = 0;
+    if (opt.output[0]) {
+        char *data = read_file_content(opt.output, SIZE_MAX - 1);
+        if (!data) {
+            fprintf(stderr, "cannot read %s\n", opt.output);
+            return 1;
+        }
+        buffer_append(&raw, data);
+        free(data);
+    } else {
+        rounds = bench_make_output(&raw, (size_t)opt.output_kb * 1024);
+    }
+    
+    if (bench_enabled(&opt, "walk")) bench_walk(&opt);
+    if (bench_enabled(&opt, "ignore")) bench_ignore(&opt);
+    if (bench_enabled(&opt, "context")) bench_context(&opt);
+    if (bench_enabled(&opt, "context")) bench_dedup(&opt);
+    if (bench_enabled(&opt, "buffer")) bench_buffer();
+    if (bench_enabled(&opt, "classify")) bench_classify();
+    if (bench_enabled(&opt, "response")) bench_response(&opt, &raw);
+    if (bench_enabled(&opt, "apply") && !opt.output[0]) bench_apply(&opt, &raw, rounds);
+    if (bench_enabled(&opt, "turn")) bench_turn(&opt, &raw);
+    
+    buffer_free(&raw);
+    if (!opt.keep) bench_remove_tree(opt.dir);
+    return 0;
+}
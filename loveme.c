@@ -1,30 +1,68 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
 // Testing capabilities. Incomplete.
-// Build: gcc -std=c11 -O2 -Wall -Wextra -o devstral_agent devstral_agent.c -lncurses -ltinfo
+// Build: make (gcc -std=c11 -O2 -Wall -Wextra -o loveme loveme.c -lncurses -ltinfo -lpthread -lm)
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <time.h>
 #include <ctype.h>
+#include <math.h>
 #include <ncurses.h>
 #include <signal.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
 
 #define PATH_MAX_LEN 4096
 #define BUF_SIZE 8192
+#define ARENA_BLOCK_SIZE (256*1024)
 #define DEFAULT_MAX_TOTAL (4*1024*1024)
 #define DEFAULT_MAX_FILE  (512*1024)
 #define MAX_PLAN_FILES 256
 #define MAX_LINE 4096
-#define MAX_HISTORY 100
+#define HISTORY_RING 64                 // recent exchanges kept in memory
+#define HISTORY_ARENA_MAX (1024*1024)   // bytes of text they may use
+#define HISTORY_MAGIC 0x52485644u       // "DVHR"
+#define HISTORY_CONTEXT_TURNS 32        // exchanges considered for the prompt
+#define HISTORY_FULL_MAX 4096           // bytes; longer exchanges are only summarized
+#define HISTORY_BRIEF_MAX 400           // bytes of prose in a summary
 #define INPUT_HEIGHT 5
-#define MAX_FILES 1000
+#define MAX_PROMPT_LEN (64*1024) // bytes typed into the prompt editor
+#define MAX_FILES 1000 // entries listed in the prompt
+#define MAX_INDEX_FILES 200000
+#define SERVER_START_TIMEOUT 180 // seconds to wait for the model to load
+#define SERVER_MAX_RESTARTS 3
+#define GEN_REFRESH_MS 200      // redraw cadence while a reply streams in
+#define GEN_KILL_GRACE_MS 1000  // SIGTERM to SIGKILL for a stopped CLI
+#define TEST_DEFAULT_TIMEOUT 300      // seconds for the whole test run
+#define TEST_OUTPUT_MAX (1024*1024)   // bytes kept per run
+#define TEST_MAX_SHARDS 64
+#define TEST_MAX_ARGS 128
 
 typedef struct {
     char workdir[PATH_MAX_LEN];
@@ -33,14 +71,21 @@ typedef struct {
     char mode[32];
     char focus_file[PATH_MAX_LEN];
     char test_cmd[PATH_MAX_LEN];
+    char server[PATH_MAX_LEN]; // llama-server binary; empty = one-shot CLI
+    int server_port;    // 0 = a free port picked per instance
     size_t max_total;
     size_t max_file;
     size_t ctx_size;
     size_t n_predict;
+    size_t history_tokens; // slice of the prompt for conversation history; 0 = an eighth
     int apply_changes;
     int run_tests;
+    int test_timeout; // seconds; 0 = TEST_DEFAULT_TIMEOUT
+    int test_jobs;    // shards run at once; 0 = one per CPU
     int stream_output;
     int include_code;
+    char stop_seq[128]; // extra stop sequence for generation; empty = none
+    int stop_grace;     // opt-in fallback: reply bytes after the last edit block before stopping; 0 = never
 } Config;
 
 typedef struct {
@@ -49,37 +94,205 @@ typedef struct {
     size_t cap;
 } Buffer;
 
+// One exchange in the session log, followed by prompt '\0' response '\0'
 typedef struct {
-    char prompts[MAX_HISTORY][2048];
-    char responses[MAX_HISTORY][8192];
+    uint32_t magic;
+    uint32_t prompt_len;
+    uint32_t response_len;
+    uint32_t check; // hash of the fields above and time; detects torn records
+    int64_t time;
+} HistoryRecord;
+
+typedef struct {
+    uint32_t seq;        // exchange number
+    size_t off;          // of the prompt in the arena
+    uint32_t prompt_len, response_len;
+} HistoryEntry;
+
+// Compacted forms of one exchange, from richest to smallest
+typedef struct {
+    uint32_t seq_plus1;  // 0 = empty slot
+    char *full;          // prompt and response with file bodies replaced; NULL if too long
+    char *brief;         // prompt, leading prose and the files touched
+    char *line;          // one line
+} HistoryDigest;
+
+// Conversation history. Every exchange is appended to a per-workdir log
+// on disk (with an index of record offsets) and read back through a
+// mapping; the most recent ones are also kept in a ring whose text lives
+// in a circular arena.
+typedef struct {
+    char *arena;
+    size_t arena_cap, arena_head;
+    HistoryEntry ring[HISTORY_RING];
+    uint32_t ring_first, ring_count;
+    
+    char workdir[PATH_MAX_LEN];
+    int opened;
+    int log_fd, idx_fd;
+    char *map;
+    size_t map_len;
+    uint64_t *offsets;   // record offsets in the log
+    uint32_t logged, offsets_cap;
     int count;
-    int current;
+    HistoryDigest digests[HISTORY_CONTEXT_TURNS];
 } History;
 
+// What sampling a file's head found (see classify_sample)
+enum { CONTENT_UNKNOWN, CONTENT_TEXT, CONTENT_BINARY, CONTENT_MINIFIED, CONTENT_GENERATED, CONTENT_LOCKFILE };
+
 typedef struct {
-    char path[PATH_MAX_LEN];
+    char *path;
     size_t size;
     int is_dir;
+    int64_t mtime_ns;
+    uint64_t ino;
+    uint64_t hash; // content hash, 0 = not computed yet
+    int content; // CONTENT_* verdict, CONTENT_UNKNOWN = not sampled yet
+    int in_context; // body included in the current prompt
 } FileEntry;
 
 typedef struct {
-    FileEntry files[MAX_FILES];
+    FileEntry *files;
     int count;
+    int cap;
     int selected;
 } FileList;
 
+// Live state of the persistent repository index behind file_list
+typedef struct {
+    char workdir[PATH_MAX_LEN];
+    int loaded;
+    int dirty;        // needs saving
+    int64_t root_stamp; // dir_stamp() of the workdir at the last full walk
+    int inotify_fd;
+    char **watch_paths; // watch descriptor -> dir path relative to workdir
+    int watch_cap;
+} RepoIndex;
+
+// One edit inside a file: replace the lines matching search
+typedef struct {
+    char *search;   // empty = append (or create)
+    char *replace;
+    int line_hint;  // 1-based line from a diff header, 0 if unknown
+} EditHunk;
+
 typedef struct {
     char filepath[PATH_MAX_LEN];
-    char *content;
+    char *content;  // complete new content, or NULL when hunks are used
+    EditHunk *hunks;
+    int num_hunks;
     int applied;
+    char error[128];
 } FileChange;
 
+// Resident llama-server child reused across prompts
+typedef struct {
+    pid_t pid;
+    int port;
+    int failures; // consecutive start/health failures
+    int atexit_registered;
+    char model[PATH_MAX_LEN];
+    size_t ctx_size;
+} ModelServer;
+
+// Prompt layout and timing of the last generation
+typedef struct {
+    uint64_t prefix_hash; // system prompt + repository context
+    size_t prompt_bytes;
+    size_t prompt_tokens; // estimated
+    size_t budget_tokens;
+    int dropped_files;    // context candidates that did not fit
+    int skipped_files;    // candidates that are binary, minified, generated or lockfiles
+    int aliased_files;    // candidates listed by path only: copies of a body already included
+    int dropped_entries;  // structure lines not listed
+    int dropped_history;  // exchanges considered but left out
+    int compacted_history; // exchanges included only as a summary
+    char dropped[256];    // names of dropped files
+    long peak_rss_kb;     // after prompt build
+    double ttft_ms;
+    double prev_ttft_ms;
+} PromptStats;
+
+// Where one turn's time went. Times are monotonic milliseconds; token
+// counts come from the backend when it reports them, -1 otherwise.
+typedef struct {
+    double start;          // now_ms() at the start of the turn
+    double first_token_at; // 0 until the first generated token
+    double scan_ms;        // repository index refresh
+    double prompt_ms;      // prompt assembly, excluding the scan
+    double load_ms;        // model load (server start, or the CLI's load time)
+    double eval_ms;        // prompt evaluation
+    double ttft_ms;
+    double decode_ms;
+    double apply_ms;
+    double test_ms;
+    double total_ms;
+    long prompt_n, cached_n, decode_n;
+    double tok_per_s;      // decode speed
+    const char *backend;   // "server" or "cli"
+    int ok;
+} TurnTimings;
+
+// Incremental HTTP/1.1 response decoder for the server's SSE stream
+typedef struct {
+    int in_body;
+    int status;
+    int chunked;
+    int chunk_state; // 0=size line, 1=data, 2=trailing CRLF
+    size_t chunk_left;
+    Buffer line;     // partial header or chunk-size line
+    Buffer event;    // partial SSE line
+    int done;
+} HttpStream;
+
+// Scrollback model behind output_win: the text, its logical lines and the
+// rows they wrap to. Growth re-indexes only the last (unfinished) line, and
+// only screen rows whose content changed are repainted.
+enum { OUT_NORMAL, OUT_CODE, OUT_FILE };
+
+typedef struct {
+    uint32_t off, len;
+    uint32_t first_row;
+    uint8_t style;
+    uint8_t hidden; // ``` fences and end markers
+} OutputLine;
+
+typedef struct {
+    uint32_t line;
+    uint32_t off, len;
+} OutputRow;
+
+typedef struct {
+    Buffer text;
+    OutputLine *lines;
+    uint32_t nlines, lines_cap;
+    uint32_t complete;   // lines ending in '\n'
+    int in_code, in_file; // style state after the complete lines
+    OutputRow *rows;
+    uint32_t nrows, rows_cap;
+    int width;           // wrap width the rows were built for
+    uint32_t top;        // first row on screen
+    uint32_t drawn_top;  // top as last drawn
+    int follow;          // keep the newest rows in view
+    char stamp[16];
+    WINDOW *win;         // window the cache below refers to
+    uint64_t *shown;     // per screen row: signature of what is drawn
+    uint32_t shown_cap;
+} OutputView;
+
 static WINDOW *config_win, *prompt_win, *output_win, *status_win, *file_win;
+static int batch_verbose = 0; // batch mode: echo status messages to stderr
 static Config global_cfg;
-static History history = {0};
+static History history = { .log_fd = -1, .idx_fd = -1 };
 static FileList file_list = {0};
+static RepoIndex repo_index = { .inotify_fd = -1 };
 static int should_exit = 0;
 static int ui_mode = 0; // 0=normal, 1=file_browser
+static ModelServer model_server = { .pid = -1 };
+static PromptStats prompt_stats = {0};
+static TurnTimings turn_timings = {0}, last_turn = {0}; // in progress, last finished
+static OutputView output_view = {0};
 
 // Colors
 enum {
@@ -108,7 +321,10 @@ static void cleanup_ncurses(void) {
     endwin();
 }
 
+static void gen_signal_cleanup(void);
+
 static void signal_handler(int sig) {
+    gen_signal_cleanup();
     cleanup_ncurses();
     exit(sig);
 }
@@ -128,6 +344,14 @@ static void buffer_free(Buffer *b) {
     b->len = b->cap = 0; 
 }
 
+// Hand the contents to the caller, who frees them
+static char *buffer_detach(Buffer *b) {
+    char *s = b->data;
+    b->data = NULL;
+    b->len = b->cap = 0;
+    return s;
+}
+
 static void buffer_clear(Buffer *b) { 
     b->len = 0; 
     b->data[0] = '\0'; 
@@ -142,24 +366,195 @@ static void buffer_ensure_capacity(Buffer *b, size_t needed) {
     }
 }
 
-static void buffer_append(Buffer *b, const char *s) {
-    size_t sl = strlen(s);
+static void buffer_append_n(Buffer *b, const char *s, size_t sl) {
     buffer_ensure_capacity(b, sl);
     memcpy(b->data + b->len, s, sl);
     b->len += sl;
     b->data[b->len] = '\0';
 }
 
+static void buffer_append(Buffer *b, const char *s) {
+    buffer_append_n(b, s, strlen(s));
+}
+
+// Formats in place; a result that does not fit the spare capacity grows
+// the buffer and is formatted again, so nothing is truncated
 static void buffer_append_fmt(Buffer *b, const char *fmt, ...) {
-    va_list ap;
+    va_list ap, again;
     va_start(ap, fmt);
-    char tmp[BUF_SIZE];
-    vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_copy(again, ap);
+    size_t room = b->cap - b->len;
+    int n = vsnprintf(b->data + b->len, room, fmt, ap);
     va_end(ap);
-    buffer_append(b, tmp);
+    if (n >= 0 && (size_t)n >= room) {
+        buffer_ensure_capacity(b, (size_t)n);
+        vsnprintf(b->data + b->len, (size_t)n + 1, fmt, again);
+    }
+    va_end(again);
+    if (n > 0) b->len += (size_t)n;
+    b->data[b->len] = '\0';
+}
+
+// Misc helpers
+static uint64_t hash_bytes(const void *data, size_t len, uint64_t h) {
+    // FNV-1a
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+// File contents: 8 bytes per step where hash_bytes() takes one. Never 0,
+// which marks a hash not computed yet.
+static uint64_t hash_content(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t h = HASH_SEED ^ (len * 0x9e3779b97f4a7c15ULL);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 29;
+    }
+    h = hash_bytes(p + i, len - i, h);
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void *grow_array(void *p, uint32_t *cap, uint32_t need, size_t elem) {
+    if (need <= *cap) return p;
+    uint32_t newcap = *cap ? *cap : 16;
+    while (newcap < need) newcap *= 2;
+    p = realloc(p, elem * newcap);
+    if (!p) die("realloc");
+    *cap = newcap;
+    return p;
+}
+
+// Open-addressing slot table, all empty (-1)
+static int *slots_new(size_t n) {
+    int *slots = malloc(sizeof(int) * n);
+    if (!slots) die("malloc");
+    memset(slots, -1, sizeof(int) * n);
+    return slots;
+}
+
+// Per-turn bump allocator. Parsed changes, hunk text and the line tables
+// used to anchor hunks come from turn_arena and are released together by
+// arena_reset() when the turn ends. Reset keeps one block big enough for
+// the whole turn, so a steady stream of similar turns stops calling malloc.
+typedef struct ArenaBlock {
+    struct ArenaBlock *next; // older blocks
+    size_t cap;
+    size_t used;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+    size_t allocs;      // this turn: allocations served
+    size_t bytes;       // this turn: bytes handed out
+    size_t blocks;      // this turn: blocks taken from malloc
+    void *last;         // most recent allocation, which can grow in place
+} Arena;
+
+#define ARENA_ALIGN 16
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static Arena turn_arena = {0};
+
+static void *arena_alloc(Arena *a, size_t n) {
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock *b = a->head;
+    if (!b || b->cap - b->used < n) {
+        size_t cap = b ? b->cap * 2 : ARENA_BLOCK_SIZE;
+        while (cap < n) cap *= 2;
+        b = malloc(ARENA_HEADER + cap);
+        if (!b) die("malloc");
+        b->cap = cap;
+        b->used = 0;
+        b->next = a->head;
+        a->head = b;
+        a->blocks++;
+    }
+    void *p = (char *)b + ARENA_HEADER + b->used;
+    b->used += n;
+    a->allocs++;
+    a->bytes += n;
+    a->last = p;
+    return p;
+}
+
+// realloc() for arena memory: the latest allocation grows in place
+static void *arena_grow(Arena *a, void *p, size_t old, size_t n) {
+    if (p && p == a->last) {
+        ArenaBlock *b = a->head;
+        size_t at = (size_t)((char *)p - ((char *)b + ARENA_HEADER));
+        size_t want = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if (at + want <= b->cap) {
+            a->bytes += at + want - b->used;
+            b->used = at + want;
+            return p;
+        }
+    }
+    void *q = arena_alloc(a, n);
+    if (p) memcpy(q, p, old < n ? old : n);
+    return q;
+}
+
+static char *arena_strndup(Arena *a, const char *s, size_t n) {
+    char *d = arena_alloc(a, n + 1);
+    memcpy(d, s, n);
+    d[n] = '\0';
+    return d;
+}
+
+// Release everything; a turn that needed several blocks leaves one block
+// of the combined size for the next
+static void arena_reset(Arena *a) {
+    if (a->head && a->head->next) {
+        size_t total = 0;
+        while (a->head) {
+            ArenaBlock *next = a->head->next;
+            total += a->head->cap;
+            free(a->head);
+            a->head = next;
+        }
+        a->head = malloc(ARENA_HEADER + total);
+        if (!a->head) die("malloc");
+        a->head->cap = total;
+        a->head->next = NULL;
+    }
+    if (a->head) a->head->used = 0;
+    a->allocs = a->bytes = a->blocks = 0;
+    a->last = NULL;
+}
+
+// Per-user cache directory ($HOME/.devstral_cache)
+static int cache_dir(char *out, size_t len) {
+    int n = snprintf(out, len, "%s/.devstral_cache", getenv("HOME") ?: ".");
+    if (n < 0 || (size_t)n >= len) return -1;
+    if (mkdir(out, 0700) != 0 && errno != EEXIST) return -1;
+    return 0;
 }
 
 // File helpers
+static int path_join(char *out, size_t len, const char *dir, const char *name) {
+    int n = snprintf(out, len, "%s%s%s", dir, dir[0] && name[0] ? "/" : "", name);
+    return n < 0 || (size_t)n >= len ? -1 : 0;
+}
+
 static int ends_with(const char *s, const char *suf) {
     size_t ls = strlen(s), lf = strlen(suf);
     return lf <= ls && strcmp(s + ls - lf, suf) == 0;
@@ -175,20 +570,6 @@ static int is_code_file(const char *path) {
     return 0;
 }
 
-static int should_ignore(const char *name) {
-    // Ignore common non-source directories and files
-    const char *ignore[] = {"node_modules", ".git", ".svn", "__pycache__", 
-        ".pytest_cache", "dist", "build", "target", ".next", ".vscode",
-        ".idea", "*.pyc", "*.o", "*.so", "*.dll", "*.exe", ".DS_Store"};
-    
-    for (size_t i = 0; i < sizeof(ignore) / sizeof(ignore[0]); i++) {
-        if (strcmp(name, ignore[i]) == 0) return 1;
-        // Handle wildcards
-        if (ignore[i][0] == '*' && ends_with(name, ignore[i] + 1)) return 1;
-    }
-    return 0;
-}
-
 // Read file content
 static char* read_file_content(const char *path, size_t max_size) {
     FILE *f = fopen(path, "r");
@@ -216,325 +597,4432 @@ static char* read_file_content(const char *path, size_t max_size) {
     return content;
 }
 
-// Write file content
-static int write_file_content(const char *path, const char *content) {
-    // Create backup
-    char backup_path[PATH_MAX_LEN];
-    snprintf(backup_path, sizeof(backup_path), "%s.bak", path);
+// Content-addressed object store for replaced file contents:
+// ~/.devstral_cache/objects/xx/<id>, shared by all repositories.
+#define OBJECT_ID_LEN 32
+
+static void object_id(const void *data, size_t len, char out[OBJECT_ID_LEN + 1]) {
+    snprintf(out, OBJECT_ID_LEN + 1, "%016llx%016llx",
+             (unsigned long long)hash_bytes(data, len, HASH_SEED),
+             (unsigned long long)hash_bytes(data, len, ~HASH_SEED));
+}
+
+static int object_path(const char *id, char *out, size_t len) {
+    char dir[PATH_MAX_LEN];
+    if (cache_dir(dir, sizeof(dir)) != 0 || path_join(out, len, dir, "objects") != 0) return -1;
+    mkdir(out, 0700);
+    size_t n = strlen(out);
+    int m = snprintf(out + n, len - n, "/%.2s", id);
+    if (m < 0 || (size_t)m >= len - n) return -1;
+    if (mkdir(out, 0700) != 0 && errno != EEXIST) return -1;
+    n += m;
+    m = snprintf(out + n, len - n, "/%s", id + 2);
+    return m < 0 || (size_t)m >= len - n ? -1 : 0;
+}
+
+// Keep the content of (dirfd, name), which hashes to id, before it is
+// replaced: a hard link to the outgoing inode when the cache shares the
+// filesystem, else a reflink, else a copy of data
+static int object_store(const char *id, int dirfd, const char *name, const char *data, size_t len) {
+    char path[PATH_MAX_LEN];
+    if (object_path(id, path, sizeof(path)) != 0) return -1;
+    if (access(path, F_OK) == 0) return 0; // deduplicated
+    if (linkat(dirfd, name, AT_FDCWD, path, 0) == 0) return 0;
     
-    // Read original for backup
-    char *original = read_file_content(path, DEFAULT_MAX_FILE * 10);
-    if (original) {
-        FILE *backup = fopen(backup_path, "w");
-        if (backup) {
-            fputs(original, backup);
-            fclose(backup);
-        }
-        free(original);
+    char tmp[PATH_MAX_LEN + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0400);
+    if (fd < 0) return -1;
+    int ok = 0;
+#ifdef __linux__
+    int src = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (src >= 0) {
+        ok = ioctl(fd, FICLONE, src) == 0;
+        close(src);
+    }
+#endif
+    size_t off = 0;
+    while (!ok && off < len) {
+        ssize_t n = write(fd, data + off, len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += (size_t)n;
+    }
+    if (!ok) ok = off == len;
+    if (close(fd) != 0 || !ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
     }
-    
-    // Write new content
-    FILE *f = fopen(path, "w");
-    if (!f) return -1;
-    
-    fputs(content, f);
-    fclose(f);
     return 0;
 }
 
-// Recursive directory scanning
-static void scan_directory(const char *path, FileList *list, const char *base_path, int depth) {
-    if (depth > 5) return; // Limit recursion depth
-    if (list->count >= MAX_FILES) return;
-    
-    DIR *d = opendir(path);
-    if (!d) return;
-    
-    struct dirent *ent;
-    while ((ent = readdir(d)) && list->count < MAX_FILES) {
-        if (ent->d_name[0] == '.') continue;
-        if (should_ignore(ent->d_name)) continue;
-        
-        char full[PATH_MAX_LEN];
-        snprintf(full, sizeof(full), "%s/%s", path, ent->d_name);
-        
-        struct stat st;
-        if (stat(full, &st) != 0) continue;
-        
-        // Calculate relative path
-        char rel[PATH_MAX_LEN];
-        if (strlen(full) > strlen(base_path) + 1) {
-            strcpy(rel, full + strlen(base_path) + 1);
-        } else {
-            strcpy(rel, ent->d_name);
-        }
-        
-        if (S_ISDIR(st.st_mode)) {
-            // Add directory entry
-            strcpy(list->files[list->count].path, rel);
-            list->files[list->count].size = 0;
-            list->files[list->count].is_dir = 1;
-            list->count++;
-            
-            // Recurse
-            scan_directory(full, list, base_path, depth + 1);
-        } else if (S_ISREG(st.st_mode) && is_code_file(ent->d_name)) {
-            strcpy(list->files[list->count].path, rel);
-            list->files[list->count].size = st.st_size;
-            list->files[list->count].is_dir = 0;
-            list->count++;
-        }
+// Read a stored object; NULL if missing
+static char *object_load(const char *id, size_t *len) {
+    char path[PATH_MAX_LEN];
+    if (object_path(id, path, sizeof(path)) != 0) return NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fd, &st) == 0 && (data = malloc((size_t)st.st_size + 1)) != NULL) {
+        size_t off = 0;
+        ssize_t n;
+        while (off < (size_t)st.st_size && (n = read(fd, data + off, (size_t)st.st_size - off)) > 0) off += (size_t)n;
+        data[off] = '\0';
+        *len = off;
     }
-    closedir(d);
+    close(fd);
+    return data;
 }
 
-// Build repository context with actual code
-static void build_repo_context(const Config *cfg, Buffer *ctx, int include_code) {
-    buffer_append_fmt(ctx, "Repository root: %s\n\n", cfg->workdir);
-    
-    // Scan files
-    file_list.count = 0;
-    scan_directory(cfg->workdir, &file_list, cfg->workdir, 0);
-    
-    buffer_append(ctx, "## Repository Structure:\n");
-    
-    size_t total_added = 0;
-    for (int i = 0; i < file_list.count && total_added < cfg->max_total; i++) {
-        FileEntry *fe = &file_list.files[i];
-        
-        if (fe->is_dir) {
-            buffer_append_fmt(ctx, "📁 %s/\n", fe->path);
-        } else {
-            buffer_append_fmt(ctx, "📄 %s (%zu bytes)\n", fe->path, fe->size);
-            
-            // Include actual code if requested and file is focused or small enough
-            if (include_code && fe->size < cfg->max_file) {
-                int include_this = 0;
-                
-                // Always include focused file
-                if (strlen(cfg->focus_file) > 0 && strstr(fe->path, cfg->focus_file)) {
-                    include_this = 1;
-                }
-                // Include small important files
-                else if (fe->size < 10000 && (ends_with(fe->path, ".h") || 
-                         ends_with(fe->path, "README.md") || 
-                         ends_with(fe->path, "Makefile") ||
-                         ends_with(fe->path, "CMakeLists.txt") ||
-                         ends_with(fe->path, "package.json"))) {
-                    include_this = 1;
-                }
-                
-                if (include_this && total_added + fe->size < cfg->max_total) {
-                    char full_path[PATH_MAX_LEN];
-                    snprintf(full_path, sizeof(full_path), "%s/%s", cfg->workdir, fe->path);
-                    
-                    char *content = read_file_content(full_path, cfg->max_file);
-                    if (content) {
-                        buffer_append_fmt(ctx, "\n### File: %s\n```\n", fe->path);
-                        buffer_append(ctx, content);
-                        buffer_append(ctx, "\n```\n\n");
-                        total_added += strlen(content);
-                        free(content);
-                    }
-                }
-            }
-        }
+// Write file content. A batch of files lands all or nothing: each is
+// written to a temporary next to its target, and only when every file is
+// ready are they renamed into place. Replaced contents go to the object
+// store so the batch can be undone. Directories are synced once at the end.
+typedef struct {
+    int dirfd;
+    int own_fd;            // first user of dirfd closes it
+    char dir[PATH_MAX_LEN]; // relative to the root, "" for the root itself
+    char name[PATH_MAX_LEN];
+    char tmp[64];
+    int remove;            // delete instead of write
+    int existed;
+    mode_t mode;
+    char *old_map;         // outgoing content, mapped
+    size_t old_len;
+    char old_id[OBJECT_ID_LEN + 1]; // "" when the file did not exist
+    char new_id[OBJECT_ID_LEN + 1]; // "" when removed
+    int renamed;
+} StagedWrite;
+
+typedef struct {
+    int rootfd;
+    StagedWrite *items;
+    uint32_t count, cap;
+    char error[128];
+} WriteBatch;
+
+static int write_batch_begin(WriteBatch *wb, const char *root) {
+    memset(wb, 0, sizeof(*wb));
+    wb->rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (wb->rootfd < 0) {
+        snprintf(wb->error, sizeof(wb->error), "cannot open %.100s", root);
+        return -1;
     }
-    
-    buffer_append_fmt(ctx, "\nTotal files: %d\n", file_list.count);
+    return 0;
 }
 
-// Enhanced prompt building
-static void append_system_prompt(Buffer *out, const Config *cfg) {
-    buffer_append(out,
-        "<|system|>\n"
-        "You are Devstral, an advanced repository agent specialized in code analysis and modification.\n\n"
-        "Core Capabilities:\n"
-        "- Comprehensive code analysis with architectural insights\n"
-        "- Precise file modifications with context awareness\n"
-        "- Test-driven development support\n"
-        "- Refactoring and optimization suggestions\n\n");
-    
-    if (strcmp(cfg->mode, "edit") == 0) {
-        buffer_append(out,
-            "EDIT MODE - Output format for file changes:\n"
-            "<<<FILE: path/to/file.ext>>>\n"
-            "<<<REPLACEMENT_START>>>\n"
-            "complete new file content here\n"
-            "<<<REPLACEMENT_END>>>\n\n"
-            "- Always output complete file content\n"
-            "- Multiple files can be edited in one response\n"
-            "- Include clear explanations before changes\n\n");
-    } else if (strcmp(cfg->mode, "agent") == 0) {
-        buffer_append(out,
-            "AGENT MODE - Autonomous problem solving:\n"
-            "1. Analyze the repository structure and understand the codebase\n"
-            "2. Create a detailed plan with specific steps\n"
-            "3. Implement changes systematically\n"
-            "4. Suggest tests and validation steps\n"
-            "5. Provide file modifications in EDIT format when needed\n\n");
+// Open dir (relative to rootfd), creating missing components
+static int mkdir_p_at(int rootfd, const char *dir) {
+    int fd = dup(rootfd);
+    char copy[PATH_MAX_LEN];
+    snprintf(copy, sizeof(copy), "%s", dir);
+    char *save = NULL;
+    for (char *comp = strtok_r(copy, "/", &save); comp && fd >= 0; comp = strtok_r(NULL, "/", &save)) {
+        if (mkdirat(fd, comp, 0755) != 0 && errno != EEXIST) {
+            close(fd);
+            return -1;
+        }
+        int next = openat(fd, comp, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+        fd = next;
     }
-    
-    buffer_append(out, "<|endofsystem|>\n\n");
+    return fd;
 }
 
-static void build_conversation_context(Buffer *out) {
-    if (history.count > 0) {
-        buffer_append(out, "<|conversation_history|>\n");
-        
-        // Include last 3 exchanges for context
-        int start = history.count > 3 ? history.count - 3 : 0;
-        for (int i = start; i < history.count; i++) {
-            buffer_append_fmt(out, "User: %s\n", history.prompts[i]);
-            if (strlen(history.responses[i]) > 500) {
-                // Truncate long responses
-                char truncated[500];
-                strncpy(truncated, history.responses[i], 497);
-                truncated[497] = '\0';
-                buffer_append_fmt(out, "Assistant: %s...\n\n", truncated);
-            } else {
-                buffer_append_fmt(out, "Assistant: %s\n\n", history.responses[i]);
-            }
-        }
-        buffer_append(out, "<|endofhistory|>\n\n");
+// Write data to name in dirfd through a temporary; the temporary's name is left in tmp
+static int write_temp_at(int dirfd, const char *tmp, const char *data, size_t len, mode_t mode) {
+    int fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if (fd < 0) return -1;
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(fd, data + off, len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += (size_t)n;
     }
+    int ok = off == len && fchmod(fd, mode) == 0 && fsync(fd) == 0;
+    if (close(fd) != 0) ok = 0;
+    return ok ? 0 : -1;
 }
 
-static void build_enhanced_prompt(const Config *cfg, const char *task, Buffer *out) {
-    append_system_prompt(out, cfg);
-    
-    // Add conversation history for context
-    build_conversation_context(out);
+// Stage rel's new content (or its removal when content is NULL); nothing is
+// visible until write_batch_commit(). mode 0 keeps the current permissions.
+static int write_batch_add(WriteBatch *wb, const char *rel, const char *content, size_t len, mode_t mode) {
+    // Stay inside the root
+    int bad = rel[0] == '\0' || rel[0] == '/' || strchr(rel, '\n') != NULL;
+    for (const char *c = rel; !bad && (c = strstr(c, "..")) != NULL; c += 2) {
+        bad = (c == rel || c[-1] == '/') && (c[2] == '/' || c[2] == '\0');
+    }
+    if (bad) {
+        snprintf(wb->error, sizeof(wb->error), "refusing path %s", rel);
+        return -1;
+    }
     
-    // Add repository context
-    Buffer repo;
-    buffer_init(&repo);
-    build_repo_context(cfg, &repo, cfg->include_code);
+    wb->items = grow_array(wb->items, &wb->cap, wb->count + 1, sizeof(StagedWrite));
+    StagedWrite *sw = &wb->items[wb->count];
+    memset(sw, 0, sizeof(*sw));
+    const char *slash = strrchr(rel, '/');
+    snprintf(sw->dir, sizeof(sw->dir), "%.*s", slash ? (int)(slash - rel) : 0, rel);
+    snprintf(sw->name, sizeof(sw->name), "%s", slash ? slash + 1 : rel);
+    snprintf(sw->tmp, sizeof(sw->tmp), ".devstral-%d-%u.tmp", (int)getpid(), wb->count);
+    sw->remove = content == NULL;
     
-    buffer_append(out, "<|repository_context|>\n");
-    buffer_append(out, repo.data);
-    buffer_append(out, "<|endofcontext|>\n\n");
+    sw->dirfd = -1;
+    for (uint32_t i = 0; i < wb->count; i++) {
+        if (strcmp(wb->items[i].dir, sw->dir) == 0) {
+            sw->dirfd = wb->items[i].dirfd;
+            break;
+        }
+    }
+    if (sw->dirfd < 0) {
+        sw->dirfd = mkdir_p_at(wb->rootfd, sw->dir);
+        sw->own_fd = 1;
+        if (sw->dirfd < 0) {
+            snprintf(wb->error, sizeof(wb->error), "cannot create directory for %s", rel);
+            return -1;
+        }
+    }
     
-    // Add user query
-    buffer_append(out, "<|user|>\n");
-    buffer_append_fmt(out, "%s\n", task);
-    buffer_append(out, "<|endofuser|>\n\n");
+    // Map what is being replaced: its id for the journal, its bytes for rollback
+    sw->mode = mode ? mode : 0644;
+    int fd = openat(sw->dirfd, sw->name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        sw->existed = 1;
+        if (!mode) sw->mode = st.st_mode & 07777;
+        sw->old_len = (size_t)st.st_size;
+        if (st.st_size > 0) {
+            sw->old_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (sw->old_map == MAP_FAILED) sw->old_map = NULL;
+        }
+        object_id(sw->old_map ? sw->old_map : "", sw->old_map ? sw->old_len : 0, sw->old_id);
+        if (st.st_size > 0 && !sw->old_map) {
+            close(fd);
+            snprintf(wb->error, sizeof(wb->error), "cannot read %s", rel);
+            if (sw->own_fd) close(sw->dirfd);
+            return -1;
+        }
+    }
+    if (fd >= 0) close(fd);
     
-    // Add assistant tag for response
-    buffer_append(out, "<|assistant|>\n");
+    if (sw->remove) {
+        wb->count++;
+        return 0;
+    }
     
-    buffer_free(&repo);
+    object_id(content, len, sw->new_id);
+    if (write_temp_at(sw->dirfd, sw->tmp, content, len, sw->mode) != 0) {
+        snprintf(wb->error, sizeof(wb->error), "cannot write %s: %s", rel, strerror(errno));
+        unlinkat(sw->dirfd, sw->tmp, 0);
+        if (sw->old_map) munmap(sw->old_map, sw->old_len);
+        if (sw->own_fd) close(sw->dirfd);
+        return -1;
+    }
+    wb->count++;
+    return 0;
 }
 
-// Parse file changes from response
-static int parse_file_changes(const char *response, FileChange **changes, int *num_changes) {
-    *num_changes = 0;
-    *changes = malloc(sizeof(FileChange) * MAX_PLAN_FILES);
-    if (!*changes) return -1;
-    
-    const char *p = response;
-    while ((p = strstr(p, "<<<FILE:")) != NULL) {
-        p += 8; // Skip "<<<FILE:"
-        while (*p == ' ') p++;
-        
-        // Extract filename
-        const char *end = strstr(p, ">>>");
-        if (!end) break;
-        
-        size_t len = end - p;
-        if (len >= PATH_MAX_LEN) {
-            p = end + 3;
-            continue;
-        }
-        
-        FileChange *change = &(*changes)[*num_changes];
-        strncpy(change->filepath, p, len);
-        change->filepath[len] = '\0';
-        change->applied = 0;
-        
-        // Find replacement content
-        p = strstr(end, "<<<REPLACEMENT_START>>>");
-        if (!p) break;
-        p += 23; // Skip marker
-        if (*p == '\n') p++; // Skip newline
-        
-        const char *content_end = strstr(p, "<<<REPLACEMENT_END>>>");
-        if (!content_end) break;
-        
-        len = content_end - p;
-        change->content = malloc(len + 1);
-        if (!change->content) break;
-        
-        strncpy(change->content, p, len);
-        change->content[len] = '\0';
-        
-        (*num_changes)++;
-        if (*num_changes >= MAX_PLAN_FILES) break;
-        
-        p = content_end + 20; // Skip end marker
+static void write_batch_close(WriteBatch *wb) {
+    for (uint32_t i = 0; i < wb->count; i++) {
+        if (wb->items[i].old_map) munmap(wb->items[i].old_map, wb->items[i].old_len);
+        if (wb->items[i].own_fd) close(wb->items[i].dirfd);
     }
-    
-    return *num_changes > 0 ? 0 : -1;
+    if (wb->rootfd >= 0) close(wb->rootfd);
+    free(wb->items);
+    wb->items = NULL;
+    wb->count = wb->cap = 0;
+    wb->rootfd = -1;
 }
 
-// Apply file changes
-static int apply_file_changes(const Config *cfg, FileChange *changes, int num_changes) {
-    int success_count = 0;
-    
-    for (int i = 0; i < num_changes; i++) {
-        char full_path[PATH_MAX_LEN];
-        snprintf(full_path, sizeof(full_path), "%s/%s", cfg->workdir, changes[i].filepath);
-        
-        // Create directories if needed
-        char *path_copy = strdup(full_path);
-        char *dir = dirname(path_copy);
-        
-        char mkdir_cmd[PATH_MAX_LEN];
-        snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", dir);
-        system(mkdir_cmd);
-        free(path_copy);
-        
-        if (write_file_content(full_path, changes[i].content) == 0) {
-            changes[i].applied = 1;
-            success_count++;
-        }
+static void write_batch_abort(WriteBatch *wb) {
+    for (uint32_t i = 0; i < wb->count; i++) {
+        if (!wb->items[i].renamed && !wb->items[i].remove) unlinkat(wb->items[i].dirfd, wb->items[i].tmp, 0);
     }
-    
-    return success_count;
+    write_batch_close(wb);
 }
 
-// Run tests
-static int run_tests(const Config *cfg, Buffer *output) {
-    if (strlen(cfg->test_cmd) == 0) {
-        buffer_append(output, "No test command configured.\n");
-        return -1;
+// Put every staged file in place, keeping each outgoing content in the
+// object store, then sync each directory once. On failure, files already
+// replaced are put back and -1 is returned. On success the items stay
+// readable (for the journal) until write_batch_close().
+static int write_batch_commit(WriteBatch *wb) {
+    uint32_t i = 0;
+    for (; i < wb->count; i++) {
+        StagedWrite *sw = &wb->items[i];
+        if (sw->existed && object_store(sw->old_id, sw->dirfd, sw->name, sw->old_map, sw->old_len) != 0) {
+            snprintf(wb->error, sizeof(wb->error), "cannot save undo copy of %.64s", sw->name);
+            break;
+        }
+        int rc = sw->remove ? (sw->existed ? unlinkat(sw->dirfd, sw->name, 0) : 0)
+                            : renameat(sw->dirfd, sw->tmp, sw->dirfd, sw->name);
+        if (rc != 0) {
+            snprintf(wb->error, sizeof(wb->error), "cannot replace %.64s: %s", sw->name, strerror(errno));
+            break;
+        }
+        sw->renamed = 1;
     }
     
-    buffer_append_fmt(output, "Running tests: %s\n", cfg->test_cmd);
-    buffer_append(output, "─────────────────────────────\n");
-    
-    FILE *pipe = popen(cfg->test_cmd, "r");
-    if (!pipe) {
-        buffer_append(output, "Failed to run test command.\n");
+    if (i < wb->count) {
+        while (i-- > 0) {
+            StagedWrite *sw = &wb->items[i];
+            if (!sw->existed) {
+                unlinkat(sw->dirfd, sw->name, 0);
+            } else if (write_temp_at(sw->dirfd, sw->tmp, sw->old_map ? sw->old_map : "",
+                                     sw->old_len, sw->mode) == 0) {
+                renameat(sw->dirfd, sw->tmp, sw->dirfd, sw->name);
+            }
+            sw->renamed = 0;
+        }
+        write_batch_abort(wb);
         return -1;
     }
     
-    char line[1024];
-    while (fgets(line, sizeof(line), pipe)) {
-        buffer_append(output, line);
+    for (i = 0; i < wb->count; i++) {
+        if (wb->items[i].own_fd) fsync(wb->items[i].dirfd);
     }
-    
-    int status = pclose(pipe);
-    int exit_code = WEXITSTATUS(status);
-    
-    buffer_append(output, "─────────────────────────────\n");
-    buffer_append_fmt(output, "Tests %s (exit code: %d)\n", 
-                     exit_code == 0 ? "PASSED" : "FAILED", exit_code);
-    
-    return exit_code;
+    fsync(wb->rootfd); // new directories
+    return 0;
 }
 
-// Enhanced response extraction
+// Undo journal: ~/.devstral_cache/journal-<workdir hash>.log, append-only.
+//   T <seq> <time> <files>                 a batch was applied, followed by
+//   F <old id|-> <new id|-> <mode> <path>  one line per file
+//   U <seq> / R <seq>                      the batch was undone / redone
+// Applying a new batch after undos drops the turns that could be redone.
+typedef struct {
+    char path[PATH_MAX_LEN];
+    char old_id[OBJECT_ID_LEN + 1]; // "" = did not exist
+    char new_id[OBJECT_ID_LEN + 1]; // "" = removed
+    unsigned mode;
+} JournalEntry;
+
+typedef struct {
+    uint32_t seq;
+    uint32_t first, count; // entries
+} JournalTurn;
+
+typedef struct {
+    char workdir[PATH_MAX_LEN];
+    int loaded;
+    JournalEntry *entries;
+    uint32_t nentries, entries_cap;
+    JournalTurn *turns;
+    uint32_t nturns, turns_cap;
+    uint32_t applied; // turns[0, applied) are in effect, the rest can be redone
+    uint32_t next_seq;
+} UndoJournal;
+
+static UndoJournal journal = {0};
+
+static int journal_path(const char *workdir, char *out, size_t len) {
+    char dir[PATH_MAX_LEN], name[64];
+    if (cache_dir(dir, sizeof(dir)) != 0) return -1;
+    snprintf(name, sizeof(name), "journal-%016llx.log",
+             (unsigned long long)hash_bytes(workdir, strlen(workdir), HASH_SEED));
+    return path_join(out, len, dir, name);
+}
+
+static JournalTurn *journal_begin_turn(uint32_t seq) {
+    // A new turn forgets everything that was undone
+    journal.nturns = journal.applied;
+    journal.nentries = journal.nturns ? journal.turns[journal.nturns - 1].first +
+                                        journal.turns[journal.nturns - 1].count : 0;
+    journal.turns = grow_array(journal.turns, &journal.turns_cap, journal.nturns + 1, sizeof(JournalTurn));
+    JournalTurn *t = &journal.turns[journal.nturns++];
+    t->seq = seq;
+    t->first = journal.nentries;
+    t->count = 0;
+    journal.applied = journal.nturns;
+    if (seq >= journal.next_seq) journal.next_seq = seq + 1;
+    return t;
+}
+
+static void journal_add_entry(JournalTurn *t, const char *old_id, const char *new_id, unsigned mode, const char *path) {
+    journal.entries = grow_array(journal.entries, &journal.entries_cap, journal.nentries + 1, sizeof(JournalEntry));
+    JournalEntry *e = &journal.entries[journal.nentries++];
+    snprintf(e->old_id, sizeof(e->old_id), "%s", strcmp(old_id, "-") == 0 ? "" : old_id);
+    snprintf(e->new_id, sizeof(e->new_id), "%s", strcmp(new_id, "-") == 0 ? "" : new_id);
+    snprintf(e->path, sizeof(e->path), "%s", path);
+    e->mode = mode;
+    t->count++;
+}
+
+static void journal_load(const char *workdir) {
+    if (journal.loaded && strcmp(journal.workdir, workdir) == 0) return;
+    free(journal.entries);
+    free(journal.turns);
+    memset(&journal, 0, sizeof(journal));
+    snprintf(journal.workdir, sizeof(journal.workdir), "%s", workdir);
+    journal.loaded = 1;
+    
+    char path[PATH_MAX_LEN];
+    if (journal_path(workdir, path, sizeof(path)) != 0) return;
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    
+    char line[PATH_MAX_LEN + 128];
+    JournalTurn *t = NULL;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        unsigned seq, mode;
+        char old_id[OBJECT_ID_LEN + 1], new_id[OBJECT_ID_LEN + 1];
+        int off = 0;
+        if (sscanf(line, "T %u", &seq) == 1) {
+            t = journal_begin_turn(seq);
+        } else if (t && sscanf(line, "F %32s %32s %o %n", old_id, new_id, &mode, &off) == 3 && off > 0) {
+            journal_add_entry(t, old_id, new_id, mode, line + off);
+        } else if (sscanf(line, "U %u", &seq) == 1) {
+            if (journal.applied > 0 && journal.turns[journal.applied - 1].seq == seq) journal.applied--;
+            t = NULL;
+        } else if (sscanf(line, "R %u", &seq) == 1) {
+            if (journal.applied < journal.nturns && journal.turns[journal.applied].seq == seq) journal.applied++;
+            t = NULL;
+        }
+    }
+    fclose(f);
+}
+
+static int journal_append(const char *text) {
+    char path[PATH_MAX_LEN];
+    if (journal_path(journal.workdir, path, sizeof(path)) != 0) return -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    ssize_t n = write(fd, text, strlen(text)); // one write: records never interleave
+    close(fd);
+    return n == (ssize_t)strlen(text) ? 0 : -1;
+}
+
+// Record a committed batch as a new turn
+static void journal_record(const char *workdir, const WriteBatch *wb) {
+    journal_load(workdir);
+    JournalTurn *t = journal_begin_turn(journal.next_seq);
+    Buffer rec;
+    buffer_init(&rec);
+    buffer_append_fmt(&rec, "T %u %lld %u\n", t->seq, (long long)time(NULL), wb->count);
+    for (uint32_t i = 0; i < wb->count; i++) {
+        const StagedWrite *sw = &wb->items[i];
+        char path[2 * PATH_MAX_LEN];
+        path_join(path, sizeof(path), sw->dir, sw->name);
+        const char *old_id = sw->existed ? sw->old_id : "-";
+        const char *new_id = sw->remove ? "-" : sw->new_id;
+        journal_add_entry(t, old_id, new_id, sw->mode, path);
+        buffer_append_fmt(&rec, "F %s %s %o %s\n", old_id, new_id, (unsigned)sw->mode, path);
+    }
+    journal_append(rec.data);
+    buffer_free(&rec);
+}
+
+// Undo the newest applied turn, or redo the oldest undone one. Files the
+// user changed since are not overwritten: the whole step is refused.
+static int journal_step(const Config *cfg, int redo, char *msg, size_t msg_len) {
+    journal_load(cfg->workdir);
+    if (redo ? journal.applied >= journal.nturns : journal.applied == 0) {
+        snprintf(msg, msg_len, "Nothing to %s", redo ? "redo" : "undo");
+        return -1;
+    }
+    JournalTurn *t = &journal.turns[redo ? journal.applied : journal.applied - 1];
+    
+    WriteBatch wb;
+    if (write_batch_begin(&wb, cfg->workdir) != 0) {
+        snprintf(msg, msg_len, "%s", wb.error);
+        return -1;
+    }
+    for (uint32_t i = 0; i < t->count; i++) {
+        const JournalEntry *e = &journal.entries[t->first + i];
+        const char *expect = redo ? e->old_id : e->new_id;
+        const char *target = redo ? e->new_id : e->old_id;
+        
+        char cur[OBJECT_ID_LEN + 1] = "";
+        int fd = openat(wb.rootfd, e->path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            struct stat st;
+            void *map = NULL;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            if (map != MAP_FAILED) {
+                object_id(map ? map : "", map ? (size_t)st.st_size : 0, cur);
+                if (map) munmap(map, st.st_size);
+            }
+            close(fd);
+        }
+        if (strcmp(cur, expect) != 0) {
+            snprintf(msg, msg_len, "%.64s changed since; not %s", e->path, redo ? "redone" : "undone");
+            write_batch_abort(&wb);
+            return -1;
+        }
+        
+        size_t len = 0;
+        char *data = target[0] ? object_load(target, &len) : NULL;
+        if (target[0] && !data) {
+            snprintf(msg, msg_len, "Undo copy of %.64s is missing", e->path);
+            write_batch_abort(&wb);
+            return -1;
+        }
+        int rc = write_batch_add(&wb, e->path, data, len, e->mode);
+        free(data);
+        if (rc != 0) {
+            snprintf(msg, msg_len, "%s", wb.error);
+            write_batch_abort(&wb);
+            return -1;
+        }
+    }
+    if (write_batch_commit(&wb) != 0) {
+        snprintf(msg, msg_len, "%s", wb.error);
+        return -1;
+    }
+    write_batch_close(&wb);
+    
+    char rec[32];
+    snprintf(rec, sizeof(rec), "%c %u\n", redo ? 'R' : 'U', t->seq);
+    journal_append(rec);
+    journal.applied += redo ? 1 : -1;
+    snprintf(msg, msg_len, "%s %u file(s) (%u of %u turns applied)", redo ? "Redid" : "Undid",
+             t->count, journal.applied, journal.nturns);
+    return 0;
+}
+
+static void file_list_clear(FileList *list) {
+    for (int i = 0; i < list->count; i++) free(list->files[i].path);
+    list->count = 0;
+}
+
+static void file_list_free(FileList *list) {
+    file_list_clear(list);
+    free(list->files);
+    list->files = NULL;
+    list->cap = 0;
+}
+
+static FileEntry *file_list_add(FileList *list, const char *rel, const struct stat *st) {
+    if (list->count >= list->cap) {
+        int newcap = list->cap ? list->cap * 2 : 256;
+        FileEntry *files = realloc(list->files, sizeof(FileEntry) * newcap);
+        if (!files) die("realloc");
+        list->files = files;
+        list->cap = newcap;
+    }
+    FileEntry *fe = &list->files[list->count++];
+    memset(fe, 0, sizeof(*fe));
+    fe->path = strdup(rel);
+    if (!fe->path) die("strdup");
+    fe->is_dir = S_ISDIR(st->st_mode);
+    fe->size = fe->is_dir ? 0 : (size_t)st->st_size;
+    fe->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    fe->ino = (uint64_t)st->st_ino;
+    return fe;
+}
+
+// Ignore rules with .gitignore semantics. Every directory's .gitignore and
+// .ignore (the latter wins) are compiled once, when the walker enters the
+// directory, into an IgnoreLevel stacked on its parent's: literal names,
+// anchored literal paths and "*.ext" suffixes go into hash tables, the
+// remaining globs into groups hashed by their literal prefix, so a path is
+// only tried against globs that share a prefix with it. A path is
+// decided by the deepest level with a matching rule, and within a level by
+// the last matching rule, so negations work as in git. The bottom of every
+// stack is .git/info/exclude over the built-in defaults.
+#define IGNORE_MAX_BYTES (4 * 1024 * 1024)
+#define IGNORE_PREFIX_MAX 63 // longest literal prefix a glob is grouped by
+
+static const char *const ignore_files[] = {".gitignore", ".ignore"};
+#define IGNORE_NFILES 2
+
+static const char ignore_defaults_text[] =
+    "node_modules\n.git\n.svn\n__pycache__\n.pytest_cache\ndist\nbuild\ntarget\n"
+    ".next\n.vscode\n.idea\n*.pyc\n*.o\n*.so\n*.dll\n*.exe\n.DS_Store\n";
+
+typedef struct {
+    const char *pat;    // points into the level's text
+    unsigned negate : 1;
+    unsigned dir_only : 1;
+    unsigned anchored : 1; // matched against the path below the level, not the name
+    unsigned lookup : 1;   // a literal or suffix, found through a table
+} IgnoreRule;
+
+typedef struct {
+    const char *key;
+    size_t len;
+    int file_rule;      // last rule with this key that applies to files, or -1
+    int dir_rule;       // same for directories (dir-only rules included)
+} IgnoreSlot;
+
+typedef struct {
+    IgnoreSlot *slots;
+    size_t mask;
+} IgnoreTable;
+
+typedef struct {
+    const char *key;    // literal prefix shared by the group's globs
+    size_t len;
+    int start;          // group is rules[start .. start + count), ascending
+    int count;
+} IgnoreGroup;
+
+typedef struct {
+    IgnoreGroup *slots;
+    size_t mask;
+    uint64_t lens;      // bit n: some group's prefix is n bytes long
+    int *rules;
+} IgnoreGlobs;
+
+typedef struct IgnoreLevel IgnoreLevel;
+struct IgnoreLevel {
+    IgnoreLevel *parent;     // enclosing directory; lower precedence
+    IgnoreLevel *next;       // levels compiled by one walk, for freeing
+    size_t base_len;         // length of "dir/" in workdir-relative paths
+    char *text;
+    IgnoreRule *rules;
+    int count;
+    IgnoreTable names;       // unanchored literals: "build"
+    IgnoreTable paths;       // anchored literals: "/vendor/zlib"
+    IgnoreTable suffixes;    // "*.log"
+    IgnoreGlobs *name_globs; // unanchored globs, matched against the name
+    IgnoreGlobs *path_globs; // anchored globs, matched against the path
+    IgnoreGlobs *deep_globs; // anchored globs led by "**/", tried at every directory
+};
+
+// '*' and '?' stay within one path component, "**/" spans any number of
+// directories and a trailing "**" everything below; [a-z], [!a-z] and
+// backslash escapes as in fnmatch
+static int ignore_glob(const char *p, const char *s) {
+    for (;;) {
+        switch (*p) {
+        case '\0':
+            return *s == '\0';
+        case '*': {
+            int deep = p[1] == '*';
+            while (*p == '*') p++;
+            if (deep && *p == '\0') return 1;
+            if (deep && *p == '/') {
+                p++;
+                for (;;) {
+                    if (ignore_glob(p, s)) return 1;
+                    s = strchr(s, '/');
+                    if (!s) return 0;
+                    s++;
+                }
+            }
+            for (;; s++) {
+                if (ignore_glob(p, s)) return 1;
+                if (*s == '\0' || *s == '/') return 0;
+            }
+        }
+        case '?':
+            if (*s == '\0' || *s == '/') return 0;
+            p++, s++;
+            break;
+        case '[': {
+            const char *q = p + 1;
+            int negate = *q == '!' || *q == '^';
+            if (negate) q++;
+            int hit = 0;
+            for (const char *first = q; *q && (*q != ']' || q == first); q++) {
+                unsigned char lo = *q == '\\' && q[1] ? *++q : *q, hi = lo;
+                if (q[1] == '-' && q[2] && q[2] != ']') {
+                    q += 2;
+                    hi = *q == '\\' && q[1] ? *++q : *q;
+                }
+                if ((unsigned char)*s >= lo && (unsigned char)*s <= hi) hit = 1;
+            }
+            if (*q != ']') { // unterminated: a literal '['
+                if (*s != '[') return 0;
+                p++, s++;
+                break;
+            }
+            if (*s == '\0' || *s == '/' || hit == negate) return 0;
+            p = q + 1, s++;
+            break;
+        }
+        case '\\':
+            if (p[1]) p++;
+            // fall through
+        default:
+            if (*p != *s) return 0;
+            p++, s++;
+        }
+    }
+}
+
+static void ignore_table_add(IgnoreTable *t, const char *key, size_t len, int rule, int dir_only) {
+    size_t h = hash_bytes(key, len, HASH_SEED) & t->mask;
+    while (t->slots[h].key && (t->slots[h].len != len || memcmp(t->slots[h].key, key, len) != 0)) {
+        h = (h + 1) & t->mask;
+    }
+    IgnoreSlot *s = &t->slots[h];
+    if (!s->key) {
+        s->key = key;
+        s->len = len;
+        s->file_rule = s->dir_rule = -1;
+    }
+    s->dir_rule = rule;
+    if (!dir_only) s->file_rule = rule;
+}
+
+static int ignore_table_find(const IgnoreTable *t, const char *key, size_t len, int is_dir) {
+    if (!t->slots) return -1;
+    size_t h = hash_bytes(key, len, HASH_SEED) & t->mask;
+    while (t->slots[h].key) {
+        const IgnoreSlot *s = &t->slots[h];
+        if (s->len == len && memcmp(s->key, key, len) == 0) return is_dir ? s->dir_rule : s->file_rule;
+        h = (h + 1) & t->mask;
+    }
+    return -1;
+}
+
+static void ignore_table_init(IgnoreTable *t, int count) {
+    if (count == 0) return;
+    size_t n = 16;
+    while (n < (size_t)count * 2) n *= 2;
+    t->slots = calloc(n, sizeof(IgnoreSlot));
+    if (!t->slots) die("calloc");
+    t->mask = n - 1;
+}
+
+enum { IGNORE_NAME_GLOB, IGNORE_PATH_GLOB, IGNORE_DEEP_GLOB };
+
+static int ignore_glob_kind(const IgnoreRule *r) {
+    if (!r->anchored) return IGNORE_NAME_GLOB;
+    return strncmp(r->pat, "**/", 3) == 0 ? IGNORE_DEEP_GLOB : IGNORE_PATH_GLOB;
+}
+
+// Literal prefix of a glob, past any leading "**/"
+static const char *ignore_glob_prefix(const char *pat, size_t *len) {
+    while (strncmp(pat, "**/", 3) == 0) pat += 3;
+    size_t n = strcspn(pat, "*?[\\");
+    *len = n < IGNORE_PREFIX_MAX ? n : IGNORE_PREFIX_MAX;
+    return pat;
+}
+
+static IgnoreGroup *ignore_group_find(const IgnoreGlobs *g, const char *key, size_t len, uint64_t h) {
+    for (h &= g->mask; g->slots[h].key; h = (h + 1) & g->mask) {
+        if (g->slots[h].len == len && memcmp(g->slots[h].key, key, len) == 0) return &g->slots[h];
+    }
+    return NULL;
+}
+
+static IgnoreGlobs *ignore_globs_build(const IgnoreLevel *lv, int kind, int count) {
+    if (count == 0) return NULL;
+    IgnoreGlobs *g = calloc(1, sizeof(IgnoreGlobs));
+    if (!g) die("calloc");
+    size_t n = 16;
+    while (n < (size_t)count * 2) n *= 2;
+    g->slots = calloc(n, sizeof(IgnoreGroup));
+    g->rules = malloc(sizeof(int) * count);
+    if (!g->slots || !g->rules) die("malloc");
+    g->mask = n - 1;
+    
+    // Count each group, lay the groups out, then fill them in rule order
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < lv->count; i++) {
+            const IgnoreRule *r = &lv->rules[i];
+            if (r->lookup || ignore_glob_kind(r) != kind) continue;
+            size_t len;
+            const char *key = ignore_glob_prefix(r->pat, &len);
+            uint64_t h = hash_bytes(key, len, HASH_SEED);
+            IgnoreGroup *grp = ignore_group_find(g, key, len, h);
+            if (pass == 1) {
+                g->rules[grp->start + grp->count++] = i;
+                continue;
+            }
+            if (!grp) {
+                for (h &= g->mask; g->slots[h].key; h = (h + 1) & g->mask) {}
+                grp = &g->slots[h];
+                grp->key = key;
+                grp->len = len;
+                g->lens |= 1ULL << len;
+            }
+            grp->count++;
+        }
+        if (pass == 0) {
+            int start = 0;
+            for (size_t h = 0; h <= g->mask; h++) {
+                g->slots[h].start = start;
+                start += g->slots[h].count;
+                g->slots[h].count = 0;
+            }
+        }
+    }
+    return g;
+}
+
+// Highest rule above best whose glob matches subject, among the groups
+// whose prefix starts probe (subject itself, or a directory within it)
+static int ignore_globs_scan(const IgnoreLevel *lv, const IgnoreGlobs *g, const char *probe,
+                             const char *subject, int is_dir, int best) {
+    uint64_t h = HASH_SEED;
+    for (size_t n = 0; n <= IGNORE_PREFIX_MAX && (g->lens >> n); n++) {
+        if (g->lens & (1ULL << n)) {
+            const IgnoreGroup *grp = ignore_group_find(g, probe, n, h);
+            for (int i = grp ? grp->count - 1 : -1; i >= 0 && g->rules[grp->start + i] > best; i--) {
+                const IgnoreRule *r = &lv->rules[g->rules[grp->start + i]];
+                if (r->dir_only && !is_dir) continue;
+                if (ignore_glob(r->pat, subject)) {
+                    best = g->rules[grp->start + i];
+                    break;
+                }
+            }
+        }
+        if (probe[n] == '\0') break;
+        h = (h ^ (unsigned char)probe[n]) * 0x100000001b3ULL;
+    }
+    return best;
+}
+
+static void ignore_globs_free(IgnoreGlobs *g) {
+    if (!g) return;
+    free(g->slots);
+    free(g->rules);
+    free(g);
+}
+
+// Literal suffix of a "*.ext" pattern, or NULL
+static const char *ignore_suffix(const char *pat) {
+    if (pat[0] != '*' || pat[1] != '.') return NULL;
+    return strpbrk(pat + 1, "*?[\\") ? NULL : pat + 1;
+}
+
+// Compile text (taken over) into a level on top of parent
+static IgnoreLevel *ignore_level_compile(char *text, IgnoreLevel *parent, size_t base_len) {
+    IgnoreLevel *lv = calloc(1, sizeof(IgnoreLevel));
+    if (!lv) die("calloc");
+    lv->parent = parent;
+    lv->base_len = base_len;
+    lv->text = text;
+    
+    int cap = 0;
+    for (char *p = text; *p; p++) if (*p == '\n') cap++;
+    lv->rules = malloc(sizeof(IgnoreRule) * (cap + 1));
+    if (!lv->rules) die("malloc");
+    
+    int nnames = 0, npaths = 0, nsuffixes = 0, nglobs[3] = {0};
+    for (char *line = text; line; ) {
+        char *end = strchr(line, '\n');
+        char *next = end ? end + 1 : NULL;
+        if (!end) end = line + strlen(line);
+        *end = '\0';
+        if (end > line && end[-1] == '\r') *--end = '\0';
+        while (end > line && end[-1] == ' ' && !(end - 1 > line && end[-2] == '\\')) *--end = '\0';
+        
+        IgnoreRule r = {0};
+        char *pat = line;
+        line = next;
+        if (*pat == '#' || *pat == '\0') continue;
+        if (*pat == '!') {
+            r.negate = 1;
+            pat++;
+        }
+        if (end > pat && end[-1] == '/') {
+            r.dir_only = 1;
+            *--end = '\0';
+        }
+        if (*pat == '/') {
+            r.anchored = 1;
+            pat++;
+        } else if (strncmp(pat, "**/", 3) == 0 && !strchr(pat + 3, '/')) {
+            pat += 3; // same as the bare name
+        } else if (strchr(pat, '/')) {
+            r.anchored = 1;
+        }
+        if (*pat == '\0') continue;
+        r.pat = pat;
+        
+        if (!strpbrk(pat, "*?[\\")) {
+            r.lookup = 1;
+            if (r.anchored) npaths++;
+            else nnames++;
+        } else if (!r.anchored && ignore_suffix(pat)) {
+            r.lookup = 1;
+            nsuffixes++;
+        } else {
+            nglobs[ignore_glob_kind(&r)]++;
+        }
+        lv->rules[lv->count++] = r;
+    }
+    
+    ignore_table_init(&lv->names, nnames);
+    ignore_table_init(&lv->paths, npaths);
+    ignore_table_init(&lv->suffixes, nsuffixes);
+    for (int i = 0; i < lv->count; i++) {
+        const IgnoreRule *r = &lv->rules[i];
+        if (!r->lookup) continue;
+        IgnoreTable *t = r->anchored ? &lv->paths : ignore_suffix(r->pat) ? &lv->suffixes : &lv->names;
+        const char *key = t == &lv->suffixes ? r->pat + 1 : r->pat;
+        ignore_table_add(t, key, strlen(key), i, r->dir_only);
+    }
+    lv->name_globs = ignore_globs_build(lv, IGNORE_NAME_GLOB, nglobs[IGNORE_NAME_GLOB]);
+    lv->path_globs = ignore_globs_build(lv, IGNORE_PATH_GLOB, nglobs[IGNORE_PATH_GLOB]);
+    lv->deep_globs = ignore_globs_build(lv, IGNORE_DEEP_GLOB, nglobs[IGNORE_DEEP_GLOB]);
+    return lv;
+}
+
+static void ignore_level_free(IgnoreLevel *lv) {
+    free(lv->names.slots);
+    free(lv->paths.slots);
+    free(lv->suffixes.slots);
+    ignore_globs_free(lv->name_globs);
+    ignore_globs_free(lv->path_globs);
+    ignore_globs_free(lv->deep_globs);
+    free(lv->rules);
+    free(lv->text);
+    free(lv);
+}
+
+// This level's verdict on path (workdir-relative, last component name):
+// 1 ignored, 0 re-included by a negation, -1 no rule matched
+static int ignore_level_match(const IgnoreLevel *lv, const char *path, const char *name, int is_dir) {
+    const char *sub = path + lv->base_len;
+    int best = ignore_table_find(&lv->names, name, strlen(name), is_dir);
+    int r = ignore_table_find(&lv->paths, sub, strlen(sub), is_dir);
+    if (r > best) best = r;
+    if (lv->suffixes.slots) {
+        for (const char *dot = strchr(name, '.'); dot; dot = strchr(dot + 1, '.')) {
+            r = ignore_table_find(&lv->suffixes, dot, strlen(dot), is_dir);
+            if (r > best) best = r;
+        }
+    }
+    if (lv->name_globs) best = ignore_globs_scan(lv, lv->name_globs, name, name, is_dir, best);
+    if (lv->path_globs) best = ignore_globs_scan(lv, lv->path_globs, sub, sub, is_dir, best);
+    for (const char *dir = sub; lv->deep_globs && dir; dir = strchr(dir, '/')) {
+        if (*dir == '/') dir++;
+        best = ignore_globs_scan(lv, lv->deep_globs, dir, sub, is_dir, best);
+    }
+    return best < 0 ? -1 : !lv->rules[best].negate;
+}
+
+static int ignore_match(const IgnoreLevel *lv, const char *path, const char *name, int is_dir) {
+    for (; lv; lv = lv->parent) {
+        int m = ignore_level_match(lv, path, name, is_dir);
+        if (m >= 0) return m;
+    }
+    return 0;
+}
+
+// Compiled once, before any walker thread starts
+static IgnoreLevel *ignore_defaults(void) {
+    static IgnoreLevel *defaults;
+    if (!defaults) {
+        char *text = strdup(ignore_defaults_text);
+        if (!text) die("strdup");
+        defaults = ignore_level_compile(text, NULL, 0);
+    }
+    return defaults;
+}
+
+static int should_ignore(const char *name) {
+    return ignore_level_match(ignore_defaults(), name, name, 1) > 0;
+}
+
+static int is_ignore_file(const char *name) {
+    for (int i = 0; i < IGNORE_NFILES; i++) {
+        if (strcmp(name, ignore_files[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+// Append file name (relative to dirfd) and a newline to out, which is
+// only allocated once a file exists
+static int ignore_read_at(int dirfd, const char *name, Buffer *out) {
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (!out->data) buffer_init(out);
+    char chunk[8192];
+    size_t total = 0;
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0 && total < IGNORE_MAX_BYTES) {
+        buffer_append_n(out, chunk, (size_t)n);
+        total += (size_t)n;
+    }
+    close(fd);
+    buffer_append(out, "\n");
+    return 0;
+}
+
+// Rules of the directory open at dirfd (path "dir/" has base_len bytes) on
+// top of parent; parent itself when the directory has no ignore files
+static IgnoreLevel *ignore_level_load(int dirfd, const char *const *names, int nnames,
+                                      IgnoreLevel *parent, size_t base_len) {
+    Buffer text = {0};
+    for (int i = 0; i < nnames; i++) ignore_read_at(dirfd, names[i], &text);
+    if (!text.data) return parent;
+    return ignore_level_compile(text.data, parent, base_len);
+}
+
+// Parallel directory walker. Each directory is one task on a small
+// work-stealing pool; entries are classified from d_type where possible
+// and stat'ed (fstatat, relative to the directory fd) only when a file is
+// kept or its type is unknown. Children are sorted by name and the tree is
+// flattened depth-first afterwards, so the output order is deterministic.
+#define SCAN_MAX_DEPTH 5
+#define SCAN_MAX_THREADS 8
+
+typedef struct ScanNode ScanNode;
+
+typedef struct {
+    char *name;
+    int is_dir;
+    size_t size;
+    int64_t mtime_ns;
+    uint64_t ino;
+    ScanNode *sub; // filled by the child's task for directories
+} ScanChild;
+
+struct ScanNode {
+    char *rel;      // path relative to the scan base
+    int64_t stamp;  // dir_stamp() taken before reading the directory
+    int depth;
+    IgnoreLevel *ignore; // rules of the enclosing directories
+    ScanChild *children;
+    int count;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    ScanNode **tasks;
+    int count;
+    int cap;
+} ScanDeque;
+
+typedef struct {
+    int root_fd;
+    ScanDeque *deques;
+    int nthreads;
+    atomic_int pending; // tasks queued or running
+    atomic_int queued;  // tasks in some deque
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond; // a task was queued, or pending reached 0
+    atomic_int entries;
+    const char *prefix; // scan base relative to the workdir
+    pthread_mutex_t ignore_lock;
+    IgnoreLevel *ignore_levels; // compiled during this walk
+} ScanPool;
+
+typedef struct {
+    ScanPool *pool;
+    int id;
+} ScanWorker;
+
+static int scan_threads = 0; // 0 = one per CPU, capped at SCAN_MAX_THREADS
+
+static void scan_push(ScanPool *pool, int id, ScanNode *node) {
+    ScanDeque *q = &pool->deques[id];
+    atomic_fetch_add(&pool->pending, 1);
+    pthread_mutex_lock(&q->lock);
+    if (q->count >= q->cap) {
+        int newcap = q->cap ? q->cap * 2 : 64;
+        ScanNode **tasks = realloc(q->tasks, sizeof(ScanNode *) * newcap);
+        if (!tasks) die("realloc");
+        q->tasks = tasks;
+        q->cap = newcap;
+    }
+    q->tasks[q->count++] = node;
+    atomic_fetch_add(&pool->queued, 1);
+    pthread_mutex_unlock(&q->lock);
+    
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+// Own deque: newest first (depth-first locality). Others: steal oldest.
+static ScanNode *scan_take(ScanPool *pool, int id) {
+    ScanDeque *q = &pool->deques[id];
+    ScanNode *node = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) node = q->tasks[--q->count];
+    pthread_mutex_unlock(&q->lock);
+    
+    for (int i = 1; !node && i < pool->nthreads; i++) {
+        ScanDeque *victim = &pool->deques[(id + i) % pool->nthreads];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->count > 0) {
+            node = victim->tasks[0];
+            memmove(victim->tasks, victim->tasks + 1, sizeof(ScanNode *) * --victim->count);
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    if (node) atomic_fetch_sub(&pool->queued, 1);
+    return node;
+}
+
+// A directory's mtime, or that of one of its ignore files if newer: an
+// ignore file edited in place leaves the directory's own mtime alone.
+// -1 if rel (relative to base_fd) is not a directory.
+static int64_t dir_stamp(int base_fd, const char *rel) {
+    struct stat st;
+    if (fstatat(base_fd, rel[0] ? rel : ".", &st, 0) != 0 || !S_ISDIR(st.st_mode)) return -1;
+    int64_t stamp = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    for (int i = 0; i < IGNORE_NFILES; i++) {
+        char path[PATH_MAX_LEN];
+        if (path_join(path, sizeof(path), rel, ignore_files[i]) != 0 || fstatat(base_fd, path, &st, 0) != 0) continue;
+        int64_t m = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        if (m > stamp) stamp = m;
+    }
+    return stamp;
+}
+
+static int scan_child_cmp(const void *a, const void *b) {
+    return strcmp(((const ScanChild *)a)->name, ((const ScanChild *)b)->name);
+}
+
+// Track a level returned by ignore_level_load; returns it
+static IgnoreLevel *scan_keep_level(ScanPool *pool, IgnoreLevel *lv, const IgnoreLevel *parent) {
+    if (lv != parent) {
+        pthread_mutex_lock(&pool->ignore_lock);
+        lv->next = pool->ignore_levels;
+        pool->ignore_levels = lv;
+        pthread_mutex_unlock(&pool->ignore_lock);
+    }
+    return lv;
+}
+
+static void scan_one_dir(ScanPool *pool, int id, ScanNode *node) {
+    int fd = node->rel[0] ? openat(pool->root_fd, node->rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                          : dup(pool->root_fd);
+    if (fd < 0) return;
+    node->stamp = dir_stamp(fd, "");
+    
+    // Workdir-relative "dir/" followed by each entry's name, for matching
+    char path[PATH_MAX_LEN];
+    if (path_join(path, sizeof(path), pool->prefix, node->rel) != 0) {
+        close(fd);
+        return;
+    }
+    size_t base_len = path[0] ? strlen(path) + 1 : 0;
+    if (base_len) path[base_len - 1] = '/';
+    IgnoreLevel *ignore = scan_keep_level(pool, ignore_level_load(fd, ignore_files, IGNORE_NFILES, node->ignore, base_len),
+                                          node->ignore);
+    
+    DIR *d = fdopendir(fd);
+    if (!d) {
+        close(fd);
+        return;
+    }
+    
+    int cap = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) && atomic_load(&pool->entries) < MAX_INDEX_FILES) {
+        if (ent->d_name[0] == '.') continue;
+        size_t nl = strlen(ent->d_name);
+        if (base_len + nl >= sizeof(path)) continue;
+        memcpy(path + base_len, ent->d_name, nl + 1);
+        
+        int is_dir = 0, known = 0;
+#ifdef DT_DIR
+        if (ent->d_type == DT_DIR) {
+            is_dir = 1;
+            known = 1;
+        } else if (ent->d_type == DT_REG) {
+            known = 1;
+        }
+#endif
+        // Regular files that are not code never need a stat, nor do
+        // entries the ignore rules can decide from the type alone
+        if (known && !is_dir && !is_code_file(ent->d_name)) continue;
+        if (known && ignore_match(ignore, path, ent->d_name, is_dir)) continue;
+        
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        if (!is_dir) {
+            if (fstatat(dirfd(d), ent->d_name, &st, 0) != 0) continue;
+            if (S_ISDIR(st.st_mode)) {
+                is_dir = 1;
+            } else if (!S_ISREG(st.st_mode) || !is_code_file(ent->d_name)) {
+                continue;
+            }
+        }
+        if (!known && ignore_match(ignore, path, ent->d_name, is_dir)) continue;
+        
+        if (node->count >= cap) {
+            cap = cap ? cap * 2 : 16;
+            ScanChild *children = realloc(node->children, sizeof(ScanChild) * cap);
+            if (!children) die("realloc");
+            node->children = children;
+        }
+        ScanChild *c = &node->children[node->count++];
+        c->name = strdup(ent->d_name);
+        if (!c->name) die("strdup");
+        c->is_dir = is_dir;
+        c->size = is_dir ? 0 : (size_t)st.st_size;
+        c->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        c->ino = is_dir && st.st_ino == 0 ? (uint64_t)ent->d_ino : (uint64_t)st.st_ino;
+        c->sub = NULL;
+        atomic_fetch_add(&pool->entries, 1);
+    }
+    closedir(d);
+    
+    qsort(node->children, node->count, sizeof(ScanChild), scan_child_cmp);
+    
+    if (node->depth + 1 > SCAN_MAX_DEPTH) return;
+    for (int i = 0; i < node->count; i++) {
+        ScanChild *c = &node->children[i];
+        if (!c->is_dir) continue;
+        ScanNode *sub = calloc(1, sizeof(ScanNode));
+        if (!sub) die("calloc");
+        size_t rl = strlen(node->rel), nl = strlen(c->name);
+        sub->rel = malloc(rl + nl + 2);
+        if (!sub->rel) die("malloc");
+        if (rl) {
+            memcpy(sub->rel, node->rel, rl);
+            sub->rel[rl] = '/';
+            memcpy(sub->rel + rl + 1, c->name, nl + 1);
+        } else {
+            memcpy(sub->rel, c->name, nl + 1);
+        }
+        sub->depth = node->depth + 1;
+        sub->ignore = ignore;
+        c->sub = sub;
+        scan_push(pool, id, sub);
+    }
+}
+
+// Idle workers sleep until a task is queued or the walk is over
+static void *scan_worker(void *arg) {
+    ScanWorker *w = arg;
+    ScanPool *pool = w->pool;
+    while (atomic_load(&pool->pending) > 0) {
+        ScanNode *node = scan_take(pool, w->id);
+        if (!node) {
+            pthread_mutex_lock(&pool->idle_lock);
+            while (atomic_load(&pool->pending) > 0 && atomic_load(&pool->queued) == 0) {
+                pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+            }
+            pthread_mutex_unlock(&pool->idle_lock);
+            continue;
+        }
+        scan_one_dir(pool, w->id, node);
+        if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+            pthread_mutex_lock(&pool->idle_lock);
+            pthread_cond_broadcast(&pool->idle_cond);
+            pthread_mutex_unlock(&pool->idle_lock);
+        }
+    }
+    return NULL;
+}
+
+// Depth-first flatten; prefix is the base-relative path of node
+static void scan_flatten(const ScanNode *node, const char *prefix, FileList *list) {
+    for (int i = 0; i < node->count && list->count < MAX_INDEX_FILES; i++) {
+        const ScanChild *c = &node->children[i];
+        char rel[PATH_MAX_LEN];
+        if (path_join(rel, sizeof(rel), prefix, c->name) != 0) continue;
+        
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_mode = c->is_dir ? S_IFDIR : S_IFREG;
+        FileEntry *fe = file_list_add(list, rel, &st);
+        fe->size = c->size;
+        fe->mtime_ns = c->mtime_ns;
+        fe->ino = c->ino;
+        if (c->is_dir) fe->mtime_ns = c->sub ? c->sub->stamp : 0; // 0 = below the depth limit
+        
+        if (c->sub) scan_flatten(c->sub, rel, list);
+    }
+}
+
+static void scan_node_free(ScanNode *node) {
+    for (int i = 0; i < node->count; i++) {
+        if (node->children[i].sub) {
+            scan_node_free(node->children[i].sub);
+            free(node->children[i].sub);
+        }
+        free(node->children[i].name);
+    }
+    free(node->children);
+    free(node->rel);
+}
+
+// Rules of directory dir (relative to base_fd) on top of parent
+static IgnoreLevel *scan_ignore_dir(ScanPool *pool, int base_fd, const char *dir, IgnoreLevel *parent) {
+    int fd = openat(base_fd, dir[0] ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return parent;
+    IgnoreLevel *lv = ignore_level_load(fd, ignore_files, IGNORE_NFILES, parent, dir[0] ? strlen(dir) + 1 : 0);
+    close(fd);
+    return scan_keep_level(pool, lv, parent);
+}
+
+// Rules in force above the walk's root: the defaults, .git/info/exclude,
+// then those of the base and every directory down to the root's parent
+static IgnoreLevel *scan_ignore_ancestors(ScanPool *pool, const char *base_path) {
+    IgnoreLevel *lv = ignore_defaults();
+    int base_fd = open(base_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd < 0) return lv;
+    
+    const char *exclude = ".git/info/exclude";
+    lv = scan_keep_level(pool, ignore_level_load(base_fd, &exclude, 1, lv, 0), lv);
+    const char *prefix = pool->prefix;
+    if (prefix[0]) {
+        lv = scan_ignore_dir(pool, base_fd, "", lv);
+        for (const char *slash = strchr(prefix, '/'); slash; slash = strchr(slash + 1, '/')) {
+            char dir[PATH_MAX_LEN];
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash - prefix), prefix);
+            lv = scan_ignore_dir(pool, base_fd, dir, lv);
+        }
+    }
+    close(base_fd);
+    return lv;
+}
+
+// Walk path (at the given depth below base_path) and append its entries to list
+static void scan_directory(const char *path, FileList *list, const char *base_path, int depth) {
+    if (depth > SCAN_MAX_DEPTH) return; // Limit recursion depth
+    if (list->count >= MAX_INDEX_FILES) return;
+    
+    ScanPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.root_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (pool.root_fd < 0) return;
+    atomic_init(&pool.pending, 0);
+    atomic_init(&pool.queued, 0);
+    atomic_init(&pool.entries, list->count);
+    pool.prefix = "";
+    if (strlen(path) > strlen(base_path) + 1) pool.prefix = path + strlen(base_path) + 1;
+    pthread_mutex_init(&pool.ignore_lock, NULL);
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle_cond, NULL);
+    
+    int n = scan_threads;
+    if (n <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? (int)cpus : 1;
+    }
+    if (n > SCAN_MAX_THREADS) n = SCAN_MAX_THREADS;
+    pool.nthreads = n;
+    pool.deques = calloc(n, sizeof(ScanDeque));
+    if (!pool.deques) die("calloc");
+    for (int i = 0; i < n; i++) pthread_mutex_init(&pool.deques[i].lock, NULL);
+    
+    ScanNode root = { .rel = strdup(""), .depth = depth, .ignore = scan_ignore_ancestors(&pool, base_path) };
+    if (!root.rel) die("strdup");
+    scan_push(&pool, 0, &root);
+    
+    pthread_t threads[SCAN_MAX_THREADS];
+    ScanWorker workers[SCAN_MAX_THREADS];
+    int started = 1;
+    for (int i = 1; i < n; i++) {
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        if (pthread_create(&threads[i], NULL, scan_worker, &workers[i]) != 0) break;
+        started++;
+    }
+    workers[0].pool = &pool;
+    workers[0].id = 0;
+    scan_worker(&workers[0]);
+    for (int i = 1; i < started; i++) pthread_join(threads[i], NULL);
+    
+    scan_flatten(&root, pool.prefix, list);
+    
+    scan_node_free(&root);
+    while (pool.ignore_levels) {
+        IgnoreLevel *next = pool.ignore_levels->next;
+        ignore_level_free(pool.ignore_levels);
+        pool.ignore_levels = next;
+    }
+    pthread_mutex_destroy(&pool.ignore_lock);
+    pthread_mutex_destroy(&pool.idle_lock);
+    pthread_cond_destroy(&pool.idle_cond);
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+    free(pool.deques);
+    close(pool.root_fd);
+}
+
+// Path -> entry lookup over a FileList (open addressing)
+typedef struct {
+    int *slots;
+    size_t mask;
+} PathTable;
+
+static void path_table_build(PathTable *t, const FileList *list) {
+    size_t n = 64;
+    while (n < (size_t)list->count * 2) n *= 2;
+    t->slots = malloc(sizeof(int) * n);
+    if (!t->slots) die("malloc");
+    memset(t->slots, -1, sizeof(int) * n);
+    t->mask = n - 1;
+    for (int i = 0; i < list->count; i++) {
+        size_t h = hash_bytes(list->files[i].path, strlen(list->files[i].path), HASH_SEED) & t->mask;
+        while (t->slots[h] >= 0) h = (h + 1) & t->mask;
+        t->slots[h] = i;
+    }
+}
+
+static int path_table_find(const PathTable *t, const FileList *list, const char *path) {
+    size_t h = hash_bytes(path, strlen(path), HASH_SEED) & t->mask;
+    while (t->slots[h] >= 0) {
+        if (strcmp(list->files[t->slots[h]].path, path) == 0) return t->slots[h];
+        h = (h + 1) & t->mask;
+    }
+    return -1;
+}
+
+static void path_table_free(PathTable *t) {
+    free(t->slots);
+    t->slots = NULL;
+}
+
+static int file_entry_same(const FileEntry *a, const FileEntry *b) {
+    return a->is_dir == b->is_dir && a->size == b->size &&
+           a->mtime_ns == b->mtime_ns && a->ino == b->ino;
+}
+
+// Keep content-derived data for entries whose metadata did not change
+static void file_list_carry_over(FileList *fresh, int from, int to, const FileList *old, const PathTable *t) {
+    for (int i = from; i < to; i++) {
+        int j = path_table_find(t, old, fresh->files[i].path);
+        if (j >= 0 && file_entry_same(&fresh->files[i], &old->files[j])) {
+            fresh->files[i].hash = old->files[j].hash;
+            fresh->files[i].content = old->files[j].content;
+        }
+    }
+}
+
+// Persistent repository index: ~/.devstral_cache/index-<workdir hash>.idx
+#define INDEX_MAGIC 0x58495644u // "DVIX"
+#define INDEX_VERSION 4
+
+typedef struct {
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t ino;
+    uint64_t hash;
+    uint16_t is_dir;
+    uint16_t content;
+    uint32_t path_len;
+} IndexRecord;
+
+static int repo_index_path(const char *workdir, char *out, size_t len) {
+    char dir[PATH_MAX_LEN / 2];
+    if (cache_dir(dir, sizeof(dir)) != 0) return -1;
+    snprintf(out, len, "%s/index-%016llx.idx", dir,
+             (unsigned long long)hash_bytes(workdir, strlen(workdir), HASH_SEED));
+    return 0;
+}
+
+// Entries as saved, directories carrying their dir_stamp(); -1 if there is
+// no index for workdir or it is cut short (list may still hold a prefix)
+static int repo_index_load(const char *workdir, FileList *list, int64_t *root_stamp) {
+    char path[PATH_MAX_LEN];
+    if (repo_index_path(workdir, path, sizeof(path)) != 0) return -1;
+    
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    
+    uint32_t hdr[4];
+    char stored[PATH_MAX_LEN];
+    if (fread(hdr, sizeof(hdr), 1, f) != 1 || hdr[0] != INDEX_MAGIC ||
+        hdr[1] != INDEX_VERSION || hdr[3] >= sizeof(stored) ||
+        fread(stored, 1, hdr[3], f) != hdr[3] || fread(root_stamp, sizeof(*root_stamp), 1, f) != 1) {
+        fclose(f);
+        return -1;
+    }
+    stored[hdr[3]] = '\0';
+    if (strcmp(stored, workdir) != 0) {
+        fclose(f);
+        return -1;
+    }
+    
+    for (uint32_t i = 0; i < hdr[2]; i++) {
+        IndexRecord rec;
+        char rel[PATH_MAX_LEN];
+        if (fread(&rec, sizeof(rec), 1, f) != 1 || rec.path_len >= sizeof(rel) ||
+            fread(rel, 1, rec.path_len, f) != rec.path_len) {
+            fclose(f);
+            return -1;
+        }
+        rel[rec.path_len] = '\0';
+        
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_mode = rec.is_dir ? S_IFDIR : S_IFREG;
+        FileEntry *fe = file_list_add(list, rel, &st);
+        fe->size = rec.size;
+        fe->mtime_ns = rec.mtime_ns;
+        fe->ino = rec.ino;
+        fe->hash = rec.hash;
+        fe->content = rec.content;
+    }
+    fclose(f);
+    return 0;
+}
+
+static int repo_index_save(const char *workdir, const FileList *list) {
+    char path[PATH_MAX_LEN], tmp[PATH_MAX_LEN + 16];
+    if (repo_index_path(workdir, path, sizeof(path)) != 0) return -1;
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return -1;
+    
+    uint32_t hdr[4] = { INDEX_MAGIC, INDEX_VERSION, (uint32_t)list->count, (uint32_t)strlen(workdir) };
+    fwrite(hdr, sizeof(hdr), 1, f);
+    fwrite(workdir, 1, hdr[3], f);
+    fwrite(&repo_index.root_stamp, sizeof(repo_index.root_stamp), 1, f);
+    for (int i = 0; i < list->count; i++) {
+        const FileEntry *fe = &list->files[i];
+        IndexRecord rec = { fe->size, fe->mtime_ns, fe->ino, fe->hash,
+                            (uint16_t)fe->is_dir, (uint16_t)fe->content, (uint32_t)strlen(fe->path) };
+        fwrite(&rec, sizeof(rec), 1, f);
+        fwrite(fe->path, 1, rec.path_len, f);
+    }
+    
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Walk the whole tree, keeping hashes of unchanged files from old
+static void repo_index_full_scan(const char *workdir, FileList *list, const FileList *old) {
+    FileList fresh = {0};
+    repo_index.root_stamp = dir_stamp(AT_FDCWD, workdir);
+    scan_directory(workdir, &fresh, workdir, 0);
+    
+    PathTable t;
+    path_table_build(&t, old);
+    file_list_carry_over(&fresh, 0, fresh.count, old, &t);
+    path_table_free(&t);
+    
+    int selected = list->selected;
+    file_list_free(list);
+    *list = fresh;
+    list->selected = selected < list->count ? selected : 0;
+}
+
+// Re-walk the subtree of one directory (rel path) and splice it into list;
+// the new subtree occupies [*from, *from + *added)
+static int repo_index_rescan_dir(const char *workdir, FileList *list, const char *rel, int *from, int *added) {
+    PathTable t;
+    path_table_build(&t, list);
+    int di = path_table_find(&t, list, rel);
+    
+    char full[PATH_MAX_LEN];
+    int64_t stamp = -1;
+    if (di < 0 || path_join(full, sizeof(full), workdir, rel) != 0 || !list->files[di].is_dir ||
+        (stamp = dir_stamp(AT_FDCWD, full)) < 0) {
+        path_table_free(&t);
+        return -1; // gone; the parent's event covers it
+    }
+    
+    // Subtree is contiguous in walk order: entries prefixed with "rel/"
+    size_t rl = strlen(rel);
+    int end = di + 1;
+    while (end < list->count && strncmp(list->files[end].path, rel, rl) == 0 &&
+           list->files[end].path[rl] == '/') {
+        end++;
+    }
+    
+    int depth = 1;
+    for (const char *p = rel; *p; p++) if (*p == '/') depth++;
+    
+    FileList sub = {0};
+    scan_directory(full, &sub, workdir, depth);
+    file_list_carry_over(&sub, 0, sub.count, list, &t);
+    path_table_free(&t);
+    
+    list->files[di].mtime_ns = stamp;
+    
+    // Splice: [0, di] + sub + [end, count)
+    int removed = end - di - 1;
+    int newcount = list->count - removed + sub.count;
+    for (int i = di + 1; i < end; i++) free(list->files[i].path);
+    if (newcount > list->cap) {
+        FileEntry *files = realloc(list->files, sizeof(FileEntry) * newcount);
+        if (!files) die("realloc");
+        list->files = files;
+        list->cap = newcount;
+    }
+    memmove(&list->files[di + 1 + sub.count], &list->files[end],
+            sizeof(FileEntry) * (list->count - end));
+    memcpy(&list->files[di + 1], sub.files, sizeof(FileEntry) * sub.count);
+    list->count = newcount;
+    if (list->selected >= list->count) list->selected = 0;
+    free(sub.files); // paths now owned by list
+    
+    *from = di + 1;
+    *added = sub.count;
+    return 0;
+}
+
+// Take new metadata for fe; content data is dropped if it changed
+static int file_entry_restat(FileEntry *fe, const struct stat *st) {
+    int64_t mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    if (fe->size == (size_t)st->st_size && fe->mtime_ns == mtime && fe->ino == (uint64_t)st->st_ino) return 0;
+    fe->size = st->st_size;
+    fe->mtime_ns = mtime;
+    fe->ino = st->st_ino;
+    fe->hash = 0;
+    fe->content = CONTENT_UNKNOWN;
+    return 1;
+}
+
+// Bring a freshly loaded index up to date without walking the tree: a
+// directory whose stamp moved is re-read with its subtree, every other
+// entry is re-stated. -1 when the workdir's own stamp moved (the caller
+// walks everything then, as for a changed root under inotify).
+static int repo_index_revalidate(const char *workdir, FileList *list, int64_t root_stamp) {
+    int root_fd = open(workdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) return -1;
+    if (dir_stamp(root_fd, "") != root_stamp) {
+        close(root_fd);
+        return -1;
+    }
+    repo_index.root_stamp = root_stamp;
+    
+    // Subtrees are contiguous in walk order, so a changed directory's
+    // entries can be skipped: its rescan restats them
+    char **dirs = NULL;
+    uint32_t ndirs = 0, dirs_cap = 0;
+    int changed = 0;
+    for (int i = 0; i < list->count; i++) {
+        FileEntry *fe = &list->files[i];
+        if (fe->is_dir) {
+            if (fe->mtime_ns == 0 || dir_stamp(root_fd, fe->path) == fe->mtime_ns) continue;
+            dirs = grow_array(dirs, &dirs_cap, ndirs + 1, sizeof(char *));
+            dirs[ndirs++] = fe->path; // stays valid: rescans only replace entries below it
+            size_t l = strlen(fe->path);
+            while (i + 1 < list->count && strncmp(list->files[i + 1].path, fe->path, l) == 0 &&
+                   list->files[i + 1].path[l] == '/') {
+                i++;
+            }
+            continue;
+        }
+        struct stat st;
+        if (fstatat(root_fd, fe->path, &st, 0) != 0) continue; // its directory's stamp moved as well
+        changed |= file_entry_restat(fe, &st);
+    }
+    close(root_fd);
+    
+    for (uint32_t i = 0; i < ndirs; i++) {
+        int from, added;
+        repo_index_rescan_dir(workdir, list, dirs[i], &from, &added);
+    }
+    free(dirs);
+    
+    if (changed || ndirs > 0) repo_index.dirty = 1;
+    return 0;
+}
+
+#ifdef __linux__
+#define INDEX_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                          IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR)
+
+static void repo_index_watch(const char *rel) {
+    char full[PATH_MAX_LEN];
+    if (path_join(full, sizeof(full), repo_index.workdir, rel) != 0) return;
+    int wd = inotify_add_watch(repo_index.inotify_fd, full, INDEX_WATCH_MASK);
+    if (wd < 0) {
+        // Out of watches: fall back to walking every turn
+        close(repo_index.inotify_fd);
+        repo_index.inotify_fd = -1;
+        return;
+    }
+    if (wd >= repo_index.watch_cap) {
+        int newcap = wd * 2 + 64;
+        char **paths = realloc(repo_index.watch_paths, sizeof(char *) * newcap);
+        if (!paths) die("realloc");
+        memset(paths + repo_index.watch_cap, 0, sizeof(char *) * (newcap - repo_index.watch_cap));
+        repo_index.watch_paths = paths;
+        repo_index.watch_cap = newcap;
+    }
+    free(repo_index.watch_paths[wd]);
+    repo_index.watch_paths[wd] = strdup(rel);
+}
+
+static void repo_index_watch_all(const FileList *list, int from, int to) {
+    for (int i = from; i < to && repo_index.inotify_fd >= 0; i++) {
+        if (list->files[i].is_dir) repo_index_watch(list->files[i].path);
+    }
+}
+
+static void repo_index_unwatch(void) {
+    if (repo_index.inotify_fd >= 0) close(repo_index.inotify_fd);
+    repo_index.inotify_fd = -1;
+    for (int i = 0; i < repo_index.watch_cap; i++) free(repo_index.watch_paths[i]);
+    free(repo_index.watch_paths);
+    repo_index.watch_paths = NULL;
+    repo_index.watch_cap = 0;
+}
+
+static void add_unique(char ***set, int *n, const char *s) {
+    for (int i = 0; i < *n; i++) if (strcmp((*set)[i], s) == 0) return;
+    char **grown = realloc(*set, sizeof(char *) * (*n + 1));
+    if (!grown) die("realloc");
+    *set = grown;
+    (*set)[(*n)++] = strdup(s);
+}
+
+static int cmp_len(const void *a, const void *b) {
+    return (int)strlen(*(char *const *)a) - (int)strlen(*(char *const *)b);
+}
+
+// Apply pending inotify events; returns -1 if a full rescan is needed
+static int repo_index_apply_events(FileList *list) {
+    char **dirs = NULL, **files = NULL;
+    int ndirs = 0, nfiles = 0, full = 0;
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    
+    while ((n = read(repo_index.inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) full = 1;
+            if (ev->wd < 0 || ev->wd >= repo_index.watch_cap || !repo_index.watch_paths[ev->wd]) continue;
+            const char *dir = repo_index.watch_paths[ev->wd];
+            if (ev->mask & IN_IGNORED) {
+                free(repo_index.watch_paths[ev->wd]);
+                repo_index.watch_paths[ev->wd] = NULL;
+                continue;
+            }
+            if (ev->len > 0 && is_ignore_file(ev->name)) {
+                add_unique(&dirs, &ndirs, dir); // what belongs below dir changed
+                continue;
+            }
+            if (ev->len == 0 || ev->name[0] == '.' || should_ignore(ev->name)) continue;
+            if (!(ev->mask & IN_ISDIR) && !is_code_file(ev->name)) continue;
+            
+            if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+                add_unique(&dirs, &ndirs, dir);
+            } else {
+                char rel[PATH_MAX_LEN];
+                if (path_join(rel, sizeof(rel), dir, ev->name) == 0) add_unique(&files, &nfiles, rel);
+            }
+        }
+    }
+    
+    int changed = ndirs + nfiles > 0;
+    if (!full) {
+        // Parents first; a rescanned parent covers everything below it
+        if (ndirs > 1) qsort(dirs, ndirs, sizeof(char *), cmp_len);
+        for (int i = 0; i < ndirs && !full; i++) {
+            int covered = 0;
+            for (int j = 0; j < i; j++) {
+                size_t l = strlen(dirs[j]);
+                if (l == 0 || (strncmp(dirs[i], dirs[j], l) == 0 && dirs[i][l] == '/')) covered = 1;
+            }
+            if (covered) continue;
+            if (dirs[i][0] == '\0') {
+                full = 1; // root changed: cheaper to walk everything
+                break;
+            }
+            int from, added;
+            if (repo_index_rescan_dir(repo_index.workdir, list, dirs[i], &from, &added) == 0) {
+                repo_index_watch_all(list, from, from + added);
+            }
+        }
+    }
+    
+    if (!full && nfiles > 0) {
+        PathTable t;
+        path_table_build(&t, list);
+        for (int i = 0; i < nfiles; i++) {
+            int fi = path_table_find(&t, list, files[i]);
+            if (fi < 0) continue;
+            char full[PATH_MAX_LEN];
+            struct stat st;
+            if (path_join(full, sizeof(full), repo_index.workdir, files[i]) != 0 ||
+                stat(full, &st) != 0) continue;
+            file_entry_restat(&list->files[fi], &st);
+        }
+        path_table_free(&t);
+    }
+    
+    for (int i = 0; i < ndirs; i++) free(dirs[i]);
+    for (int i = 0; i < nfiles; i++) free(files[i]);
+    free(dirs);
+    free(files);
+    
+    if (changed) repo_index.dirty = 1;
+    return full ? -1 : 0;
+}
+#endif
+
+// Bring file_list up to date for cfg->workdir with as little I/O as possible
+static void repo_index_refresh(const Config *cfg) {
+    if (!repo_index.loaded || strcmp(repo_index.workdir, cfg->workdir) != 0) {
+#ifdef __linux__
+        repo_index_unwatch();
+#endif
+        memcpy(repo_index.workdir, cfg->workdir, sizeof(repo_index.workdir));
+        
+        // Cold start: revalidate the on-disk index; walk only without one,
+        // reusing whatever content data it has
+        int64_t root_stamp = 0;
+        file_list_clear(&file_list);
+        if (repo_index_load(cfg->workdir, &file_list, &root_stamp) != 0 ||
+            repo_index_revalidate(cfg->workdir, &file_list, root_stamp) != 0) {
+            FileList old = file_list;
+            memset(&file_list, 0, sizeof(file_list));
+            repo_index_full_scan(cfg->workdir, &file_list, &old);
+            file_list_free(&old);
+            repo_index.dirty = 1;
+        }
+        repo_index.loaded = 1;
+        
+#ifdef __linux__
+        repo_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (repo_index.inotify_fd >= 0) {
+            repo_index_watch("");
+            repo_index_watch_all(&file_list, 0, file_list.count);
+        }
+#endif
+    } else {
+        int rescan = 1;
+#ifdef __linux__
+        if (repo_index.inotify_fd >= 0) rescan = repo_index_apply_events(&file_list) != 0;
+#endif
+        if (rescan) {
+            FileList old = file_list;
+            memset(&file_list, 0, sizeof(file_list));
+            file_list.selected = old.selected;
+            repo_index_full_scan(cfg->workdir, &file_list, &old);
+            file_list_free(&old);
+            repo_index.dirty = 1;
+#ifdef __linux__
+            if (repo_index.inotify_fd >= 0) repo_index_watch_all(&file_list, 0, file_list.count);
+#endif
+        }
+    }
+    
+    if (repo_index.dirty && repo_index_save(cfg->workdir, &file_list) == 0) {
+        repo_index.dirty = 0;
+    }
+}
+
+// Context packing. Tokens are estimated from bytes (code averages a bit
+// over three bytes per token, so this errs on the side of fitting).
+#define CONTEXT_RESERVE_TOKENS 256
+#define PACK_NOTE_NAMES 20 // dropped files named in the prompt
+
+static size_t estimate_tokens(size_t bytes) {
+    return (bytes + 2) / 3;
+}
+
+// Tokens available for the prompt: ctx_size - n_predict - reserve
+static size_t context_budget(const Config *cfg) {
+    if (cfg->ctx_size == 0) return SIZE_MAX;
+    size_t fixed = cfg->n_predict + CONTEXT_RESERVE_TOKENS;
+    return cfg->ctx_size > fixed ? cfg->ctx_size - fixed : 0;
+}
+
+// Lower is more important
+static int file_priority(const Config *cfg, const FileEntry *fe) {
+    if (fe->is_dir || fe->size >= cfg->max_file) return -1;
+    if (strlen(cfg->focus_file) > 0 && strstr(fe->path, cfg->focus_file)) return 0;
+    if (ends_with(fe->path, ".h")) return 1;
+    if (ends_with(fe->path, "README.md") || 
+        ends_with(fe->path, "Makefile") ||
+        ends_with(fe->path, "CMakeLists.txt") ||
+        ends_with(fe->path, "package.json")) return 2;
+    return -1;
+}
+
+typedef struct {
+    int file;
+    int priority;
+    size_t tokens;
+} PackCandidate;
+
+static int pack_candidate_cmp(const void *a, const void *b) {
+    const PackCandidate *x = a, *y = b;
+    if (x->priority != y->priority) return x->priority - y->priority;
+    if (x->tokens != y->tokens) return x->tokens < y->tokens ? -1 : 1;
+    return x->file - y->file;
+}
+
+// Content hash of an entry of file_list; kept until the file changes
+static uint64_t file_content_hash(const Config *cfg, FileEntry *fe) {
+    if (fe->hash || fe->is_dir || fe->size == 0) return fe->hash;
+    char full_path[PATH_MAX_LEN];
+    if (path_join(full_path, sizeof(full_path), cfg->workdir, fe->path) != 0) return 0;
+    int fd = open(full_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != fe->size) {
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, fe->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    fe->hash = hash_content(map, fe->size);
+    munmap(map, fe->size);
+    repo_index.dirty = 1;
+    return fe->hash;
+}
+
+// Chosen bodies, deduplicated by content hash: a copy of a body already
+// chosen costs only its path, listed next to that body
+enum { PACK_BODY = 1, PACK_ALIAS };
+
+typedef struct {
+    char *chosen;      // per file: PACK_BODY, PACK_ALIAS or 0
+    int *alias_next;   // per file: next copy of the same body, -1 = none
+    int *by_hash;      // chosen bodies by content hash (open addressing), -1 = empty
+    size_t mask;
+    size_t used;       // tokens
+    size_t body_bytes;
+} PackState;
+
+static void pack_take(const Config *cfg, PackState *ps, const PackCandidate *cand, size_t token_budget) {
+    FileEntry *fe = &file_list.files[cand->file];
+    uint64_t h = file_content_hash(cfg, fe);
+    size_t slot = h & ps->mask;
+    for (; h && ps->by_hash[slot] >= 0; slot = (slot + 1) & ps->mask) {
+        int body = ps->by_hash[slot];
+        if (file_list.files[body].hash != h || file_list.files[body].size != fe->size) continue;
+        size_t t = estimate_tokens(strlen(fe->path) + 4);
+        if (ps->used + t > token_budget) return;
+        ps->chosen[cand->file] = PACK_ALIAS;
+        int *link = &ps->alias_next[body];
+        while (*link >= 0) link = &ps->alias_next[*link];
+        *link = cand->file;
+        ps->used += t;
+        prompt_stats.aliased_files++;
+        return;
+    }
+    if (ps->used + cand->tokens > token_budget || ps->body_bytes + fe->size >= cfg->max_total) return;
+    ps->chosen[cand->file] = PACK_BODY;
+    ps->used += cand->tokens;
+    ps->body_bytes += fe->size;
+    if (h) ps->by_hash[slot] = cand->file;
+}
+
+static void pack_note_dropped(const char *what) {
+    size_t used = strlen(prompt_stats.dropped);
+    if (used + strlen(what) + 3 >= sizeof(prompt_stats.dropped)) return;
+    snprintf(prompt_stats.dropped + used, sizeof(prompt_stats.dropped) - used,
+             "%s%s", used ? ", " : "", what);
+}
+
+// Map a file and copy it straight into ctx; returns bytes appended or -1.
+// Like read_file_content(), content stops at max_size or the first NUL.
+static long append_mapped_file(Buffer *ctx, const char *path, size_t max_size, FileEntry *fe) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    
+    size_t len = (size_t)st.st_size < max_size ? (size_t)st.st_size : max_size;
+    const char *nul = memchr(map, '\0', len);
+    if (nul) len = nul - (const char *)map;
+    
+    if (len == fe->size && fe->hash == 0) {
+        fe->hash = hash_content(map, len);
+        repo_index.dirty = 1;
+    }
+    buffer_append_n(ctx, map, len);
+    munmap(map, st.st_size);
+    return (long)len;
+}
+
+// Content classification. Extensions say nothing about minified bundles,
+// generated fixtures or lockfiles, so a file's head is sampled once, the
+// first time it could reach the prompt, and the verdict is kept in the
+// index until the file changes. Only CONTENT_TEXT files are packed,
+// retrieved or scanned for symbols.
+#define CLASSIFY_SAMPLE 8192
+#define CLASSIFY_MARKER_BYTES 512 // generated-code markers sit in the header
+#define CLASSIFY_LONG_LINE 1000
+#define CLASSIFY_ENTROPY 5.7 // bits per byte; code stays near 5, base64 near 6
+
+static int classify_name(const char *path) {
+    const char *locks[] = {"package-lock.json", "npm-shrinkwrap.json", "pnpm-lock.yaml", "yarn.lock",
+        "Cargo.lock", "poetry.lock", "Pipfile.lock", "composer.lock", "Gemfile.lock", "go.sum"};
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash + 1 : path;
+    for (size_t i = 0; i < sizeof(locks) / sizeof(locks[0]); i++)
+        if (strcmp(name, locks[i]) == 0) return CONTENT_LOCKFILE;
+    if (strstr(name, ".min.")) return CONTENT_MINIFIED;
+    return CONTENT_UNKNOWN;
+}
+
+// Verdict on the first len bytes of a file
+static int classify_sample(const unsigned char *s, size_t len) {
+    if (len == 0) return CONTENT_TEXT;
+    if (memchr(s, '\0', len)) return CONTENT_BINARY;
+    
+    // Line lengths via memchr, which is vectorised: minified code is a
+    // few very long lines
+    size_t lines = 0, longest = 0;
+    for (const unsigned char *p = s, *end = s + len; p < end; lines++) {
+        const unsigned char *nl = memchr(p, '\n', end - p);
+        size_t l = (size_t)((nl ? nl : end) - p);
+        if (l > longest) longest = l;
+        p = nl ? nl + 1 : end;
+    }
+    if (longest >= CLASSIFY_LONG_LINE && len / lines >= CLASSIFY_LONG_LINE / 4) return CONTENT_MINIFIED;
+    
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < len; i++) counts[s[i]]++;
+    size_t control = counts[127], high = 0;
+    for (int c = 0; c < 32; c++) {
+        if (c != '\t' && c != '\n' && c != '\r' && c != '\f' && c != '\v' && c != 27) control += counts[c];
+    }
+    for (int c = 128; c < 256; c++) high += counts[c];
+    if (control * 20 > len) return CONTENT_BINARY;
+    
+    // Encoded blobs such as base64: ASCII with a large, near-uniform alphabet.
+    // UTF-8 text is skipped, its multi-byte sequences raise the entropy.
+    if (len >= 1024 && high * 20 < len) {
+        double bits = 0;
+        for (int c = 0; c < 256; c++) {
+            if (counts[c]) bits -= (double)counts[c] / len * log2((double)counts[c] / len);
+        }
+        if (bits > CLASSIFY_ENTROPY) return CONTENT_BINARY;
+    }
+    
+    const char *markers[] = {"@generated", "do not edit", "auto-generated", "autogenerated",
+        "code generated", "generated by"};
+    char head[CLASSIFY_MARKER_BYTES + 1];
+    size_t hl = len < CLASSIFY_MARKER_BYTES ? len : CLASSIFY_MARKER_BYTES;
+    for (size_t i = 0; i < hl; i++) head[i] = (char)tolower(s[i]);
+    head[hl] = '\0';
+    for (size_t i = 0; i < sizeof(markers) / sizeof(markers[0]); i++)
+        if (strstr(head, markers[i])) return CONTENT_GENERATED;
+    return CONTENT_TEXT;
+}
+
+// Verdict for an entry of file_list, sampling the file on first use
+static int file_content_class(const Config *cfg, FileEntry *fe) {
+    if (fe->content != CONTENT_UNKNOWN) return fe->content;
+    int verdict = classify_name(fe->path);
+    if (verdict == CONTENT_UNKNOWN) {
+        char full_path[PATH_MAX_LEN];
+        unsigned char sample[CLASSIFY_SAMPLE];
+        if (path_join(full_path, sizeof(full_path), cfg->workdir, fe->path) != 0) return CONTENT_UNKNOWN;
+        int fd = open(full_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return CONTENT_UNKNOWN;
+        ssize_t n = pread(fd, sample, sizeof(sample), 0);
+        close(fd);
+        if (n < 0) return CONTENT_UNKNOWN;
+        verdict = classify_sample(sample, (size_t)n);
+    }
+    fe->content = verdict;
+    repo_index.dirty = 1;
+    return verdict;
+}
+
+// Symbol index: definitions (functions, types, typedefs, macros) with line
+// ranges, extracted by a small per-language scanner and kept per file in
+// ~/.devstral_cache/symbols-<workdir hash>.idx next to the repository index.
+#define SYMBOLS_MAGIC 0x59535644u // "DVSY"
+#define SYMBOLS_VERSION 1
+#define SYMBOL_MAX_NAME 64
+#define SYMBOL_MAX_REFS 64
+#define SYMBOL_MAX_LINES 120 // longer definitions are cut
+
+enum { SYM_FUNCTION, SYM_TYPE, SYM_TYPEDEF, SYM_MACRO };
+
+typedef struct {
+    char name[SYMBOL_MAX_NAME];
+    int kind;
+    uint32_t line_start, line_end;
+} Symbol;
+
+typedef struct {
+    char *path;
+    int64_t mtime_ns;
+    size_t size;
+    Symbol *syms;
+    uint32_t count, cap;
+    int seen;
+} SymbolFile;
+
+typedef struct {
+    char workdir[PATH_MAX_LEN];
+    int loaded;
+    int dirty;
+    int generation;
+    SymbolFile *files;
+    uint32_t nfiles, files_cap;
+    int *file_slots;
+    size_t file_mask;
+    uint64_t *name_slots; // (file << 32 | sym) + 1, 0 = empty
+    size_t name_mask;
+} SymbolIndex;
+
+static SymbolIndex symbols = {0};
+
+static void symbol_add(SymbolFile *sf, const char *name, size_t len, int kind, uint32_t start, uint32_t end) {
+    if (len == 0 || len >= SYMBOL_MAX_NAME) return;
+    sf->syms = grow_array(sf->syms, &sf->cap, sf->count + 1, sizeof(Symbol));
+    Symbol *sym = &sf->syms[sf->count++];
+    memcpy(sym->name, name, len);
+    sym->name[len] = '\0';
+    sym->kind = kind;
+    sym->line_start = start;
+    sym->line_end = end;
+}
+
+static int is_ident_start(int c) { return isalpha(c) || c == '_' || c == '$'; }
+static int is_ident_char(int c) { return isalnum(c) || c == '_' || c == '$'; }
+
+// First identifier in s at or after position from; returns its start or -1
+static int next_ident(const char *s, int from, int *len) {
+    for (int i = from; s[i]; i++) {
+        if (is_ident_start((unsigned char)s[i]) && (i == 0 || !is_ident_char((unsigned char)s[i - 1]))) {
+            int j = i;
+            while (is_ident_char((unsigned char)s[j])) j++;
+            *len = j - i;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Position of word w as a whole token in s, or -1
+static int find_word(const char *s, const char *w) {
+    size_t wl = strlen(w);
+    for (const char *p = s; (p = strstr(p, w)) != NULL; p++) {
+        if ((p == s || !is_ident_char((unsigned char)p[-1])) && !is_ident_char((unsigned char)p[wl])) {
+            return (int)(p - s);
+        }
+    }
+    return -1;
+}
+
+// Name of the function whose head is s (text before its body's '{')
+static int head_function_name(const char *s, int *len) {
+    const char *kw[] = {"func", "function", "fn", "fun", "def", "sub"};
+    for (size_t k = 0; k < sizeof(kw) / sizeof(kw[0]); k++) {
+        int at = find_word(s, kw[k]);
+        if (at < 0) continue;
+        int from = at + (int)strlen(kw[k]);
+        while (s[from] == ' ' || s[from] == '\t' || s[from] == '\n') from++;
+        if (s[from] == '(') { // Go method receiver
+            int depth = 0;
+            for (; s[from]; from++) {
+                if (s[from] == '(') depth++;
+                else if (s[from] == ')' && --depth == 0) { from++; break; }
+            }
+        }
+        return next_ident(s, from, len);
+    }
+    
+    // C style: identifier right before the first '('
+    const char *paren = strchr(s, '(');
+    if (!paren || strchr(s, '=')) return -1;
+    int end = (int)(paren - s);
+    while (end > 0 && isspace((unsigned char)s[end - 1])) end--;
+    int start = end;
+    while (start > 0 && is_ident_char((unsigned char)s[start - 1])) start--;
+    *len = end - start;
+    if (*len == 0 || !is_ident_start((unsigned char)s[start])) return -1;
+    
+    const char *control[] = {"if", "for", "while", "switch", "catch", "return", "sizeof", "do", "else"};
+    for (size_t k = 0; k < sizeof(control) / sizeof(control[0]); k++) {
+        if ((int)strlen(control[k]) == *len && strncmp(s + start, control[k], *len) == 0) return -1;
+    }
+    return start;
+}
+
+// Name of the type whose head is s: "struct Name", "class Name : Base", "type Name struct"
+static int head_type_name(const char *s, int *len) {
+    if (strncmp(s, "type ", 5) == 0) return next_ident(s, 5, len);
+    const char *kw[] = {"class", "struct", "interface", "trait", "impl", "union", "enum"};
+    for (size_t k = 0; k < sizeof(kw) / sizeof(kw[0]); k++) {
+        int at = find_word(s, kw[k]);
+        if (at >= 0) return next_ident(s, at + (int)strlen(kw[k]), len);
+    }
+    return -1;
+}
+
+// Line a definition starts on: the name's line, or the one before when the
+// name opens its line (a return type on its own line, as in "static int\nf()")
+static uint32_t head_line_of(const uint32_t *lines, const char *head, int at) {
+    int k = at;
+    while (k > 0 && head[k - 1] == ' ') k--;
+    if (k > 0 && lines[k - 1] != lines[at]) return lines[k - 1];
+    return lines[at];
+}
+
+typedef struct {
+    int container; // namespace/class body: definitions inside still count
+    int sym;       // symbol to close at the matching '}', or -1
+    int typedef_body;
+} BraceFrame;
+
+// Brace languages: C, C++, Java, Go, Rust, JS/TS, ...
+static void extract_brace_symbols(SymbolFile *sf, const char *src, size_t n, int has_macros) {
+    BraceFrame stack[256];
+    int depth = 0, opaque = 0;
+    char head[512];
+    uint32_t head_lines[512];
+    int hl = 0;
+    uint32_t line = 1, head_line = 0, typedef_line = 0;
+    int at_line_start = 1;
+    
+    for (size_t i = 0; i < n; i++) {
+        char c = src[i];
+        
+        if (c == '\n') {
+            line++;
+            at_line_start = 1;
+            if (hl > 0 && hl < (int)sizeof(head) - 1) {
+                head_lines[hl] = line - 1;
+                head[hl++] = ' ';
+            }
+            continue;
+        }
+        if (at_line_start && (c == ' ' || c == '\t')) continue;
+        
+        // Preprocessor line, with continuations
+        if (at_line_start && c == '#' && has_macros) {
+            size_t j = i + 1;
+            while (j < n && (src[j] == ' ' || src[j] == '\t')) j++;
+            int is_define = n - j > 6 && strncmp(src + j, "define", 6) == 0 && isspace((unsigned char)src[j + 6]);
+            uint32_t start = line;
+            size_t name_at = j + 6;
+            while (j < n && !(src[j] == '\n' && src[j - 1] != '\\')) {
+                if (src[j] == '\n') line++;
+                j++;
+            }
+            if (is_define) {
+                while (name_at < j && isspace((unsigned char)src[name_at])) name_at++;
+                size_t e = name_at;
+                while (e < j && is_ident_char((unsigned char)src[e])) e++;
+                size_t body = e;
+                while (body < j && isspace((unsigned char)src[body])) body++;
+                if (body < j) symbol_add(sf, src + name_at, e - name_at, SYM_MACRO, start, line); // not guards
+            }
+            i = j - 1;
+            continue;
+        }
+        at_line_start = 0;
+        
+        // Comments and literals
+        if (c == '/' && i + 1 < n && src[i + 1] == '/') {
+            while (i + 1 < n && src[i + 1] != '\n') i++;
+            continue;
+        }
+        if (c == '/' && i + 1 < n && src[i + 1] == '*') {
+            for (i += 2; i + 1 < n && !(src[i] == '*' && src[i + 1] == '/'); i++) {
+                if (src[i] == '\n') line++;
+            }
+            i++;
+            continue;
+        }
+        if (c == '"' || c == '\'' || c == '`') {
+            for (i++; i < n && src[i] != c; i++) {
+                if (src[i] == '\\') i++;
+                else if (src[i] == '\n') {
+                    line++;
+                    if (c != '`') break; // unterminated: resync at the line end
+                }
+            }
+            if (opaque == 0 && hl < (int)sizeof(head) - 3) {
+                if (hl == 0) head_line = line;
+                head_lines[hl] = head_lines[hl + 1] = line;
+                head[hl++] = c;
+                head[hl++] = c;
+            }
+            continue;
+        }
+        
+        if (c == '{') {
+            BraceFrame f = { 0, -1, 0 };
+            if (opaque == 0) {
+                head[hl] = '\0';
+                int len, at;
+                if (strncmp(head, "typedef", 7) == 0) {
+                    f.typedef_body = 1;
+                    typedef_line = head_line;
+                } else if (find_word(head, "namespace") >= 0 || strncmp(head, "extern", 6) == 0) {
+                    f.container = 1;
+                } else if (!strchr(head, '(') && !strchr(head, '=') && (at = head_type_name(head, &len)) >= 0) {
+                    f.container = find_word(head, "enum") < 0;
+                    symbol_add(sf, head + at, len, SYM_TYPE, head_line_of(head_lines, head, at), line);
+                    f.sym = (int)sf->count - 1;
+                } else if ((at = head_function_name(head, &len)) >= 0) {
+                    symbol_add(sf, head + at, len, SYM_FUNCTION, head_line_of(head_lines, head, at), line);
+                    f.sym = (int)sf->count - 1;
+                }
+            }
+            if (depth < (int)(sizeof(stack) / sizeof(stack[0]))) stack[depth] = f;
+            depth++;
+            if (!f.container) opaque++;
+            hl = 0;
+            continue;
+        }
+        if (c == '}') {
+            if (depth > 0) {
+                depth--;
+                if (depth < (int)(sizeof(stack) / sizeof(stack[0]))) {
+                    BraceFrame f = stack[depth];
+                    if (!f.container && opaque > 0) opaque--;
+                    if (f.sym >= 0 && (uint32_t)f.sym < sf->count) sf->syms[f.sym].line_end = line;
+                    if (f.typedef_body && opaque == 0) {
+                        // Keep collecting: the name follows the closing brace
+                        head_line = typedef_line;
+                        memcpy(head, "typedef ", 8);
+                        for (hl = 0; hl < 8; hl++) head_lines[hl] = typedef_line;
+                        continue;
+                    }
+                }
+            }
+            hl = 0;
+            continue;
+        }
+        if (c == ';') {
+            if (opaque == 0 && hl > 0) {
+                head[hl] = '\0';
+                if (strncmp(head, "typedef", 7) == 0) {
+                    // Function pointer typedef: (*name); otherwise the last identifier
+                    const char *fp = strstr(head, "(*");
+                    int len = 0, at = -1;
+                    if (fp) {
+                        at = next_ident(head, (int)(fp - head) + 2, &len);
+                    } else {
+                        for (int k = 0, l; (k = next_ident(head, k, &l)) >= 0; k += l) {
+                            at = k;
+                            len = l;
+                        }
+                    }
+                    if (at >= 0) symbol_add(sf, head + at, len, SYM_TYPEDEF, head_line, line);
+                }
+            }
+            hl = 0;
+            continue;
+        }
+        
+        if (opaque == 0) {
+            if (hl == 0) head_line = line;
+            if (hl < (int)sizeof(head) - 1) {
+                head_lines[hl] = line;
+                head[hl++] = c;
+            }
+        }
+    }
+}
+
+// Indentation languages: Python (def/class), Ruby and Lua (def/function ... end)
+static void extract_indent_symbols(SymbolFile *sf, const char *src, size_t n, int end_keyword) {
+    struct { int indent; int sym; } open[64];
+    int nopen = 0;
+    uint32_t line = 0, last_code_line = 0;
+    
+    for (size_t i = 0; i < n;) {
+        line++;
+        size_t e = i;
+        while (e < n && src[e] != '\n') e++;
+        
+        int indent = 0;
+        size_t p = i;
+        while (p < e && (src[p] == ' ' || src[p] == '\t')) {
+            indent += src[p] == '\t' ? 8 : 1;
+            p++;
+        }
+        int blank = p == e || src[p] == '#' || (p + 1 < e && src[p] == '-' && src[p + 1] == '-');
+        
+        if (!blank) {
+            if (end_keyword && e - p >= 3 && strncmp(src + p, "end", 3) == 0 &&
+                (e - p == 3 || !is_ident_char((unsigned char)src[p + 3]))) {
+                if (nopen > 0 && open[nopen - 1].indent == indent) {
+                    sf->syms[open[nopen - 1].sym].line_end = line;
+                    nopen--;
+                }
+            } else {
+                // Anything dedented to or past a definition closes it
+                while (nopen > 0 && indent <= open[nopen - 1].indent) {
+                    sf->syms[open[nopen - 1].sym].line_end = last_code_line;
+                    nopen--;
+                }
+            }
+            
+            const char *kws[] = {"async def ", "def ", "class ", "module ", "local function ", "function "};
+            for (size_t k = 0; k < sizeof(kws) / sizeof(kws[0]); k++) {
+                size_t kl = strlen(kws[k]);
+                if ((size_t)(e - p) <= kl || strncmp(src + p, kws[k], kl) != 0) continue;
+                size_t s = p + kl;
+                while (s < e && src[s] == ' ') s++;
+                // Ruby "def self.name", Lua "function M.name": take the last segment
+                size_t ne = s;
+                while (ne < e && (is_ident_char((unsigned char)src[ne]) || src[ne] == '.' || src[ne] == ':')) ne++;
+                while (ne > s && !is_ident_char((unsigned char)src[ne - 1])) ne--;
+                size_t ns = ne;
+                while (ns > s && is_ident_char((unsigned char)src[ns - 1])) ns--;
+                int kind = kws[k][0] == 'c' || kws[k][0] == 'm' ? SYM_TYPE : SYM_FUNCTION;
+                uint32_t before = sf->count;
+                symbol_add(sf, src + ns, ne - ns, kind, line, line);
+                if (sf->count > before && nopen < (int)(sizeof(open) / sizeof(open[0]))) {
+                    open[nopen].indent = indent;
+                    open[nopen].sym = (int)sf->count - 1;
+                    nopen++;
+                }
+                break;
+            }
+            last_code_line = line;
+        }
+        i = e + 1;
+    }
+    while (nopen > 0) {
+        nopen--;
+        sf->syms[open[nopen].sym].line_end = last_code_line;
+    }
+}
+
+static void extract_symbols(SymbolFile *sf, const char *full_path) {
+    sf->count = 0;
+    const char *indent_exts[] = {".py", ".rb", ".lua"};
+    const char *brace_exts[] = {".c", ".h", ".cpp", ".cc", ".cxx", ".cs", ".java", ".go", ".rs",
+        ".js", ".ts", ".jsx", ".tsx", ".php", ".swift", ".kt", ".m", ".mm", ".scala", ".pl", ".sh"};
+    int style = 0; // 1 = brace, 2 = indent
+    for (size_t i = 0; i < sizeof(brace_exts) / sizeof(brace_exts[0]) && !style; i++) {
+        if (ends_with(sf->path, brace_exts[i])) style = 1;
+    }
+    for (size_t i = 0; i < sizeof(indent_exts) / sizeof(indent_exts[0]) && !style; i++) {
+        if (ends_with(sf->path, indent_exts[i])) style = 2;
+    }
+    if (!style) return;
+    
+    int fd = open(full_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+    
+    size_t n = (size_t)st.st_size;
+    const char *nul = memchr(map, '\0', n);
+    if (nul) n = nul - map;
+    
+    if (style == 1) {
+        int c_like = ends_with(sf->path, ".c") || ends_with(sf->path, ".h") || ends_with(sf->path, ".cpp") ||
+                     ends_with(sf->path, ".cc") || ends_with(sf->path, ".cxx") || ends_with(sf->path, ".m") ||
+                     ends_with(sf->path, ".mm") || ends_with(sf->path, ".cs");
+        extract_brace_symbols(sf, map, n, c_like);
+    } else {
+        extract_indent_symbols(sf, map, n, !ends_with(sf->path, ".py"));
+    }
+    munmap(map, st.st_size);
+}
+
+// Path table over files[0, nfiles) with n slots
+static void symbols_rehash_files(size_t n) {
+    free(symbols.file_slots);
+    symbols.file_slots = slots_new(n);
+    symbols.file_mask = n - 1;
+    for (uint32_t i = 0; i < symbols.nfiles; i++) {
+        size_t h = hash_bytes(symbols.files[i].path, strlen(symbols.files[i].path), HASH_SEED) & symbols.file_mask;
+        while (symbols.file_slots[h] >= 0) h = (h + 1) & symbols.file_mask;
+        symbols.file_slots[h] = (int)i;
+    }
+}
+
+static int symbol_file_slot(const char *path, int create) {
+    size_t h;
+    if (symbols.file_slots) {
+        h = hash_bytes(path, strlen(path), HASH_SEED) & symbols.file_mask;
+        while (symbols.file_slots[h] >= 0) {
+            if (strcmp(symbols.files[symbols.file_slots[h]].path, path) == 0) return symbols.file_slots[h];
+            h = (h + 1) & symbols.file_mask;
+        }
+    }
+    if (!create) return -1;
+    
+    symbols.files = grow_array(symbols.files, &symbols.files_cap, symbols.nfiles + 1, sizeof(SymbolFile));
+    int slot = (int)symbols.nfiles++;
+    memset(&symbols.files[slot], 0, sizeof(SymbolFile));
+    symbols.files[slot].path = strdup(path);
+    if (!symbols.files[slot].path) die("strdup");
+    
+    if (!symbols.file_slots || symbols.nfiles * 2 > symbols.file_mask) {
+        symbols_rehash_files(symbols.file_slots ? (symbols.file_mask + 1) * 2 : 1024);
+    } else {
+        h = hash_bytes(path, strlen(path), HASH_SEED) & symbols.file_mask;
+        while (symbols.file_slots[h] >= 0) h = (h + 1) & symbols.file_mask;
+        symbols.file_slots[h] = slot;
+    }
+    return slot;
+}
+
+static void symbols_reset(void) {
+    for (uint32_t i = 0; i < symbols.nfiles; i++) {
+        free(symbols.files[i].path);
+        free(symbols.files[i].syms);
+    }
+    free(symbols.files);
+    free(symbols.file_slots);
+    free(symbols.name_slots);
+    memset(&symbols, 0, sizeof(symbols));
+}
+
+static int symbols_path(const char *workdir, char *out, size_t len) {
+    char dir[PATH_MAX_LEN / 2];
+    if (cache_dir(dir, sizeof(dir)) != 0) return -1;
+    snprintf(out, len, "%s/symbols-%016llx.idx", dir,
+             (unsigned long long)hash_bytes(workdir, strlen(workdir), HASH_SEED));
+    return 0;
+}
+
+static void symbols_load(const char *workdir) {
+    char path[PATH_MAX_LEN];
+    if (symbols_path(workdir, path, sizeof(path)) != 0) return;
+    FILE *f = fopen(path, "rb");
+    if (!f) return;
+    
+    uint32_t hdr[4];
+    char stored[PATH_MAX_LEN];
+    if (fread(hdr, sizeof(hdr), 1, f) != 1 || hdr[0] != SYMBOLS_MAGIC || hdr[1] != SYMBOLS_VERSION ||
+        hdr[3] >= sizeof(stored) || fread(stored, 1, hdr[3], f) != hdr[3]) {
+        fclose(f);
+        return;
+    }
+    stored[hdr[3]] = '\0';
+    if (strcmp(stored, workdir) != 0) {
+        fclose(f);
+        return;
+    }
+    
+    for (uint32_t i = 0; i < hdr[2]; i++) {
+        uint32_t rec[2]; // path length, symbol count
+        int64_t meta[2]; // size, mtime
+        char rel[PATH_MAX_LEN];
+        if (fread(rec, sizeof(rec), 1, f) != 1 || fread(meta, sizeof(meta), 1, f) != 1 ||
+            rec[0] >= sizeof(rel) || fread(rel, 1, rec[0], f) != rec[0]) {
+            break;
+        }
+        rel[rec[0]] = '\0';
+        int slot = symbol_file_slot(rel, 1);
+        SymbolFile *sf = &symbols.files[slot];
+        sf->size = (size_t)meta[0];
+        sf->mtime_ns = meta[1];
+        sf->syms = grow_array(sf->syms, &sf->cap, rec[1], sizeof(Symbol));
+        if (rec[1] && fread(sf->syms, sizeof(Symbol), rec[1], f) != rec[1]) {
+            sf->mtime_ns = 0; // re-extract
+            break;
+        }
+        sf->count = rec[1];
+    }
+    fclose(f);
+}
+
+static void symbols_save(const char *workdir) {
+    char path[PATH_MAX_LEN], tmp[PATH_MAX_LEN + 16];
+    if (symbols_path(workdir, path, sizeof(path)) != 0) return;
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return;
+    
+    uint32_t hdr[4] = { SYMBOLS_MAGIC, SYMBOLS_VERSION, symbols.nfiles, (uint32_t)strlen(workdir) };
+    fwrite(hdr, sizeof(hdr), 1, f);
+    fwrite(workdir, 1, hdr[3], f);
+    for (uint32_t i = 0; i < symbols.nfiles; i++) {
+        const SymbolFile *sf = &symbols.files[i];
+        uint32_t rec[2] = { (uint32_t)strlen(sf->path), sf->count };
+        int64_t meta[2] = { (int64_t)sf->size, sf->mtime_ns };
+        fwrite(rec, sizeof(rec), 1, f);
+        fwrite(meta, sizeof(meta), 1, f);
+        fwrite(sf->path, 1, rec[0], f);
+        fwrite(sf->syms, sizeof(Symbol), sf->count, f);
+    }
+    if (fclose(f) != 0 || rename(tmp, path) != 0) unlink(tmp);
+    else symbols.dirty = 0;
+}
+
+static void symbols_rebuild_names(void) {
+    size_t total = 0;
+    for (uint32_t i = 0; i < symbols.nfiles; i++) total += symbols.files[i].count;
+    size_t n = 1024;
+    while (n < total * 2) n *= 2;
+    free(symbols.name_slots);
+    symbols.name_slots = calloc(n, sizeof(uint64_t));
+    if (!symbols.name_slots) die("calloc");
+    symbols.name_mask = n - 1;
+    
+    for (uint32_t f = 0; f < symbols.nfiles; f++) {
+        for (uint32_t s = 0; s < symbols.files[f].count; s++) {
+            const char *name = symbols.files[f].syms[s].name;
+            size_t h = hash_bytes(name, strlen(name), HASH_SEED) & symbols.name_mask;
+            while (symbols.name_slots[h]) h = (h + 1) & symbols.name_mask;
+            symbols.name_slots[h] = ((uint64_t)f << 32 | s) + 1;
+        }
+    }
+}
+
+// Bring the symbol index in line with file_list, re-extracting changed files
+static void symbols_sync(const Config *cfg) {
+    if (!symbols.loaded || strcmp(symbols.workdir, cfg->workdir) != 0) {
+        symbols_reset();
+        memcpy(symbols.workdir, cfg->workdir, sizeof(symbols.workdir));
+        symbols_load(cfg->workdir);
+        symbols.loaded = 1;
+        symbols.dirty = 1;
+    }
+    
+    int gen = ++symbols.generation;
+    for (int i = 0; i < file_list.count; i++) {
+        FileEntry *fe = &file_list.files[i];
+        if (fe->is_dir || fe->size == 0 || fe->size >= cfg->max_file) continue;
+        if (file_content_class(cfg, fe) > CONTENT_TEXT) continue;
+        
+        int slot = symbol_file_slot(fe->path, 1);
+        SymbolFile *sf = &symbols.files[slot];
+        sf->seen = gen;
+        if (sf->mtime_ns == fe->mtime_ns && sf->size == fe->size) continue;
+        
+        char full_path[PATH_MAX_LEN];
+        if (path_join(full_path, sizeof(full_path), cfg->workdir, fe->path) != 0) continue;
+        extract_symbols(sf, full_path);
+        sf->mtime_ns = fe->mtime_ns;
+        sf->size = fe->size;
+        symbols.dirty = 1;
+    }
+    
+    // Forget files that are gone, keeping the others in order
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < symbols.nfiles; i++) {
+        if (symbols.files[i].seen == gen) {
+            symbols.files[kept++] = symbols.files[i];
+        } else {
+            free(symbols.files[i].path);
+            free(symbols.files[i].syms);
+        }
+    }
+    if (kept < symbols.nfiles) {
+        symbols.nfiles = kept;
+        symbols_rehash_files(symbols.file_mask + 1);
+        symbols.dirty = 1;
+    }
+    
+    if (symbols.dirty) {
+        symbols_rebuild_names();
+        symbols_save(cfg->workdir);
+    } else if (!symbols.name_slots) {
+        symbols_rebuild_names();
+    }
+}
+
+typedef struct {
+    uint32_t file, sym;
+    size_t bytes;
+} SymbolRef;
+
+static int symbol_ref_cmp(const void *a, const void *b) {
+    const SymbolRef *x = a, *y = b;
+    int kx = symbols.files[x->file].syms[x->sym].kind == SYM_FUNCTION;
+    int ky = symbols.files[y->file].syms[y->sym].kind == SYM_FUNCTION;
+    if (kx != ky) return kx - ky; // types and macros first, they are small and dense
+    return x->bytes < y->bytes ? -1 : (x->bytes > y->bytes);
+}
+
+typedef struct {
+    const char *self;   // focus file path
+    SymbolRef *refs;
+    uint32_t count, cap;
+    uint64_t *seen;     // name slots already taken
+    uint32_t nseen, seen_cap;
+} RefCollector;
+
+// Slot value of the next definition of name in the probe chain from *h, or 0
+static uint64_t symbol_probe(size_t *h, const char *name, size_t len) {
+    for (; symbols.name_slots[*h]; *h = (*h + 1) & symbols.name_mask) {
+        uint64_t v = symbols.name_slots[*h];
+        const Symbol *sym = &symbols.files[(v - 1) >> 32].syms[(uint32_t)(v - 1)];
+        if (strncmp(sym->name, name, len) == 0 && sym->name[len] == '\0') return v;
+    }
+    return 0;
+}
+
+static void collect_ref(RefCollector *rc, const char *name, size_t len) {
+    if (len >= SYMBOL_MAX_NAME || rc->count >= SYMBOL_MAX_REFS) return;
+    size_t h = hash_bytes(name, len, HASH_SEED) & symbols.name_mask;
+    
+    // Names the focus file defines itself need no context, wherever its
+    // definition sits in the chain
+    uint64_t first = 0, v;
+    for (; (v = symbol_probe(&h, name, len)) != 0; h = (h + 1) & symbols.name_mask) {
+        if (strcmp(symbols.files[(v - 1) >> 32].path, rc->self) == 0) return;
+        if (!first) first = v;
+    }
+    if (!first) return;
+    
+    int dup = 0;
+    for (uint32_t k = 0; k < rc->nseen && !dup; k++) dup = rc->seen[k] == first;
+    if (dup) return;
+    rc->seen = grow_array(rc->seen, &rc->seen_cap, rc->nseen + 1, sizeof(uint64_t));
+    rc->seen[rc->nseen++] = first;
+    
+    // Only the first definition of a name (prototype-free)
+    uint32_t f = (uint32_t)((first - 1) >> 32), s = (uint32_t)(first - 1);
+    const Symbol *sym = &symbols.files[f].syms[s];
+    rc->refs = grow_array(rc->refs, &rc->cap, rc->count + 1, sizeof(SymbolRef));
+    rc->refs[rc->count].file = f;
+    rc->refs[rc->count].sym = s;
+    rc->refs[rc->count].bytes = (size_t)(sym->line_end - sym->line_start + 1) * 40;
+    rc->count++;
+}
+
+// Definitions from other files referenced by the focus file, within token_budget
+static size_t append_symbol_definitions(const Config *cfg, Buffer *ctx, const FileEntry *focus, size_t token_budget) {
+    symbols_sync(cfg);
+    
+    char full_path[PATH_MAX_LEN];
+    if (path_join(full_path, sizeof(full_path), cfg->workdir, focus->path) != 0) return 0;
+    int fd = open(full_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    
+    RefCollector rc = { .self = focus->path };
+    for (size_t i = 0; i < (size_t)st.st_size && rc.count < SYMBOL_MAX_REFS;) {
+        if (!is_ident_start((unsigned char)map[i]) || (i > 0 && is_ident_char((unsigned char)map[i - 1]))) {
+            i++;
+            continue;
+        }
+        size_t j = i;
+        while (j < (size_t)st.st_size && is_ident_char((unsigned char)map[j])) j++;
+        collect_ref(&rc, map + i, j - i);
+        i = j;
+    }
+    munmap(map, st.st_size);
+    if (rc.count > 1) qsort(rc.refs, rc.count, sizeof(SymbolRef), symbol_ref_cmp);
+    
+    size_t start_len = ctx->len, used = estimate_tokens(64);
+    int emitted = 0;
+    for (uint32_t r = 0; r < rc.count; r++) {
+        const SymbolFile *sf = &symbols.files[rc.refs[r].file];
+        const Symbol *sym = &sf->syms[rc.refs[r].sym];
+        if (path_join(full_path, sizeof(full_path), cfg->workdir, sf->path) != 0) continue;
+        
+        fd = open(full_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+            (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+            close(fd);
+            continue;
+        }
+        close(fd);
+        
+        // Byte range of the definition's lines
+        uint32_t last = sym->line_end;
+        if (last - sym->line_start >= SYMBOL_MAX_LINES) last = sym->line_start + SYMBOL_MAX_LINES - 1;
+        size_t off = 0, end = (size_t)st.st_size;
+        uint32_t line = 1;
+        for (size_t i = 0; i < (size_t)st.st_size; i++) {
+            if (map[i] != '\n') continue;
+            line++;
+            if (line == sym->line_start) off = i + 1;
+            if (line == last + 1) {
+                end = i + 1;
+                break;
+            }
+        }
+        
+        size_t t = estimate_tokens(end - off + strlen(sf->path) + 32);
+        if (end > off && used + t <= token_budget) {
+            if (emitted++ == 0) {
+                buffer_append_fmt(ctx, "\n### Definitions referenced by %s\n", focus->path);
+            }
+            buffer_append_fmt(ctx, "// %s:%u-%u\n```\n", sf->path, sym->line_start, last);
+            buffer_append_n(ctx, map + off, end - off);
+            if (last < sym->line_end) buffer_append(ctx, "...\n");
+            buffer_append(ctx, "```\n");
+            used += t;
+        }
+        munmap(map, st.st_size);
+    }
+    
+    free(rc.refs);
+    free(rc.seen);
+    return emitted ? estimate_tokens(ctx->len - start_len) : 0;
+}
+
+// Build repository context with actual code, packed into token_budget:
+// focus file, then the structure listing, then headers, then build files
+static size_t build_repo_context(const Config *cfg, Buffer *ctx, int include_code, size_t token_budget) {
+    size_t start_len = ctx->len;
+    buffer_append_fmt(ctx, "Repository root: %s\n\n", cfg->workdir);
+    
+    // Scan files (incrementally, via the repository index)
+    double scan_start = now_ms();
+    repo_index_refresh(cfg);
+    turn_timings.scan_ms += now_ms() - scan_start;
+    
+    // Header, trailer and the dropped-files note
+    PackState ps = {0};
+    ps.used = estimate_tokens(ctx->len - start_len + 128 + PACK_NOTE_NAMES * 48);
+    
+    // Candidate bodies, by priority and then size (more files per token)
+    PackCandidate *cands = malloc(sizeof(PackCandidate) * (file_list.count + 1));
+    ps.chosen = calloc(file_list.count + 1, 1);
+    ps.alias_next = malloc(sizeof(int) * (file_list.count + 1));
+    if (!cands || !ps.chosen || !ps.alias_next) die("malloc");
+    memset(ps.alias_next, -1, sizeof(int) * (file_list.count + 1));
+    int ncands = 0;
+    for (int i = 0; include_code && i < file_list.count; i++) {
+        int prio = file_priority(cfg, &file_list.files[i]);
+        if (prio < 0) continue;
+        // The focus file (priority 0) goes in whatever its content looks like
+        if (prio > 0 && file_content_class(cfg, &file_list.files[i]) > CONTENT_TEXT) {
+            prompt_stats.skipped_files++;
+            continue;
+        }
+        const FileEntry *fe = &file_list.files[i];
+        cands[ncands].file = i;
+        cands[ncands].priority = prio;
+        cands[ncands].tokens = estimate_tokens(fe->size + strlen(fe->path) + 24);
+        ncands++;
+    }
+    qsort(cands, ncands, sizeof(PackCandidate), pack_candidate_cmp);
+    
+    size_t slots = 16;
+    while (slots < (size_t)ncands * 2) slots *= 2;
+    ps.by_hash = malloc(sizeof(int) * slots);
+    if (!ps.by_hash) die("malloc");
+    memset(ps.by_hash, -1, sizeof(int) * slots);
+    ps.mask = slots - 1;
+    
+    int c = 0;
+    for (; c < ncands && cands[c].priority == 0; c++) pack_take(cfg, &ps, &cands[c], token_budget);
+    
+    // What the focus file uses from elsewhere: just those definitions,
+    // ahead of whole headers, with up to half of what is left
+    Buffer defs = {0};
+    for (int k = 0; k < c; k++) {
+        if (!ps.chosen[cands[k].file]) continue;
+        buffer_init(&defs);
+        size_t room = token_budget > ps.used ? (token_budget - ps.used) / 2 : 0;
+        ps.used += append_symbol_definitions(cfg, &defs, &file_list.files[cands[k].file], room);
+        break;
+    }
+    
+    // Structure listing, as many lines as fit
+    int listed = 0;
+    int listable = file_list.count < MAX_FILES ? file_list.count : MAX_FILES;
+    for (; listed < listable; listed++) {
+        size_t t = estimate_tokens(strlen(file_list.files[listed].path) + 24);
+        if (ps.used + t > token_budget) break;
+        ps.used += t;
+    }
+    
+    for (; c < ncands; c++) pack_take(cfg, &ps, &cands[c], token_budget);
+    
+    // Reserve once so file bodies are copied exactly once, from the mapping
+    buffer_ensure_capacity(ctx, (size_t)listed * 64 + ps.body_bytes + defs.len + 4096);
+    
+    buffer_append(ctx, "## Repository Structure:\n");
+    
+    for (int i = 0; i < file_list.count; i++) file_list.files[i].in_context = 0;
+    for (int i = 0; i < file_list.count; i++) {
+        FileEntry *fe = &file_list.files[i];
+        if (i < listed) {
+            if (fe->is_dir) buffer_append_fmt(ctx, "📁 %s/\n", fe->path);
+            else buffer_append_fmt(ctx, "📄 %s (%zu bytes)\n", fe->path, fe->size);
+        }
+        if (ps.chosen[i] != PACK_BODY) continue;
+        
+        char full_path[PATH_MAX_LEN];
+        path_join(full_path, sizeof(full_path), cfg->workdir, fe->path);
+        
+        size_t mark = ctx->len;
+        buffer_append_fmt(ctx, "\n### File: %s\n", fe->path);
+        if (ps.alias_next[i] >= 0) {
+            buffer_append(ctx, "Identical copies: ");
+            for (int a = ps.alias_next[i]; a >= 0; a = ps.alias_next[a]) {
+                buffer_append_fmt(ctx, "%s%s", file_list.files[a].path, ps.alias_next[a] >= 0 ? ", " : "");
+            }
+            buffer_append(ctx, "\n");
+        }
+        buffer_append(ctx, "```\n");
+        long len = append_mapped_file(ctx, full_path, cfg->max_file, fe);
+        if (len > 0) {
+            buffer_append(ctx, "\n```\n\n");
+            fe->in_context = 1;
+            for (int a = ps.alias_next[i]; a >= 0; a = ps.alias_next[a]) file_list.files[a].in_context = 1;
+        } else {
+            ctx->len = mark; // unreadable or empty: drop the header
+            ctx->data[ctx->len] = '\0';
+        }
+    }
+    
+    if (file_list.count > listed) {
+        buffer_append_fmt(ctx, "... (%d more entries not listed)\n", file_list.count - listed);
+        prompt_stats.dropped_entries = file_list.count - listed;
+    }
+    if (defs.len > 0) buffer_append_n(ctx, defs.data, defs.len);
+    buffer_free(&defs);
+    
+    // Report what did not fit, so the model (and the user) know it exists
+    int dropped = 0;
+    for (int i = 0; i < ncands; i++) {
+        if (ps.chosen[cands[i].file]) continue;
+        if (dropped++ == 0) buffer_append(ctx, "Not included (context budget): ");
+        else if (dropped <= PACK_NOTE_NAMES) buffer_append(ctx, ", ");
+        if (dropped <= PACK_NOTE_NAMES) buffer_append(ctx, file_list.files[cands[i].file].path);
+        pack_note_dropped(file_list.files[cands[i].file].path);
+    }
+    if (dropped > PACK_NOTE_NAMES) buffer_append_fmt(ctx, " (+%d more)", dropped - PACK_NOTE_NAMES);
+    if (dropped) buffer_append(ctx, "\n");
+    prompt_stats.dropped_files = dropped;
+    
+    buffer_append_fmt(ctx, "\nTotal files: %d\n", file_list.count);
+    
+    free(cands);
+    free(ps.chosen);
+    free(ps.alias_next);
+    free(ps.by_hash);
+    if (repo_index.dirty && repo_index_save(cfg->workdir, &file_list) == 0) {
+        repo_index.dirty = 0;
+    }
+    return estimate_tokens(ctx->len - start_len);
+}
+
+// Relevance retrieval: BM25 over line chunks of code files, plus a trigram
+// index over the vocabulary so partial words still find their identifiers.
+// Files are (re)indexed only when their size or mtime changes; replaced
+// chunks are tombstoned and the index is rebuilt once most are dead.
+#define RETRIEVAL_CHUNK_LINES 40
+#define RETRIEVAL_MAX_HITS 12
+#define RETRIEVAL_PER_FILE 3
+#define RETRIEVAL_MAX_TERM 48
+#define RETRIEVAL_EXPANSIONS 5
+#define BM25_K1 1.2f
+#define BM25_B 0.75f
+
+typedef struct {
+    uint32_t chunk;
+    uint32_t tf;
+} Posting;
+
+typedef struct {
+    uint32_t name; // offset into chars
+    uint32_t len;
+    int stop;
+    Posting *postings;
+    uint32_t count, cap;
+} Term;
+
+typedef struct {
+    int file;
+    uint32_t line_start, line_end; // 1-based, inclusive
+    uint32_t off, len;
+    uint32_t dl;                   // terms in chunk
+    int dead;
+} Chunk;
+
+typedef struct {
+    char *path;
+    int64_t mtime_ns;
+    size_t size;
+    uint32_t first_chunk, nchunks;
+    int seen;
+    int live;
+    int list_index; // position in file_list as of the last sync
+} RetrievalFile;
+
+typedef struct {
+    uint32_t key;
+    uint32_t *terms;
+    uint32_t count, cap;
+} TrigramList;
+
+typedef struct {
+    char workdir[PATH_MAX_LEN];
+    char *chars;
+    size_t chars_len, chars_cap;
+    Term *terms;
+    uint32_t nterms, terms_cap;
+    int *term_slots;
+    size_t term_mask;
+    TrigramList *tris;
+    uint32_t ntris, tris_cap;
+    int *tri_slots;
+    size_t tri_mask;
+    Chunk *chunks;
+    uint32_t nchunks, chunks_cap, dead_chunks;
+    RetrievalFile *files;
+    int nfiles;
+    uint32_t files_cap;
+    int *file_slots;
+    size_t file_mask;
+    uint64_t live_terms;
+    uint32_t live_chunks;
+    int generation;
+    uint32_t *scratch;  // per-term counters, always left zeroed
+    uint32_t scratch_cap;
+    float *scores;      // per-chunk accumulators
+    uint32_t scores_cap;
+} RetrievalIndex;
+
+typedef struct {
+    uint32_t chunk;
+    float score;
+} ChunkHit;
+
+static RetrievalIndex retrieval = {0};
+
+static const char *term_name(uint32_t id) {
+    return retrieval.chars + retrieval.terms[id].name;
+}
+
+static void term_slots_rebuild(size_t n) {
+    free(retrieval.term_slots);
+    retrieval.term_slots = slots_new(n);
+    retrieval.term_mask = n - 1;
+    for (uint32_t i = 0; i < retrieval.nterms; i++) {
+        size_t h = hash_bytes(term_name(i), retrieval.terms[i].len, HASH_SEED) & retrieval.term_mask;
+        while (retrieval.term_slots[h] >= 0) h = (h + 1) & retrieval.term_mask;
+        retrieval.term_slots[h] = (int)i;
+    }
+}
+
+static int term_find(const char *s, size_t len) {
+    if (!retrieval.term_slots) return -1;
+    size_t h = hash_bytes(s, len, HASH_SEED) & retrieval.term_mask;
+    while (retrieval.term_slots[h] >= 0) {
+        const Term *t = &retrieval.terms[retrieval.term_slots[h]];
+        if (t->len == len && memcmp(retrieval.chars + t->name, s, len) == 0) return retrieval.term_slots[h];
+        h = (h + 1) & retrieval.term_mask;
+    }
+    return -1;
+}
+
+// Trigrams of [a-z0-9_] words packed into 24 bits
+static uint32_t trigram_at(const char *s) {
+    return ((uint32_t)(unsigned char)s[0] << 16) | ((uint32_t)(unsigned char)s[1] << 8) |
+           (uint32_t)(unsigned char)s[2];
+}
+
+static void tri_slots_rebuild(size_t n) {
+    free(retrieval.tri_slots);
+    retrieval.tri_slots = slots_new(n);
+    retrieval.tri_mask = n - 1;
+    for (uint32_t i = 0; i < retrieval.ntris; i++) {
+        size_t h = (retrieval.tris[i].key * 2654435761u) & retrieval.tri_mask;
+        while (retrieval.tri_slots[h] >= 0) h = (h + 1) & retrieval.tri_mask;
+        retrieval.tri_slots[h] = (int)i;
+    }
+}
+
+static int tri_find(uint32_t key) {
+    if (!retrieval.tri_slots) return -1;
+    size_t h = (key * 2654435761u) & retrieval.tri_mask;
+    while (retrieval.tri_slots[h] >= 0) {
+        if (retrieval.tris[retrieval.tri_slots[h]].key == key) return retrieval.tri_slots[h];
+        h = (h + 1) & retrieval.tri_mask;
+    }
+    return -1;
+}
+
+static void tri_add(uint32_t key, uint32_t term) {
+    int i = tri_find(key);
+    if (i < 0) {
+        retrieval.tris = grow_array(retrieval.tris, &retrieval.tris_cap, retrieval.ntris + 1, sizeof(TrigramList));
+        i = (int)retrieval.ntris++;
+        memset(&retrieval.tris[i], 0, sizeof(TrigramList));
+        retrieval.tris[i].key = key;
+        if (!retrieval.tri_slots || retrieval.ntris * 2 > retrieval.tri_mask) {
+            tri_slots_rebuild(retrieval.tri_slots ? (retrieval.tri_mask + 1) * 2 : 1024);
+        } else {
+            size_t h = (key * 2654435761u) & retrieval.tri_mask;
+            while (retrieval.tri_slots[h] >= 0) h = (h + 1) & retrieval.tri_mask;
+            retrieval.tri_slots[h] = i;
+        }
+    }
+    TrigramList *tl = &retrieval.tris[i];
+    if (tl->count > 0 && tl->terms[tl->count - 1] == term) return;
+    tl->terms = grow_array(tl->terms, &tl->cap, tl->count + 1, sizeof(uint32_t));
+    tl->terms[tl->count++] = term;
+}
+
+static uint32_t term_intern(const char *s, size_t len) {
+    int id = term_find(s, len);
+    if (id >= 0) return (uint32_t)id;
+    
+    if (retrieval.chars_len + len + 1 > retrieval.chars_cap) {
+        size_t newcap = retrieval.chars_cap ? retrieval.chars_cap * 2 : 65536;
+        while (newcap < retrieval.chars_len + len + 1) newcap *= 2;
+        char *chars = realloc(retrieval.chars, newcap);
+        if (!chars) die("realloc");
+        retrieval.chars = chars;
+        retrieval.chars_cap = newcap;
+    }
+    memcpy(retrieval.chars + retrieval.chars_len, s, len);
+    retrieval.chars[retrieval.chars_len + len] = '\0';
+    
+    retrieval.terms = grow_array(retrieval.terms, &retrieval.terms_cap, retrieval.nterms + 1, sizeof(Term));
+    uint32_t tid = retrieval.nterms++;
+    memset(&retrieval.terms[tid], 0, sizeof(Term));
+    retrieval.terms[tid].name = (uint32_t)retrieval.chars_len;
+    retrieval.terms[tid].len = (uint32_t)len;
+    retrieval.chars_len += len + 1;
+    
+    if (!retrieval.term_slots || retrieval.nterms * 2 > retrieval.term_mask) {
+        term_slots_rebuild(retrieval.term_slots ? (retrieval.term_mask + 1) * 2 : 4096);
+    } else {
+        size_t h = hash_bytes(s, len, HASH_SEED) & retrieval.term_mask;
+        while (retrieval.term_slots[h] >= 0) h = (h + 1) & retrieval.term_mask;
+        retrieval.term_slots[h] = (int)tid;
+    }
+    
+    for (size_t i = 0; i + 3 <= len; i++) tri_add(trigram_at(s + i), tid);
+    return tid;
+}
+
+static void retrieval_init_vocab(void) {
+    // Keywords and filler words carry no signal
+    const char *stop[] = {"the", "and", "for", "int", "char", "void", "return", "if", "else",
+        "static", "const", "struct", "include", "define", "this", "that", "with", "from",
+        "to", "of", "in", "is", "it", "a", "an", "be", "or", "on", "not", "null", "true",
+        "false", "while", "size", "def", "self", "var", "let", "fn", "function", "import",
+        "please", "make", "add", "fix", "use", "should", "can", "we", "want", "code", "file"};
+    for (size_t i = 0; i < sizeof(stop) / sizeof(stop[0]); i++) {
+        uint32_t id = term_intern(stop[i], strlen(stop[i]));
+        retrieval.terms[id].stop = 1;
+    }
+}
+
+typedef void (*TermFn)(void *ud, const char *term, size_t len);
+
+// Identifiers, lowercased, plus their snake_case/camelCase parts
+static void tokenize_terms(const char *s, size_t n, TermFn fn, void *ud) {
+    char word[RETRIEVAL_MAX_TERM + 1];
+    size_t i = 0;
+    while (i < n) {
+        unsigned char c = (unsigned char)s[i];
+        if (!(isalpha(c) || c == '_')) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while (i < n && (isalnum((unsigned char)s[i]) || s[i] == '_')) i++;
+        size_t len = i - start;
+        if (len < 2 || len > RETRIEVAL_MAX_TERM) continue;
+        
+        size_t ps = 0;
+        for (size_t k = 0; k <= len; k++) {
+            char ch = k < len ? s[start + k] : '_';
+            int boundary = ch == '_' ||
+                (k > 0 && k < len && isupper((unsigned char)ch) && islower((unsigned char)s[start + k - 1]));
+            if (boundary) {
+                if (k - ps >= 2 && k - ps < len) {
+                    for (size_t j = ps; j < k; j++) word[j - ps] = (char)tolower((unsigned char)s[start + j]);
+                    fn(ud, word, k - ps);
+                }
+                ps = ch == '_' ? k + 1 : k;
+            }
+        }
+        for (size_t j = 0; j < len; j++) word[j] = (char)tolower((unsigned char)s[start + j]);
+        fn(ud, word, len);
+    }
+}
+
+typedef struct {
+    uint32_t *touched;
+    uint32_t count, cap;
+} ChunkTerms;
+
+static void scratch_reserve(void) {
+    uint32_t old = retrieval.scratch_cap;
+    retrieval.scratch = grow_array(retrieval.scratch, &retrieval.scratch_cap, retrieval.nterms, sizeof(uint32_t));
+    memset(retrieval.scratch + old, 0, sizeof(uint32_t) * (retrieval.scratch_cap - old));
+}
+
+static void chunk_term(void *ud, const char *term, size_t len) {
+    ChunkTerms *ct = ud;
+    uint32_t id = term_intern(term, len);
+    if (retrieval.terms[id].stop) return;
+    scratch_reserve();
+    if (retrieval.scratch[id]++ == 0) {
+        ct->touched = grow_array(ct->touched, &ct->cap, ct->count + 1, sizeof(uint32_t));
+        ct->touched[ct->count++] = id;
+    }
+}
+
+static void retrieval_add_chunk(int file, const char *base, uint32_t off, uint32_t len,
+                                uint32_t line_start, uint32_t line_end, ChunkTerms *ct) {
+    retrieval.chunks = grow_array(retrieval.chunks, &retrieval.chunks_cap, retrieval.nchunks + 1, sizeof(Chunk));
+    uint32_t cid = retrieval.nchunks++;
+    Chunk *ch = &retrieval.chunks[cid];
+    memset(ch, 0, sizeof(*ch));
+    ch->file = file;
+    ch->off = off;
+    ch->len = len;
+    ch->line_start = line_start;
+    ch->line_end = line_end;
+    
+    ct->count = 0;
+    tokenize_terms(base + off, len, chunk_term, ct);
+    for (uint32_t i = 0; i < ct->count; i++) {
+        uint32_t id = ct->touched[i];
+        Term *t = &retrieval.terms[id];
+        t->postings = grow_array(t->postings, &t->cap, t->count + 1, sizeof(Posting));
+        t->postings[t->count].chunk = cid;
+        t->postings[t->count].tf = retrieval.scratch[id];
+        t->count++;
+        ch->dl += retrieval.scratch[id];
+        retrieval.scratch[id] = 0;
+    }
+    retrieval.live_terms += ch->dl;
+    retrieval.live_chunks++;
+}
+
+static void retrieval_index_file(int slot, const char *full_path) {
+    RetrievalFile *rf = &retrieval.files[slot];
+    rf->first_chunk = retrieval.nchunks;
+    rf->nchunks = 0;
+    
+    int fd = open(full_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+    
+    size_t len = (size_t)st.st_size;
+    const char *nul = memchr(map, '\0', len);
+    if (nul) len = nul - map;
+    
+    ChunkTerms ct = {0};
+    uint32_t line = 1, chunk_line = 1, chunk_off = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (map[i] != '\n') continue;
+        line++;
+        if (line - chunk_line == RETRIEVAL_CHUNK_LINES) {
+            retrieval_add_chunk(slot, map, chunk_off, (uint32_t)(i + 1 - chunk_off), chunk_line, line - 1, &ct);
+            rf = &retrieval.files[slot];
+            rf->nchunks++;
+            chunk_line = line;
+            chunk_off = (uint32_t)(i + 1);
+        }
+    }
+    if (chunk_off < len) {
+        retrieval_add_chunk(slot, map, chunk_off, (uint32_t)(len - chunk_off), chunk_line, line, &ct);
+        retrieval.files[slot].nchunks++;
+    }
+    free(ct.touched);
+    munmap(map, st.st_size);
+}
+
+static void retrieval_drop_file(RetrievalFile *rf) {
+    for (uint32_t c = rf->first_chunk; c < rf->first_chunk + rf->nchunks; c++) {
+        if (retrieval.chunks[c].dead) continue;
+        retrieval.chunks[c].dead = 1;
+        retrieval.dead_chunks++;
+        retrieval.live_terms -= retrieval.chunks[c].dl;
+        retrieval.live_chunks--;
+    }
+    rf->nchunks = 0;
+    rf->live = 0;
+}
+
+static void retrieval_reset(void) {
+    for (uint32_t i = 0; i < retrieval.nterms; i++) free(retrieval.terms[i].postings);
+    for (uint32_t i = 0; i < retrieval.ntris; i++) free(retrieval.tris[i].terms);
+    for (int i = 0; i < retrieval.nfiles; i++) free(retrieval.files[i].path);
+    free(retrieval.chars);
+    free(retrieval.terms);
+    free(retrieval.term_slots);
+    free(retrieval.tris);
+    free(retrieval.tri_slots);
+    free(retrieval.chunks);
+    free(retrieval.files);
+    free(retrieval.file_slots);
+    free(retrieval.scratch);
+    free(retrieval.scores);
+    memset(&retrieval, 0, sizeof(retrieval));
+}
+
+static int retrieval_file_slot(const char *path, int create) {
+    size_t h;
+    if (retrieval.file_slots) {
+        h = hash_bytes(path, strlen(path), HASH_SEED) & retrieval.file_mask;
+        while (retrieval.file_slots[h] >= 0) {
+            if (strcmp(retrieval.files[retrieval.file_slots[h]].path, path) == 0) return retrieval.file_slots[h];
+            h = (h + 1) & retrieval.file_mask;
+        }
+    }
+    if (!create) return -1;
+    
+    retrieval.files = grow_array(retrieval.files, &retrieval.files_cap, (uint32_t)retrieval.nfiles + 1, sizeof(RetrievalFile));
+    int slot = retrieval.nfiles++;
+    memset(&retrieval.files[slot], 0, sizeof(RetrievalFile));
+    retrieval.files[slot].path = strdup(path);
+    if (!retrieval.files[slot].path) die("strdup");
+    
+    if (!retrieval.file_slots || (size_t)retrieval.nfiles * 2 > retrieval.file_mask) {
+        size_t n = retrieval.file_slots ? (retrieval.file_mask + 1) * 2 : 1024;
+        free(retrieval.file_slots);
+        retrieval.file_slots = slots_new(n);
+        retrieval.file_mask = n - 1;
+        for (int i = 0; i < retrieval.nfiles; i++) {
+            h = hash_bytes(retrieval.files[i].path, strlen(retrieval.files[i].path), HASH_SEED) & retrieval.file_mask;
+            while (retrieval.file_slots[h] >= 0) h = (h + 1) & retrieval.file_mask;
+            retrieval.file_slots[h] = i;
+        }
+    } else {
+        h = hash_bytes(path, strlen(path), HASH_SEED) & retrieval.file_mask;
+        while (retrieval.file_slots[h] >= 0) h = (h + 1) & retrieval.file_mask;
+        retrieval.file_slots[h] = slot;
+    }
+    return slot;
+}
+
+// Bring the retrieval index in line with file_list
+static void retrieval_sync(const Config *cfg) {
+    if (strcmp(retrieval.workdir, cfg->workdir) != 0 ||
+        (retrieval.nchunks > 4096 && retrieval.dead_chunks * 2 > retrieval.nchunks)) {
+        retrieval_reset();
+        memcpy(retrieval.workdir, cfg->workdir, sizeof(retrieval.workdir));
+    }
+    if (retrieval.nterms == 0) retrieval_init_vocab();
+    
+    int gen = ++retrieval.generation;
+    for (int i = 0; i < file_list.count; i++) {
+        FileEntry *fe = &file_list.files[i];
+        if (fe->is_dir || fe->size == 0 || fe->size >= cfg->max_file) continue;
+        if (file_content_class(cfg, fe) > CONTENT_TEXT) continue;
+        
+        int slot = retrieval_file_slot(fe->path, 1);
+        RetrievalFile *rf = &retrieval.files[slot];
+        rf->seen = gen;
+        rf->list_index = i;
+        if (rf->live && rf->mtime_ns == fe->mtime_ns && rf->size == fe->size) continue;
+        
+        retrieval_drop_file(rf);
+        char full_path[PATH_MAX_LEN];
+        if (path_join(full_path, sizeof(full_path), cfg->workdir, fe->path) != 0) continue;
+        retrieval_index_file(slot, full_path);
+        rf = &retrieval.files[slot];
+        rf->mtime_ns = fe->mtime_ns;
+        rf->size = fe->size;
+        rf->live = 1;
+    }
+    for (int i = 0; i < retrieval.nfiles; i++) {
+        if (retrieval.files[i].live && retrieval.files[i].seen != gen) retrieval_drop_file(&retrieval.files[i]);
+    }
+}
+
+typedef struct {
+    uint32_t *ids;
+    float *weights;
+    uint32_t count, ids_cap, weights_cap;
+} QueryTerms;
+
+static void query_add(QueryTerms *q, uint32_t id, float w) {
+    for (uint32_t i = 0; i < q->count; i++) {
+        if (q->ids[i] == id) {
+            if (w > q->weights[i]) q->weights[i] = w;
+            return;
+        }
+    }
+    q->ids = grow_array(q->ids, &q->ids_cap, q->count + 1, sizeof(uint32_t));
+    q->weights = grow_array(q->weights, &q->weights_cap, q->count + 1, sizeof(float));
+    q->ids[q->count] = id;
+    q->weights[q->count++] = w;
+}
+
+static void query_term(void *ud, const char *term, size_t len) {
+    QueryTerms *q = ud;
+    int id = term_find(term, len);
+    if (id >= 0) {
+        if (retrieval.terms[id].stop) return;
+        query_add(q, (uint32_t)id, 1.0f);
+    }
+    if (len < 4) return;
+    
+    // Vocabulary terms sharing most trigrams with this word
+    uint32_t ntri = (uint32_t)len - 2;
+    uint32_t *cand = NULL, ncand = 0, cap = 0;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        int t = tri_find(trigram_at(term + i));
+        if (t < 0) continue;
+        const TrigramList *tl = &retrieval.tris[t];
+        for (uint32_t k = 0; k < tl->count; k++) {
+            uint32_t tid = tl->terms[k];
+            if (retrieval.scratch[tid]++ == 0) {
+                cand = grow_array(cand, &cap, ncand + 1, sizeof(uint32_t));
+                cand[ncand++] = tid;
+            }
+        }
+    }
+    int added = 0;
+    for (uint32_t k = 0; k < ncand; k++) {
+        uint32_t tid = cand[k];
+        uint32_t shared = retrieval.scratch[tid];
+        retrieval.scratch[tid] = 0;
+        if ((int)tid == id || retrieval.terms[tid].stop || added >= RETRIEVAL_EXPANSIONS) continue;
+        uint32_t tlen = retrieval.terms[tid].len;
+        uint32_t other = tlen >= 3 ? tlen - 2 : 1;
+        float sim = (float)shared / (float)(ntri > other ? ntri : other);
+        if (sim >= 0.6f) {
+            query_add(q, tid, 0.6f * sim);
+            added++;
+        }
+    }
+    free(cand);
+}
+
+static int hit_cmp(const void *a, const void *b) {
+    const ChunkHit *x = a, *y = b;
+    if (x->score != y->score) return x->score < y->score ? 1 : -1;
+    return x->chunk < y->chunk ? -1 : (x->chunk > y->chunk);
+}
+
+// Rank chunks against text; returns the number of hits written
+static int retrieval_query(const char *text, ChunkHit *hits, int max_hits) {
+    if (retrieval.live_chunks == 0) return 0;
+    
+    scratch_reserve();
+    QueryTerms q = {0};
+    tokenize_terms(text, strlen(text), query_term, &q);
+    if (q.count == 0) return 0;
+    
+    uint32_t cap = retrieval.scores_cap;
+    if (retrieval.nchunks > cap) {
+        free(retrieval.scores);
+        retrieval.scores = calloc(retrieval.nchunks, sizeof(float));
+        if (!retrieval.scores) die("calloc");
+        retrieval.scores_cap = retrieval.nchunks;
+    }
+    
+    uint32_t *touched = NULL, ntouched = 0, tcap = 0;
+    float avgdl = (float)retrieval.live_terms / (float)retrieval.live_chunks;
+    for (uint32_t i = 0; i < q.count; i++) {
+        const Term *t = &retrieval.terms[q.ids[i]];
+        uint32_t df = 0;
+        for (uint32_t k = 0; k < t->count; k++) df += !retrieval.chunks[t->postings[k].chunk].dead;
+        if (df == 0) continue;
+        float idf = logf(1.0f + ((float)retrieval.live_chunks - df + 0.5f) / (df + 0.5f));
+        
+        for (uint32_t k = 0; k < t->count; k++) {
+            const Posting *p = &t->postings[k];
+            const Chunk *ch = &retrieval.chunks[p->chunk];
+            if (ch->dead) continue;
+            float tf = (float)p->tf;
+            float s = idf * tf * (BM25_K1 + 1) / (tf + BM25_K1 * (1 - BM25_B + BM25_B * ch->dl / avgdl));
+            if (retrieval.scores[p->chunk] == 0) {
+                touched = grow_array(touched, &tcap, ntouched + 1, sizeof(uint32_t));
+                touched[ntouched++] = p->chunk;
+            }
+            retrieval.scores[p->chunk] += q.weights[i] * s;
+        }
+    }
+    
+    ChunkHit *all = malloc(sizeof(ChunkHit) * (ntouched + 1));
+    if (!all) die("malloc");
+    for (uint32_t i = 0; i < ntouched; i++) {
+        all[i].chunk = touched[i];
+        all[i].score = retrieval.scores[touched[i]];
+        retrieval.scores[touched[i]] = 0;
+    }
+    qsort(all, ntouched, sizeof(ChunkHit), hit_cmp);
+    
+    // Best chunks, at most a few per file
+    int n = 0;
+    for (uint32_t i = 0; i < ntouched && n < max_hits; i++) {
+        int file = retrieval.chunks[all[i].chunk].file, same = 0;
+        for (int k = 0; k < n; k++) same += retrieval.chunks[hits[k].chunk].file == file;
+        if (same < RETRIEVAL_PER_FILE) hits[n++] = all[i];
+    }
+    
+    free(all);
+    free(touched);
+    free(q.ids);
+    free(q.weights);
+    return n;
+}
+
+// Code chunks most relevant to the task, best first, within token_budget
+static size_t append_relevant_code(const Config *cfg, const char *task, Buffer *out, size_t token_budget) {
+    if (!cfg->include_code || token_budget < 64) return 0;
+    
+    retrieval_sync(cfg);
+    ChunkHit hits[RETRIEVAL_MAX_HITS];
+    int n = retrieval_query(task, hits, RETRIEVAL_MAX_HITS);
+    
+    size_t start_len = out->len, used = estimate_tokens(64);
+    int emitted = 0;
+    for (int i = 0; i < n; i++) {
+        const Chunk *ch = &retrieval.chunks[hits[i].chunk];
+        const RetrievalFile *rf = &retrieval.files[ch->file];
+        size_t t = estimate_tokens(ch->len + strlen(rf->path) + 48);
+        if (used + t > token_budget) continue;
+        
+        // Whole file is already in the repository context
+        if (file_list.files[rf->list_index].in_context) continue;
+        
+        char full_path[PATH_MAX_LEN];
+        if (path_join(full_path, sizeof(full_path), cfg->workdir, rf->path) != 0) continue;
+        int fd = open(full_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        
+        if (emitted++ == 0) buffer_append(out, "<|relevant_code|>\n");
+        buffer_append_fmt(out, "### %s (lines %u-%u)\n```\n", rf->path, ch->line_start, ch->line_end);
+        buffer_ensure_capacity(out, ch->len);
+        ssize_t r = pread(fd, out->data + out->len, ch->len, ch->off);
+        close(fd);
+        if (r > 0) out->len += (size_t)r;
+        out->data[out->len] = '\0';
+        buffer_append(out, "\n```\n\n");
+        used += t;
+    }
+    if (emitted) buffer_append(out, "<|endofrelevant|>\n\n");
+    return emitted ? estimate_tokens(out->len - start_len) : 0;
+}
+
+// Enhanced prompt building
+static void append_system_prompt(Buffer *out, const Config *cfg) {
+    buffer_append(out,
+        "<|system|>\n"
+        "You are Devstral, an advanced repository agent specialized in code analysis and modification.\n\n"
+        "Core Capabilities:\n"
+        "- Comprehensive code analysis with architectural insights\n"
+        "- Precise file modifications with context awareness\n"
+        "- Test-driven development support\n"
+        "- Refactoring and optimization suggestions\n\n");
+    
+    if (strcmp(cfg->mode, "edit") == 0) {
+        buffer_append(out,
+            "EDIT MODE - Output format for file changes:\n"
+            "<<<FILE: path/to/file.ext>>>\n"
+            "<<<SEARCH>>>\n"
+            "existing lines to change, copied exactly\n"
+            "<<<REPLACE>>>\n"
+            "new lines\n"
+            "<<<END>>>\n\n"
+            "- Only output the lines that change, with a little context to make SEARCH unique\n"
+            "- Several SEARCH/REPLACE blocks may follow one FILE line, in file order\n"
+            "- An empty SEARCH appends; a unified diff inside <<<DIFF>>> ... <<<END>>> also works\n"
+            "- For new files or complete rewrites only:\n"
+            "<<<FILE: path/to/file.ext>>>\n"
+            "<<<REPLACEMENT_START>>>\n"
+            "complete new file content here\n"
+            "<<<REPLACEMENT_END>>>\n\n"
+            "- Multiple files can be edited in one response\n"
+            "- Include clear explanations before changes\n"
+            "- Before the first change, name every file you will change on one line:\n"
+            "<<<FILES: path/one.c path/two.h>>>\n"
+            "- After the last change, write <<<DONE>>> and stop\n\n");
+    } else if (strcmp(cfg->mode, "agent") == 0) {
+        buffer_append(out,
+            "AGENT MODE - Autonomous problem solving:\n"
+            "1. Analyze the repository structure and understand the codebase\n"
+            "2. Create a detailed plan with specific steps\n"
+            "3. Implement changes systematically\n"
+            "4. Suggest tests and validation steps\n"
+            "5. Provide file modifications in EDIT format when needed\n\n");
+    }
+    
+    buffer_append(out, "<|endofsystem|>\n\n");
+}
+
+// Conversation history
+static uint32_t history_check(const HistoryRecord *r) {
+    uint64_t h = hash_bytes(r, offsetof(HistoryRecord, check), HASH_SEED);
+    return (uint32_t)hash_bytes(&r->time, sizeof(r->time), h);
+}
+
+static int history_record_ok(const char *p, size_t avail) {
+    HistoryRecord r;
+    if (avail < sizeof(r)) return 0;
+    memcpy(&r, p, sizeof(r));
+    return r.magic == HISTORY_MAGIC && r.check == history_check(&r) &&
+           (uint64_t)r.prompt_len + r.response_len + 2 <= avail - sizeof(r);
+}
+
+static size_t history_record_size(const char *p) {
+    HistoryRecord r;
+    memcpy(&r, p, sizeof(r));
+    return sizeof(r) + r.prompt_len + r.response_len + 2;
+}
+
+// Map the log up to its current size
+static int history_remap(void) {
+    struct stat st;
+    if (history.log_fd < 0 || fstat(history.log_fd, &st) != 0) return -1;
+    if ((size_t)st.st_size == history.map_len) return 0;
+    if (history.map) munmap(history.map, history.map_len);
+    history.map = NULL;
+    history.map_len = 0;
+    if (st.st_size == 0) return 0;
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history.log_fd, 0);
+    if (m == MAP_FAILED) return -1;
+    history.map = m;
+    history.map_len = (size_t)st.st_size;
+    return 0;
+}
+
+static void history_close(void) {
+    if (history.map) munmap(history.map, history.map_len);
+    if (history.log_fd >= 0) close(history.log_fd);
+    if (history.idx_fd >= 0) close(history.idx_fd);
+    free(history.offsets);
+    free(history.arena);
+    for (int i = 0; i < HISTORY_CONTEXT_TURNS; i++) {
+        free(history.digests[i].full);
+        free(history.digests[i].brief);
+        free(history.digests[i].line);
+    }
+    memset(&history, 0, sizeof(history));
+    history.log_fd = history.idx_fd = -1;
+}
+
+// Open the session log of workdir, indexing any records the index missed
+static void history_open(const char *workdir) {
+    if (history.opened && strcmp(history.workdir, workdir) == 0) return;
+    history_close();
+    history.opened = 1;
+    snprintf(history.workdir, sizeof(history.workdir), "%s", workdir);
+    
+    char dir[PATH_MAX_LEN / 2], path[PATH_MAX_LEN];
+    if (cache_dir(dir, sizeof(dir)) != 0) return;
+    unsigned long long key = (unsigned long long)hash_bytes(workdir, strlen(workdir), HASH_SEED);
+    snprintf(path, sizeof(path), "%s/history-%016llx.log", dir, key);
+    history.log_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    snprintf(path, sizeof(path), "%s/history-%016llx.idx", dir, key);
+    history.idx_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (history.log_fd < 0 || history.idx_fd < 0 || history_remap() != 0) {
+        history_close();
+        history.opened = 1;
+        snprintf(history.workdir, sizeof(history.workdir), "%s", workdir);
+        return;
+    }
+    
+    // Trust the index as far as it points at valid records
+    struct stat st;
+    uint32_t n = 0;
+    if (fstat(history.idx_fd, &st) == 0 && st.st_size >= (off_t)sizeof(uint64_t)) {
+        n = (uint32_t)(st.st_size / sizeof(uint64_t));
+        history.offsets = grow_array(NULL, &history.offsets_cap, n, sizeof(uint64_t));
+        if (pread(history.idx_fd, history.offsets, n * sizeof(uint64_t), 0) != (ssize_t)(n * sizeof(uint64_t))) n = 0;
+    }
+    while (n > 0 && (history.offsets[n - 1] >= history.map_len ||
+                     !history_record_ok(history.map + history.offsets[n - 1], history.map_len - history.offsets[n - 1]))) {
+        n--;
+    }
+    for (uint32_t i = 1; i < n; i++) {
+        if (history.offsets[i] <= history.offsets[i - 1]) n = i;
+    }
+    size_t end = n ? history.offsets[n - 1] + history_record_size(history.map + history.offsets[n - 1]) : 0;
+    uint32_t indexed = n;
+    
+    // Records appended after the index was last written (or a torn tail)
+    while (end < history.map_len && history_record_ok(history.map + end, history.map_len - end)) {
+        history.offsets = grow_array(history.offsets, &history.offsets_cap, n + 1, sizeof(uint64_t));
+        history.offsets[n++] = end;
+        end += history_record_size(history.map + end);
+    }
+    if (end < history.map_len) {
+        if (ftruncate(history.log_fd, end) == 0) history_remap();
+    }
+    if (ftruncate(history.idx_fd, indexed * sizeof(uint64_t)) == 0 && n > indexed) {
+        if (pwrite(history.idx_fd, history.offsets + indexed, (n - indexed) * sizeof(uint64_t),
+                   indexed * sizeof(uint64_t)) < 0) {
+            // Rebuilt again on the next start
+        }
+    }
+    history.count = (int)n;
+    history.logged = n;
+}
+
+// Make room for len bytes in the arena, dropping the oldest ring entries
+// that would be overwritten. Returns the offset, or SIZE_MAX if too big.
+static size_t history_arena_alloc(size_t len) {
+    if (len > HISTORY_ARENA_MAX) return SIZE_MAX;
+    size_t live = 0;
+    for (uint32_t k = 0; k < history.ring_count; k++) {
+        const HistoryEntry *e = &history.ring[(history.ring_first + k) % HISTORY_RING];
+        live += e->prompt_len + e->response_len + 2;
+    }
+    
+    // Grow while below the cap, compacting the ring into the new arena
+    if (history.arena_cap < HISTORY_ARENA_MAX && live + len > history.arena_cap) {
+        size_t cap = history.arena_cap ? history.arena_cap : 64 * 1024;
+        while (cap < live + len && cap < HISTORY_ARENA_MAX) cap *= 2;
+        if (cap > HISTORY_ARENA_MAX) cap = HISTORY_ARENA_MAX;
+        char *arena = malloc(cap);
+        if (!arena) die("malloc");
+        size_t pos = 0;
+        for (uint32_t k = 0; k < history.ring_count; k++) {
+            HistoryEntry *e = &history.ring[(history.ring_first + k) % HISTORY_RING];
+            size_t n = e->prompt_len + e->response_len + 2;
+            memcpy(arena + pos, history.arena + e->off, n);
+            e->off = pos;
+            pos += n;
+        }
+        free(history.arena);
+        history.arena = arena;
+        history.arena_cap = cap;
+        history.arena_head = pos;
+    }
+    
+    size_t pos = history.arena_head;
+    if (pos + len > history.arena_cap) pos = 0;
+    for (;;) {
+        int overlap = 0;
+        for (uint32_t k = 0; k < history.ring_count && !overlap; k++) {
+            const HistoryEntry *e = &history.ring[(history.ring_first + k) % HISTORY_RING];
+            overlap = e->off < pos + len && pos < e->off + e->prompt_len + e->response_len + 2;
+        }
+        if (!overlap) break;
+        history.ring_first = (history.ring_first + 1) % HISTORY_RING;
+        history.ring_count--;
+    }
+    history.arena_head = pos + len;
+    return pos;
+}
+
+// Record a finished exchange in memory and in the session log
+static void history_add(const char *prompt, const char *response) {
+    HistoryRecord r = {0};
+    r.magic = HISTORY_MAGIC;
+    r.prompt_len = (uint32_t)strlen(prompt);
+    r.response_len = (uint32_t)strlen(response);
+    r.time = (int64_t)time(NULL);
+    r.check = history_check(&r);
+    
+    size_t off = history_arena_alloc((size_t)r.prompt_len + r.response_len + 2);
+    if (off != SIZE_MAX) {
+        if (history.ring_count == HISTORY_RING) {
+            history.ring_first = (history.ring_first + 1) % HISTORY_RING;
+            history.ring_count--;
+        }
+        HistoryEntry *e = &history.ring[(history.ring_first + history.ring_count++) % HISTORY_RING];
+        e->seq = (uint32_t)history.count;
+        e->off = off;
+        e->prompt_len = r.prompt_len;
+        e->response_len = r.response_len;
+        memcpy(history.arena + off, prompt, r.prompt_len + 1);
+        memcpy(history.arena + off + r.prompt_len + 1, response, r.response_len + 1);
+    }
+    
+    if (history.log_fd >= 0) {
+        struct iovec iov[3] = {
+            { &r, sizeof(r) },
+            { (void *)prompt, r.prompt_len + 1 },
+            { (void *)response, r.response_len + 1 },
+        };
+        size_t total = sizeof(r) + r.prompt_len + r.response_len + 2;
+        off_t end;
+        if (writev(history.log_fd, iov, 3) == (ssize_t)total && (end = lseek(history.log_fd, 0, SEEK_CUR)) >= 0) {
+            uint64_t at = (uint64_t)end - total;
+            history.offsets = grow_array(history.offsets, &history.offsets_cap, history.logged + 1, sizeof(uint64_t));
+            history.offsets[history.logged] = at;
+            if (pwrite(history.idx_fd, &at, sizeof(at), history.logged * sizeof(uint64_t)) < 0) {
+                // The next start re-indexes from the log
+            }
+            history.logged++;
+        } else {
+            // Keep the logged exchanges a prefix: the rest of the session stays in memory
+            close(history.log_fd);
+            history.log_fd = -1;
+        }
+    }
+    history.count++;
+}
+
+// Exchange i (0 = oldest); the strings stay valid until the next history_add()
+static void history_get(int i, const char **prompt, const char **response) {
+    *prompt = *response = "";
+    if (i < 0 || i >= history.count) return;
+    if (history.ring_count > 0) {
+        uint32_t first = history.ring[history.ring_first].seq;
+        if ((uint32_t)i >= first && (uint32_t)i - first < history.ring_count) {
+            const HistoryEntry *e = &history.ring[(history.ring_first + (uint32_t)i - first) % HISTORY_RING];
+            *prompt = history.arena + e->off;
+            *response = history.arena + e->off + e->prompt_len + 1;
+            return;
+        }
+    }
+    if ((uint32_t)i >= history.logged) return;
+    uint64_t off = history.offsets[i];
+    if (off + sizeof(HistoryRecord) > history.map_len) history_remap();
+    if (off >= history.map_len || !history_record_ok(history.map + off, history.map_len - off)) {
+        if (history_remap() != 0 || off >= history.map_len ||
+            !history_record_ok(history.map + off, history.map_len - off)) return;
+    }
+    HistoryRecord r;
+    memcpy(&r, history.map + off, sizeof(r));
+    *prompt = history.map + off + sizeof(r);
+    *response = *prompt + r.prompt_len + 1;
+}
+
+// Compaction of past exchanges. File blocks are reduced to what they
+// touched, code fences are kept whole or dropped whole, and prose is cut
+// at a sentence end, so nothing is ever cut mid-block.
+typedef struct {
+    char name[96];
+    int hunks;   // SEARCH and DIFF blocks
+    int lines;   // of complete replacements
+} DigestFile;
+
+static void digest_files_text(const DigestFile *files, int n, int more, int with_detail, Buffer *out) {
+    for (int i = 0; i < n; i++) {
+        if (i) buffer_append(out, ", ");
+        if (!with_detail) {
+            buffer_append(out, files[i].name);
+        } else if (files[i].hunks) {
+            buffer_append_fmt(out, "edited %s (%d hunk%s)", files[i].name, files[i].hunks, files[i].hunks == 1 ? "" : "s");
+        } else {
+            buffer_append_fmt(out, "rewrote %s (%d lines)", files[i].name, files[i].lines);
+        }
+    }
+    if (more) buffer_append_fmt(out, " and %d more", more);
+}
+
+// Append up to max bytes of text, ending at a sentence end when there is one
+static void append_sentences(Buffer *out, const char *text, size_t len, size_t max) {
+    if (len <= max) {
+        buffer_append_n(out, text, len);
+        return;
+    }
+    size_t cut = 0;
+    for (size_t i = 0; i + 1 < max; i++) {
+        if ((text[i] == '.' || text[i] == '!' || text[i] == '?' || text[i] == ':') &&
+            (text[i + 1] == ' ' || text[i + 1] == '\n')) {
+            cut = i + 1;
+        }
+    }
+    if (cut < max / 3) {
+        // No sentence end early enough; cut at a word
+        cut = max;
+        while (cut > max / 2 && text[cut] != ' ' && text[cut] != '\n') cut--;
+    }
+    buffer_append_n(out, text, cut);
+    buffer_append(out, " ...");
+}
+
+static const HistoryDigest *history_digest(int i) {
+    HistoryDigest *d = &history.digests[(uint32_t)i % HISTORY_CONTEXT_TURNS];
+    if (d->seq_plus1 == (uint32_t)i + 1) return d;
+    free(d->full);
+    free(d->brief);
+    free(d->line);
+    memset(d, 0, sizeof(*d));
+    
+    const char *prompt, *response;
+    history_get(i, &prompt, &response);
+    
+    // One pass: prose (with and without code fences) and the files touched
+    Buffer prose, with_code;
+    buffer_init(&prose);
+    buffer_init(&with_code);
+    DigestFile files[16];
+    int nfiles = 0, more = 0, in_fence = 0, in_body = 0, in_file = 0;
+    for (const char *p = response; *p; ) {
+        const char *nl = strchr(p, '\n');
+        size_t len = nl ? (size_t)(nl - p) : strlen(p);
+        const char *next = p + len + (nl ? 1 : 0);
+        
+        if (strncmp(p, "<<<FILE:", 8) == 0) {
+            const char *name = p + 8;
+            while (*name == ' ') name++;
+            const char *end = strstr(name, ">>>");
+            size_t n = end && end < p + len ? (size_t)(end - name) : (size_t)(p + len - name);
+            in_file = nfiles < 16;
+            if (in_file) {
+                memset(&files[nfiles], 0, sizeof(DigestFile));
+                snprintf(files[nfiles].name, sizeof(files[nfiles].name), "%.*s", (int)n, name);
+                nfiles++;
+            } else {
+                more++;
+            }
+            in_body = 0;
+        } else if (strncmp(p, "<<<SEARCH>>>", 12) == 0 || strncmp(p, "<<<DIFF>>>", 10) == 0) {
+            if (in_file && nfiles) files[nfiles - 1].hunks++;
+            in_body = 1;
+        } else if (strncmp(p, "<<<REPLACEMENT_START>>>", 23) == 0) {
+            in_body = 2;
+        } else if (strncmp(p, "<<<END>>>", 9) == 0 || strncmp(p, "<<<REPLACEMENT_END>>>", 21) == 0) {
+            in_body = 0;
+        } else if (strncmp(p, "<<<", 3) == 0) {
+            // REPLACE and other markers inside a block
+        } else if (in_body) {
+            if (in_body == 2 && in_file && nfiles) files[nfiles - 1].lines++;
+        } else if (strncmp(p, "```", 3) == 0) {
+            in_fence = !in_fence;
+            buffer_append_n(&with_code, p, len);
+            buffer_append(&with_code, "\n");
+        } else {
+            buffer_append_n(&with_code, p, len);
+            buffer_append(&with_code, "\n");
+            if (!in_fence && len > 0) {
+                if (prose.len) buffer_append(&prose, " ");
+                buffer_append_n(&prose, p, len);
+            }
+        }
+        p = next;
+    }
+    if (in_fence) buffer_append(&with_code, "```\n");
+    
+    Buffer changes;
+    buffer_init(&changes);
+    if (nfiles) {
+        buffer_append(&changes, "[changes: ");
+        digest_files_text(files, nfiles, more, 1, &changes);
+        buffer_append(&changes, "]");
+    }
+    
+    Buffer b;
+    size_t prompt_len = strlen(prompt);
+    if (prompt_len + with_code.len + changes.len <= HISTORY_FULL_MAX) {
+        buffer_init(&b);
+        buffer_append_fmt(&b, "User: %s\nAssistant: ", prompt);
+        buffer_append_n(&b, with_code.data, with_code.len);
+        if (changes.len) buffer_append_fmt(&b, "%s\n", changes.data);
+        buffer_append(&b, "\n");
+        d->full = buffer_detach(&b);
+    }
+    
+    buffer_init(&b);
+    buffer_append(&b, "User: ");
+    append_sentences(&b, prompt, prompt_len, 300);
+    buffer_append(&b, "\nAssistant (summary): ");
+    append_sentences(&b, prose.data, prose.len, HISTORY_BRIEF_MAX);
+    if (changes.len) buffer_append_fmt(&b, " %s", changes.data);
+    buffer_append(&b, "\n\n");
+    d->brief = buffer_detach(&b);
+    
+    buffer_init(&b);
+    buffer_append(&b, "- ");
+    const char *eol = strchr(prompt, '\n');
+    append_sentences(&b, prompt, eol ? (size_t)(eol - prompt) : prompt_len, 120);
+    if (nfiles) {
+        buffer_append(&b, " -> changed ");
+        digest_files_text(files, nfiles > 4 ? 4 : nfiles, more + (nfiles > 4 ? nfiles - 4 : 0), 0, &b);
+    }
+    buffer_append(&b, "\n");
+    d->line = buffer_detach(&b);
+    
+    buffer_free(&prose);
+    buffer_free(&with_code);
+    buffer_free(&changes);
+    d->seq_plus1 = (uint32_t)i + 1;
+    return d;
+}
+
+// Fit recent history into token_budget, newest first: the latest
+// exchanges verbatim (file bodies reduced to what they touched), older
+// ones as summaries, the oldest as one line each.
+static size_t build_conversation_context(Buffer *out, size_t token_budget) {
+    if (history.count == 0) return 0;
+    
+    enum { LEVEL_FULL, LEVEL_BRIEF, LEVEL_LINE, LEVEL_NONE };
+    int first = history.count > HISTORY_CONTEXT_TURNS ? history.count - HISTORY_CONTEXT_TURNS : 0;
+    int levels[HISTORY_CONTEXT_TURNS];
+    size_t bytes = 64; // tags and the "Earlier" heading
+    int cap = LEVEL_FULL, start = history.count;
+    
+    for (int i = history.count - 1; i >= first; i--) {
+        int age = history.count - 1 - i;
+        int level = age < 2 ? LEVEL_FULL : age < 6 ? LEVEL_BRIEF : LEVEL_LINE;
+        if (level < cap) level = cap; // once short of budget, older ones get no richer
+        
+        const HistoryDigest *d = history_digest(i);
+        for (; level < LEVEL_NONE; level++) {
+            const char *text = level == LEVEL_FULL ? d->full : level == LEVEL_BRIEF ? d->brief : d->line;
+            if (!text) continue; // too long to keep verbatim
+            if (estimate_tokens(bytes + strlen(text)) <= token_budget) {
+                bytes += strlen(text);
+                break;
+            }
+            cap = level + 1;
+        }
+        if (level == LEVEL_NONE) break;
+        levels[i - first] = level;
+        start = i;
+    }
+    
+    prompt_stats.dropped_history = start - first;
+    prompt_stats.compacted_history = 0;
+    if (start == history.count) return 0;
+    
+    buffer_append(out, "<|conversation_history|>\n");
+    int in_list = 0;
+    for (int i = start; i < history.count; i++) {
+        const HistoryDigest *d = history_digest(i);
+        int level = levels[i - first];
+        if (level != LEVEL_FULL) prompt_stats.compacted_history++;
+        if (level == LEVEL_LINE && !in_list) {
+            buffer_append(out, "Earlier in this session:\n");
+            in_list = 1;
+        } else if (level != LEVEL_LINE && in_list) {
+            buffer_append(out, "\n");
+            in_list = 0;
+        }
+        buffer_append(out, level == LEVEL_FULL ? d->full : level == LEVEL_BRIEF ? d->brief : d->line);
+    }
+    if (in_list) buffer_append(out, "\n");
+    buffer_append(out, "<|endofhistory|>\n\n");
+    return estimate_tokens(bytes);
+}
+
+// Layout: system prompt -> repository context -> history -> relevant code -> task.
+// The first two change rarely, so they form a stable prefix the model can reuse.
+static void build_enhanced_prompt(const Config *cfg, const char *task, Buffer *out) {
+    size_t budget = context_budget(cfg);
+    prompt_stats.dropped[0] = '\0';
+    prompt_stats.dropped_files = prompt_stats.dropped_entries = prompt_stats.dropped_history = 0;
+    prompt_stats.skipped_files = prompt_stats.aliased_files = 0;
+    
+    append_system_prompt(out, cfg);
+    
+    // The system prompt is not negotiable. What is left splits into the
+    // repository block and a suffix (task, history, relevant code); the
+    // split is fixed by the budget alone, so the repository block and with
+    // it the cached prefix stay the same from one task to the next
+    size_t used = estimate_tokens(out->len);
+    size_t left = budget > used ? budget - used : 0;
+    size_t suffix = left / 4;
+    
+    // The task comes out of the suffix; only one too long for it all
+    // shrinks the repository block
+    size_t task_tokens = estimate_tokens(strlen(task) + 64);
+    if (task_tokens > left) task_tokens = left;
+    if (suffix < task_tokens) suffix = task_tokens;
+    size_t relevant = cfg->include_code ? (suffix - task_tokens) / 2 : 0;
+    
+    // Add repository context, written in place
+    buffer_append(out, "<|repository_context|>\n");
+    size_t repo_tokens = build_repo_context(cfg, out, cfg->include_code, left - suffix);
+    buffer_append(out, "<|endofcontext|>\n\n");
+    left = left > repo_tokens + task_tokens ? left - repo_tokens - task_tokens : 0;
+    
+    prompt_stats.prefix_hash = hash_bytes(out->data, out->len, HASH_SEED);
+    
+    // Add conversation history for context
+    size_t history_slice = cfg->history_tokens ? cfg->history_tokens : budget / 8;
+    if (history_slice > (left > relevant ? left - relevant : 0)) history_slice = left > relevant ? left - relevant : 0;
+    size_t history_tokens = build_conversation_context(out, history_slice);
+    left = left > history_tokens ? left - history_tokens : 0;
+    
+    // Add the code most relevant to this task
+    append_relevant_code(cfg, task, out, left);
+    
+    // Add user query
+    buffer_append(out, "<|user|>\n");
+    buffer_append_fmt(out, "%s\n", task);
+    buffer_append(out, "<|endofuser|>\n\n");
+    
+    // Add assistant tag for response
+    buffer_append(out, "<|assistant|>\n");
+    
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) prompt_stats.peak_rss_kb = ru.ru_maxrss;
+    prompt_stats.prompt_bytes = out->len;
+    prompt_stats.prompt_tokens = estimate_tokens(out->len);
+    prompt_stats.budget_tokens = budget;
+}
+
+// Parse file changes from response. Per <<<FILE: path>>> block the model
+// gives either complete content (REPLACEMENT_START/END) or hunks: SEARCH/
+// REPLACE/END blocks or a unified diff in DIFF/END. Bare unified diffs
+// (--- a/x, +++ b/x, @@ ...) are picked up as well.
+// Changes and their text live in turn_arena until the turn ends
+static void edit_hunk_add(FileChange *change, char *search, char *replace, int line_hint) {
+    if (change->num_hunks % 8 == 0) {
+        change->hunks = arena_grow(&turn_arena, change->hunks, sizeof(EditHunk) * change->num_hunks,
+                                   sizeof(EditHunk) * (change->num_hunks + 8));
+    }
+    EditHunk *h = &change->hunks[change->num_hunks++];
+    h->search = search;
+    h->replace = replace;
+    h->line_hint = line_hint;
+}
+
+// Copy [s, e) dropping one trailing newline
+static char *dup_block(const char *s, const char *e) {
+    if (e > s && e[-1] == '\n') e--;
+    return arena_strndup(&turn_arena, s, e - s);
+}
+
+static const char *next_line(const char *p) {
+    const char *nl = strchr(p, '\n');
+    return nl ? nl + 1 : p + strlen(p);
+}
+
+// Unified diff hunks starting at p (an "@@" line); stops at the first line
+// that is not part of a hunk and returns it
+static const char *parse_diff_hunks(const char *p, FileChange *change) {
+    while (strncmp(p, "@@", 2) == 0) {
+        int hint = 0;
+        sscanf(p, "@@ -%d", &hint);
+        p = next_line(p);
+        
+        // Scratch for the two sides, reused across hunks and turns
+        static Buffer search, replace;
+        if (!search.data) {
+            buffer_init(&search);
+            buffer_init(&replace);
+        }
+        buffer_clear(&search);
+        buffer_clear(&replace);
+        while (*p && strncmp(p, "@@", 2) != 0 && strncmp(p, "<<<", 3) != 0 &&
+               strncmp(p, "```", 3) != 0 && strncmp(p, "--- ", 4) != 0) {
+            const char *e = next_line(p);
+            if (*p == ' ' || *p == '\n') {
+                const char *body = *p == ' ' ? p + 1 : p; // blank context may lose its space
+                buffer_append_n(&search, body, e - body);
+                buffer_append_n(&replace, body, e - body);
+            } else if (*p == '-') {
+                buffer_append_n(&search, p + 1, e - p - 1);
+            } else if (*p == '+') {
+                buffer_append_n(&replace, p + 1, e - p - 1);
+            } else if (*p != '\\') { // "\ No newline at end of file"
+                break;
+            }
+            p = e;
+        }
+        // Trailing blank context is usually just the gap before the next block
+        while (search.len >= 2 && replace.len >= 2 &&
+               strcmp(search.data + search.len - 2, "\n\n") == 0 &&
+               strcmp(replace.data + replace.len - 2, "\n\n") == 0) {
+            search.data[--search.len] = '\0';
+            replace.data[--replace.len] = '\0';
+        }
+        edit_hunk_add(change, dup_block(search.data, search.data + search.len),
+                      dup_block(replace.data, replace.data + replace.len), hint);
+    }
+    return p;
+}
+
+// The change for path, added when new; the array grows in the arena
+static FileChange *file_change_for(FileChange **changes, int *num_changes, const char *path, size_t len) {
+    if (len == 0 || len >= PATH_MAX_LEN) return NULL;
+    for (int i = 0; i < *num_changes; i++) {
+        if (strlen((*changes)[i].filepath) == len && strncmp((*changes)[i].filepath, path, len) == 0) {
+            return &(*changes)[i];
+        }
+    }
+    if (*num_changes >= MAX_PLAN_FILES) return NULL;
+    if (*num_changes % 8 == 0) {
+        *changes = arena_grow(&turn_arena, *changes, sizeof(FileChange) * *num_changes,
+                              sizeof(FileChange) * (*num_changes + 8));
+    }
+    FileChange *change = &(*changes)[(*num_changes)++];
+    memset(change, 0, sizeof(*change));
+    memcpy(change->filepath, path, len);
+    change->filepath[len] = '\0';
+    return change;
+}
+
+// Response text a <<<FILE:>>> section consumed, blocks included
+typedef struct {
+    const char *start, *end;
+} ParsedSpan;
+
+// Changes are arena memory: they go with the turn's arena_reset()
+static int parse_file_changes(const char *response, FileChange **changes, int *num_changes) {
+    *num_changes = 0;
+    *changes = NULL;
+    ParsedSpan *spans = NULL;
+    int num_spans = 0, spans_cap = 0;
+    
+    const char *p = response;
+    while ((p = strstr(p, "<<<FILE:")) != NULL) {
+        if (num_spans == spans_cap) {
+            int cap = spans_cap ? spans_cap * 2 : 16;
+            spans = arena_grow(&turn_arena, spans, sizeof(ParsedSpan) * spans_cap, sizeof(ParsedSpan) * cap);
+            spans_cap = cap;
+        }
+        ParsedSpan *span = &spans[num_spans++];
+        span->start = p;
+        span->end = p + 8;
+        p += 8; // Skip "<<<FILE:"
+        while (*p == ' ') p++;
+        
+        // Extract filename
+        const char *end = strstr(p, ">>>");
+        if (!end) break;
+        size_t len = end - p;
+        while (len > 0 && p[len - 1] == ' ') len--;
+        FileChange *change = file_change_for(changes, num_changes, p, len);
+        p = next_line(end + 3);
+        span->end = p;
+        if (!change) continue;
+        
+        // Any number of blocks until the next file
+        for (;;) {
+            while (*p == '\n' || *p == ' ' || *p == '\r') p++;
+            if (strncmp(p, "<<<REPLACEMENT_START>>>", 23) == 0) {
+                p = next_line(p + 23);
+                const char *content_end = strstr(p, "<<<REPLACEMENT_END>>>");
+                if (!content_end) break;
+                change->content = arena_strndup(&turn_arena, p, content_end - p);
+                p = content_end + 21;
+            } else if (strncmp(p, "<<<SEARCH>>>", 12) == 0) {
+                const char *s = next_line(p + 12);
+                const char *r = strstr(s, "<<<REPLACE>>>");
+                const char *e = r ? strstr(r, "<<<END>>>") : NULL;
+                if (!e) break;
+                const char *rs = next_line(r + 13);
+                edit_hunk_add(change, dup_block(s, r), dup_block(rs < e ? rs : e, e), 0);
+                p = e + 9;
+            } else if (strncmp(p, "<<<DIFF>>>", 10) == 0) {
+                p = next_line(p + 10);
+                while (*p && strncmp(p, "@@", 2) != 0 && strncmp(p, "<<<", 3) != 0) p = next_line(p);
+                p = parse_diff_hunks(p, change);
+                if (strncmp(p, "<<<END>>>", 9) == 0) p += 9;
+            } else {
+                break;
+            }
+            span->end = p;
+        }
+        if (!change->content && change->num_hunks == 0) {
+            (*num_changes)--; // header without usable blocks
+        }
+    }
+    
+    // Bare unified diffs, outside the sections above
+    int k = 0;
+    for (p = response; (p = strstr(p, "\n+++ ")) != NULL; p++) {
+        while (k < num_spans && spans[k].end <= p) k++;
+        if (k < num_spans && spans[k].start <= p) continue;
+        const char *prev = p - 1;
+        while (prev > response && prev[-1] != '\n') prev--;
+        if (strncmp(prev, "--- ", 4) != 0) continue;
+        
+        const char *path = p + 5;
+        if (strncmp(path, "b/", 2) == 0) path += 2;
+        size_t len = strcspn(path, "\t\n");
+        if (len == 9 && strncmp(path, "/dev/null", 9) == 0) continue; // deletions are not applied
+        const char *h = next_line(p + 1);
+        if (strncmp(h, "@@", 2) != 0) continue;
+        
+        FileChange *change = file_change_for(changes, num_changes, path, len);
+        if (change && !change->content) parse_diff_hunks(h, change);
+    }
+    
+    if (*num_changes == 0) {
+        *changes = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Hunk application. Each hunk is anchored by its SEARCH lines: exactly,
+// then ignoring surrounding whitespace, then loosely: a window where the
+// first or last line agrees and at most one line in five differs. Among
+// several matches the one nearest the expected line (diff header, or just
+// past the previous hunk) wins.
+
+typedef struct {
+    const char *s;
+    size_t len;
+} LineSpan;
+
+// Line table in turn_arena
+static int split_lines(const char *text, LineSpan **lines) {
+    int n = 0, cap = 64;
+    *lines = arena_alloc(&turn_arena, sizeof(LineSpan) * cap);
+    const char *p = text;
+    while (*p) {
+        const char *e = strchr(p, '\n');
+        size_t len = e ? (size_t)(e - p) : strlen(p);
+        if (n == cap) {
+            *lines = arena_grow(&turn_arena, *lines, sizeof(LineSpan) * cap, sizeof(LineSpan) * cap * 2);
+            cap *= 2;
+        }
+        (*lines)[n].s = p;
+        (*lines)[n].len = len;
+        n++;
+        p += len + (e ? 1 : 0);
+    }
+    return n;
+}
+
+static int lines_equal_trimmed(const LineSpan *a, const LineSpan *b) {
+    const char *as = a->s, *ae = a->s + a->len, *bs = b->s, *be = b->s + b->len;
+    while (as < ae && isspace((unsigned char)*as)) as++;
+    while (ae > as && isspace((unsigned char)ae[-1])) ae--;
+    while (bs < be && isspace((unsigned char)*bs)) bs++;
+    while (be > bs && isspace((unsigned char)be[-1])) be--;
+    return ae - as == be - bs && memcmp(as, bs, ae - as) == 0;
+}
+
+// Start line of the best match of want[0..m) in have[0..n), or -1
+static int anchor_hunk(const LineSpan *have, int n, const LineSpan *want, int m, int near, int *level) {
+    int best = -1;
+    double best_score = 0;
+    for (*level = 0; *level < 3; (*level)++) {
+        if (*level == 2 && m < 3) break; // too short to match loosely
+        for (int i = 0; i + m <= n; i++) {
+            int same = 0;
+            for (int k = 0; k < m; k++) {
+                int eq = *level == 0 ? (have[i + k].len == want[k].len &&
+                                        memcmp(have[i + k].s, want[k].s, want[k].len) == 0)
+                                     : lines_equal_trimmed(&have[i + k], &want[k]);
+                if (eq) same++;
+                else if (*level < 2) break;
+            }
+            double score = (double)same / m;
+            if (*level < 2 && same < m) continue;
+            if (*level == 2 && (same < m - (m + 4) / 5 ||
+                                (!lines_equal_trimmed(&have[i], &want[0]) &&
+                                 !lines_equal_trimmed(&have[i + m - 1], &want[m - 1])))) {
+                continue;
+            }
+            if (best < 0 || score > best_score + 1e-9 ||
+                (score > best_score - 1e-9 && abs(i - near) < abs(best - near))) {
+                best = i;
+                best_score = score;
+            }
+        }
+        if (best >= 0) return best;
+    }
+    return -1;
+}
+
+// Append the replacement for a match found at the given level. Lines are
+// re-indented when the match sits at another indentation, and on a loose
+// match a line carried over from a SEARCH line the file disagrees with
+// keeps the file's version (stale diff context must not overwrite code).
+static void append_replacement(Buffer *out, const char *replace, const LineSpan *found,
+                               const LineSpan *want, int m, int level) {
+    size_t fi = 0, wi = 0;
+    while (fi < found[0].len && (found[0].s[fi] == ' ' || found[0].s[fi] == '\t')) fi++;
+    while (wi < want[0].len && (want[0].s[wi] == ' ' || want[0].s[wi] == '\t')) wi++;
+    
+    for (const char *p = replace; *p;) {
+        const char *e = next_line(p);
+        size_t len = e - p - (e[-1] == '\n');
+        int k = 0;
+        for (; level == 2 && k < m; k++) {
+            if (want[k].len == len && memcmp(want[k].s, p, len) == 0 &&
+                !lines_equal_trimmed(&found[k], &want[k])) break;
+        }
+        if (level == 2 && k < m) {
+            buffer_append_n(out, found[k].s, found[k].len);
+            buffer_append(out, "\n");
+        } else if (level > 0 && wi != fi && len >= wi && strncmp(p, want[0].s, wi) == 0) {
+            buffer_append_n(out, found[0].s, fi);
+            buffer_append_n(out, p + wi, e - p - wi);
+        } else {
+            buffer_append_n(out, p, e - p);
+        }
+        p = e;
+    }
+    if (out->len > 0 && out->data[out->len - 1] != '\n') buffer_append(out, "\n");
+}
+
+// Apply change's hunks to text; returns the new content or NULL (with error set)
+static char *apply_hunks(const char *text, const FileChange *change, char *error, size_t error_len) {
+    Buffer cur, next;
+    buffer_init(&cur);
+    buffer_init(&next);
+    buffer_append(&cur, text ? text : "");
+    int cursor = 0;
+    
+    for (int h = 0; h < change->num_hunks; h++) {
+        const EditHunk *hunk = &change->hunks[h];
+        buffer_clear(&next);
+        
+        if (hunk->search[0] == '\0') {
+            // Empty SEARCH: append (or create)
+            buffer_append_n(&next, cur.data, cur.len);
+            if (next.len > 0 && next.data[next.len - 1] != '\n') buffer_append(&next, "\n");
+            buffer_append(&next, hunk->replace);
+            buffer_append(&next, "\n");
+        } else {
+            LineSpan *have, *want;
+            int n = split_lines(cur.data, &have);
+            int m = split_lines(hunk->search, &want);
+            int level;
+            int near = hunk->line_hint > 0 ? hunk->line_hint - 1 : cursor;
+            int at = anchor_hunk(have, n, want, m, near, &level);
+            if (at < 0) {
+                snprintf(error, error_len, "hunk %d does not match %.80s", h + 1, change->filepath);
+                buffer_free(&next);
+                buffer_free(&cur);
+                return NULL;
+            }
+            
+            buffer_append_n(&next, cur.data, have[at].s - cur.data);
+            if (hunk->replace[0]) append_replacement(&next, hunk->replace, &have[at], want, m, level);
+            if (at + m < n) {
+                buffer_append(&next, have[at + m].s);
+            } else if (cur.len > 0 && cur.data[cur.len - 1] != '\n' && next.len > 0) {
+                next.data[--next.len] = '\0'; // keep a missing final newline missing
+            }
+            
+            cursor = at;
+            for (const char *r = hunk->replace; *r; r = next_line(r)) cursor++;
+        }
+        Buffer t = cur;
+        cur = next;
+        next = t;
+    }
+    buffer_free(&next);
+    return cur.data;
+}
+
+// Apply file changes: every change or none of them
+static int apply_file_changes(const Config *cfg, FileChange *changes, int num_changes) {
+    WriteBatch wb;
+    if (write_batch_begin(&wb, cfg->workdir) != 0) {
+        if (num_changes > 0) memcpy(changes[0].error, wb.error, sizeof(wb.error));
+        return 0;
+    }
+    
+    int failed = 0;
+    for (int i = 0; i < num_changes && !failed; i++) {
+        char full_path[2 * PATH_MAX_LEN];
+        path_join(full_path, sizeof(full_path), cfg->workdir, changes[i].filepath);
+        
+        // Complete content wins; otherwise patch the current file
+        char *content = changes[i].content;
+        if (!content && changes[i].num_hunks > 0) {
+            char *old = read_file_content(full_path, SIZE_MAX - 1);
+            content = apply_hunks(old, &changes[i], changes[i].error, sizeof(changes[i].error));
+            free(old);
+            if (!content) {
+                failed = 1;
+                break;
+            }
+        }
+        
+        if (write_batch_add(&wb, changes[i].filepath, content, strlen(content), 0) != 0) {
+            memcpy(changes[i].error, wb.error, sizeof(wb.error));
+            failed = 1;
+        }
+        if (content != changes[i].content) free(content);
+    }
+    
+    if (failed) {
+        write_batch_abort(&wb);
+        return 0;
+    }
+    if (write_batch_commit(&wb) != 0) {
+        memcpy(changes[0].error, wb.error, sizeof(wb.error));
+        return 0;
+    }
+    journal_record(cfg->workdir, &wb);
+    write_batch_close(&wb);
+    for (int i = 0; i < num_changes; i++) changes[i].applied = 1;
+    return num_changes;
+}
+
+// Enhanced response extraction
 static void extract_clean_response(const char *raw_output, Buffer *clean) {
     buffer_clear(clean);
     
@@ -591,13 +5079,10 @@ static void extract_clean_response(const char *raw_output, Buffer *clean) {
         }
         
         // Skip timing information at the end
-        if (strstr(p, "llama_print_timings:") == p) break;
-        
-        buffer_ensure_capacity(clean, 1);
-        clean->data[clean->len++] = *p++;
+        if (strncmp(p, "llama_print_timings:", 20) == 0) break;
+        p++;
     }
-    
-    clean->data[clean->len] = '\0';
+    buffer_append_n(clean, start, p - start);
     
     // Trim trailing whitespace
     while (clean->len > 0 && isspace(clean->data[clean->len - 1])) {
@@ -606,6 +5091,311 @@ static void extract_clean_response(const char *raw_output, Buffer *clean) {
     clean->data[clean->len] = '\0';
 }
 
+// Incremental response parser. Each raw byte is examined once as it
+// arrives; a marker split across reads is held back until it completes.
+// Start markers inside the echoed prompt (the first echo_len bytes) restart
+// the response, so the last one wins, as the prompt ends with it.
+typedef struct {
+    size_t pos;         // next raw byte to examine
+    size_t echo_len;
+    int started;
+    int done;
+    int skip_ws;        // leading blanks after the start marker
+    Buffer clean;
+    size_t scan;        // clean bytes already checked for file blocks
+    int file_blocks;    // <<<FILE: headers seen
+    int closed_blocks;  // <<<REPLACEMENT_END>>> or <<<END>>> seen
+    int open_file;      // inside a file's blocks
+    size_t edits_end;   // clean length at the last block end
+    char current_file[PATH_MAX_LEN];
+    char files[PATH_MAX_LEN]; // names from <<<FILES: ...>>>, NUL-separated
+    int num_files;      // announced files, 0 = none (or too many to track)
+    uint64_t files_closed; // announced files with a closed block, by index
+    int check_next;     // every announced file closed: see what follows
+    int complete;       // <<<DONE>>>, or no more blocks after the announced files
+} ResponseParser;
+
+static const char *const response_stops[] = {
+    "<|endoftext|>", "<|end|>", "[end of text]", "llama_print_timings:", "llama_perf_", NULL
+};
+
+static void response_parser_init(ResponseParser *rp) {
+    memset(rp, 0, sizeof(*rp));
+    buffer_init(&rp->clean);
+}
+
+// Start over for a new raw stream, keeping the clean buffer's storage
+static void response_parser_reset(ResponseParser *rp, size_t echo_len) {
+    Buffer clean = rp->clean;
+    memset(rp, 0, sizeof(*rp));
+    rp->clean = clean;
+    rp->echo_len = echo_len;
+    buffer_clear(&rp->clean);
+}
+
+static void response_parser_free(ResponseParser *rp) {
+    buffer_free(&rp->clean);
+}
+
+// A model run in flight. Output arrives on a non-blocking fd that the UI
+// polls together with the keyboard; gen_pump() consumes whatever is ready.
+typedef struct {
+    int active;
+    int fd;             // CLI stdout pipe or server socket
+    pid_t pid;          // CLI child, -1 when streaming from the server
+    int server;         // fd carries an HTTP/SSE response
+    int first_token;
+    int rc;             // once finished: 0, or the CLI's wait status / -1
+    int stopped;        // ended early: the edits were complete or a stop sequence hit
+    int truncated;      // edits may be missing: ended inside a block
+    int cancelled;      // ended by the user
+    const Config *cfg;
+    const char *prompt; // the caller's, alive until the run ends (CLI fallback)
+    size_t prompt_len;
+    Buffer *out;
+    ResponseParser *rp;
+    HttpStream hs;
+    size_t skip;        // echo or marker bytes before the first token
+    size_t last_refresh;
+    size_t stop_scan;   // clean bytes already searched for cfg->stop_seq
+    double start;
+    double last_draw;
+    char tmpfile[PATH_MAX_LEN];
+    char errfile[PATH_MAX_LEN];
+} Generation;
+
+static Generation gen = { .fd = -1, .pid = -1 };
+static int ui_turn_pending = 0; // generation done, turn not yet finished
+static int ui_overlay = 0;      // a full-screen view hides output_win
+
+// First occurrence of needle in [s, s + n), or NULL
+static const char *find_bytes(const char *s, size_t n, const char *needle, size_t nl) {
+    while (n >= nl) {
+        const char *c = memchr(s, needle[0], n - nl + 1);
+        if (!c) return NULL;
+        if (memcmp(c, needle, nl) == 0) return c;
+        n -= c + 1 - s;
+        s = c + 1;
+    }
+    return NULL;
+}
+
+// 1 = marker at s, 0 = not, -1 = s is a proper prefix of it (need more bytes)
+static int marker_at(const char *s, size_t avail, const char *marker) {
+    size_t ml = strlen(marker);
+    if (avail >= ml) return memcmp(s, marker, ml) == 0;
+    return memcmp(s, marker, avail) == 0 ? -1 : 0;
+}
+
+static const char *const block_opens[] = {
+    "<<<SEARCH>>>", "<<<DIFF>>>", "<<<REPLACEMENT_START>>>", NULL
+};
+
+// Record the names of a <<<FILES: a.c b.h>>> line (body is [s, e))
+static void response_parser_announce(ResponseParser *rp, const char *s, const char *e) {
+    size_t len = 0;
+    int count = 0;
+    while (s < e) {
+        while (s < e && (*s == ' ' || *s == ',')) s++;
+        const char *w = s;
+        while (s < e && *s != ' ' && *s != ',') s++;
+        if (s == w) break;
+        if (len + (s - w) + 1 > sizeof(rp->files) || count == 64) return;
+        memcpy(rp->files + len, w, s - w);
+        len += s - w;
+        rp->files[len++] = '\0';
+        count++;
+    }
+    rp->num_files = count;
+}
+
+// A block closed for rp->current_file: tick it off the announced list
+static void response_parser_file_closed(ResponseParser *rp) {
+    const char *name = rp->files;
+    for (int i = 0; i < rp->num_files; i++, name += strlen(name) + 1) {
+        if (strcmp(name, rp->current_file) != 0) continue;
+        rp->files_closed |= (uint64_t)1 << i;
+        break;
+    }
+    uint64_t all = rp->num_files == 64 ? ~(uint64_t)0 : ((uint64_t)1 << rp->num_files) - 1;
+    if (rp->num_files > 0 && rp->files_closed == all) rp->check_next = 1;
+}
+
+// Pick up <<<FILE: path>>>, block starts and block ends in newly cleaned text
+static void response_parser_scan_blocks(ResponseParser *rp, int final) {
+    const char *base = rp->clean.data;
+    size_t n = rp->clean.len;
+    while (rp->scan < n) {
+        // After the last announced file's block only another block keeps
+        // the reply going
+        if (rp->check_next) {
+            size_t at = rp->scan;
+            while (at < n && isspace((unsigned char)base[at])) at++;
+            if (at == n) {
+                if (!final) break;
+                rp->scan = n;
+                continue;
+            }
+            int more = marker_at(base + at, n - at, "<<<FILE:");
+            for (int i = 0; block_opens[i] && more <= 0; i++) {
+                int r = marker_at(base + at, n - at, block_opens[i]);
+                if (r) more = r;
+            }
+            if (more < 0 && !final) break;
+            rp->check_next = 0;
+            if (more <= 0) rp->complete = 1;
+        }
+        
+        const char *c = memchr(base + rp->scan, '<', n - rp->scan);
+        if (!c) {
+            rp->scan = n;
+            break;
+        }
+        size_t at = c - base, avail = n - at;
+        int f = marker_at(c, avail, "<<<FILE:");
+        int a = marker_at(c, avail, "<<<FILES:");
+        int d = marker_at(c, avail, "<<<DONE>>>");
+        int e = marker_at(c, avail, "<<<REPLACEMENT_END>>>");
+        int h = marker_at(c, avail, "<<<END>>>");
+        int o = 0; // another block for the current file
+        for (int i = 0; block_opens[i] && o <= 0; i++) {
+            int r = marker_at(c, avail, block_opens[i]);
+            if (r) o = r;
+        }
+        if ((f < 0 || a < 0 || d < 0 || e < 0 || h < 0 || o < 0) && !final) break;
+        if (a > 0 && rp->num_files == 0 && rp->file_blocks == 0) {
+            const char *close = find_bytes(c + 9, avail - 9, ">>>", 3);
+            const char *nl = memchr(c + 9, '\n', avail - 9);
+            if (!close && !nl && !final) break;
+            if (close && (!nl || close < nl)) {
+                response_parser_announce(rp, c + 9, close);
+                rp->scan = close + 3 - base;
+                continue;
+            }
+        } else if (d > 0) {
+            rp->complete = 1;
+            rp->scan = at + 10;
+            continue;
+        } else if (f > 0) {
+            const char *close = find_bytes(c + 8, avail - 8, ">>>", 3);
+            const char *nl = memchr(c + 8, '\n', avail - 8);
+            if (!close && !nl && !final) break;
+            if (close && (!nl || close < nl)) {
+                const char *name = c + 8;
+                while (name < close && *name == ' ') name++;
+                size_t len = close - name;
+                if (len < sizeof(rp->current_file)) {
+                    memcpy(rp->current_file, name, len);
+                    rp->current_file[len] = '\0';
+                    rp->file_blocks++;
+                    rp->open_file = 1;
+                }
+                rp->scan = close + 3 - base;
+                continue;
+            }
+        } else if (e > 0 || h > 0) {
+            rp->closed_blocks++;
+            rp->open_file = 0;
+            rp->scan = at + (e > 0 ? 21 : 9);
+            rp->edits_end = rp->scan;
+            response_parser_file_closed(rp);
+            continue;
+        } else if (o > 0 && rp->file_blocks > 0) {
+            rp->open_file = 1;
+        }
+        rp->scan = at + 1;
+    }
+}
+
+// Consume raw->data[rp->pos .. raw->len); final means no more input follows
+static void response_parser_feed(ResponseParser *rp, const Buffer *raw, int final) {
+    static const char start_marker[] = "<|assistant|>";
+    const size_t start_len = sizeof(start_marker) - 1;
+    
+    while (!rp->done && rp->pos < raw->len) {
+        const char *p = raw->data + rp->pos;
+        size_t avail = raw->len - rp->pos;
+        
+        // Before the response: only the start marker matters
+        if (!rp->started) {
+            const char *m = find_bytes(p, avail, start_marker, start_len);
+            if (!m) {
+                // Keep a possible marker prefix for the next read
+                rp->pos = avail >= start_len ? raw->len - (start_len - 1) : rp->pos;
+                if (final) rp->pos = raw->len;
+                break;
+            }
+            rp->pos = m + start_len - raw->data;
+            rp->started = 1;
+            rp->skip_ws = 1;
+            continue;
+        }
+        
+        if (rp->skip_ws) {
+            if (*p == '\n' || *p == ' ') {
+                rp->pos++;
+                continue;
+            }
+            rp->skip_ws = 0;
+        }
+        
+        // Copy the run up to the next byte that could open a marker
+        size_t run = 0;
+        while (run < avail && p[run] != '<' && p[run] != '[' && p[run] != 'l') run++;
+        if (run > 0) {
+            buffer_append_n(&rp->clean, p, run);
+            rp->pos += run;
+            continue;
+        }
+        
+        int pending = 0, stop = 0;
+        int in_echo = rp->pos < rp->echo_len;
+        int st = marker_at(p, avail, start_marker);
+        if (st > 0 && in_echo) {
+            // A later start marker in the echoed prompt: restart
+            buffer_clear(&rp->clean);
+            rp->scan = 0;
+            rp->file_blocks = rp->closed_blocks = rp->open_file = 0;
+            rp->num_files = rp->check_next = rp->complete = 0;
+            rp->files_closed = 0;
+            rp->edits_end = 0;
+            rp->current_file[0] = '\0';
+            rp->pos += start_len;
+            rp->skip_ws = 1;
+            continue;
+        }
+        if (st < 0) pending = 1;
+        for (int i = 0; !in_echo && response_stops[i]; i++) {
+            int r = marker_at(p, avail, response_stops[i]);
+            if (r > 0) stop = 1;
+            else if (r < 0) pending = 1;
+        }
+        if (stop) {
+            rp->done = 1;
+            break;
+        }
+        if (pending && !final) break;
+        buffer_append_n(&rp->clean, p, 1);
+        rp->pos++;
+    }
+    response_parser_scan_blocks(rp, final);
+}
+
+// Final pass: falls back to the heuristic extractor when the output never
+// contained a start marker, and trims trailing whitespace
+static void response_parser_finish(ResponseParser *rp, const Buffer *raw) {
+    response_parser_feed(rp, raw, 1);
+    if (!rp->started && raw->len > 0) {
+        extract_clean_response(raw->data, &rp->clean);
+        rp->scan = 0;
+        response_parser_scan_blocks(rp, 1);
+    }
+    while (rp->clean.len > 0 && isspace((unsigned char)rp->clean.data[rp->clean.len - 1])) {
+        rp->clean.len--;
+    }
+    rp->clean.data[rp->clean.len] = '\0';
+}
+
 // UI Functions
 static void init_colors(void) {
     start_color();
@@ -658,6 +5448,8 @@ static void init_windows(void) {
     
     // Enable scrolling
     if (output_win) scrollok(output_win, TRUE);
+    if (output_win) idlok(output_win, TRUE); // let doupdate() scroll instead of repaint
+    keypad(stdscr, TRUE);
     if (prompt_win) keypad(prompt_win, TRUE);
     if (file_win) keypad(file_win, TRUE);
     
@@ -665,6 +5457,10 @@ static void init_windows(void) {
 }
 
 static void update_status(const char *msg, int color) {
+    if (!status_win) {
+        if (batch_verbose) fprintf(stderr, "%s\n", msg);
+        return;
+    }
     werase(status_win);
     wattron(status_win, COLOR_PAIR(color));
     mvwprintw(status_win, 0, 0, "%s", msg);
@@ -673,6 +5469,48 @@ static void update_status(const char *msg, int color) {
     wrefresh(status_win);
 }
 
+// Actions that would race the generation in flight are refused meanwhile
+static int ui_busy(void) {
+    if (!gen.active && !ui_turn_pending) return 0;
+    update_status("Still generating. Scroll, browse files or history until it is done.", COLOR_ERROR);
+    return 1;
+}
+
+static int gen_pump(void);
+
+// Read a key from w, driving the generation in flight while waiting.
+// Returns ERR once when the generation finishes, so callers can redraw.
+static int ui_getch(WINDOW *w) {
+    if (!gen.active) return wgetch(w);
+    
+    int ch;
+    wtimeout(w, 0);
+    while ((ch = wgetch(w)) == ERR && gen.active) {
+        struct pollfd pfd[2] = { { STDIN_FILENO, POLLIN, 0 }, { gen.fd, POLLIN, 0 } };
+        if (poll(pfd, 2, GEN_REFRESH_MS) < 0 && errno != EINTR) break;
+        gen_pump(); // also repaints the stream; EINTR here is usually SIGWINCH
+    }
+    wtimeout(w, -1);
+    return ch;
+}
+
+static void draw_config(void);
+static void output_view_render(void);
+
+// KEY_RESIZE: rebuild the layout at the new size and repaint
+static void ui_resize(void) {
+    WINDOW **wins[] = { &config_win, &prompt_win, &output_win, &status_win, &file_win };
+    for (size_t i = 0; i < sizeof(wins) / sizeof(wins[0]); i++) {
+        if (*wins[i]) delwin(*wins[i]);
+        *wins[i] = NULL;
+    }
+    clear();
+    init_windows();
+    draw_config();
+    output_view_render();
+    update_status(gen.active ? "Generating..." : "Ready. Press ? for help", COLOR_HEADER);
+}
+
 static void display_file_browser(void) {
     if (!file_win || file_list.count == 0) return;
     
@@ -709,91 +5547,253 @@ static void display_file_browser(void) {
     wrefresh(file_win);
 }
 
-static void display_response_with_highlighting(const char *response) {
-    if (!output_win) return;
+// Wrap one line into rows of at most width columns, at UTF-8 boundaries
+static void output_view_wrap(uint32_t li) {
+    OutputView *v = &output_view;
+    OutputLine *ln = &v->lines[li];
+    ln->first_row = v->nrows;
+    if (ln->hidden) return;
     
+    const char *t = v->text.data + ln->off;
+    uint32_t start = 0, cols = 0;
+    for (uint32_t i = 0; i < ln->len; i++) {
+        if (((unsigned char)t[i] & 0xC0) == 0x80) continue;
+        if (cols == (uint32_t)v->width) {
+            v->rows = grow_array(v->rows, &v->rows_cap, v->nrows + 1, sizeof(OutputRow));
+            v->rows[v->nrows++] = (OutputRow){ li, ln->off + start, i - start };
+            start = i;
+            cols = 0;
+        }
+        cols++;
+    }
+    v->rows = grow_array(v->rows, &v->rows_cap, v->nrows + 1, sizeof(OutputRow));
+    v->rows[v->nrows++] = (OutputRow){ li, ln->off + start, ln->len - start };
+}
+
+// Index lines from text offset off; only complete lines advance the style state
+static void output_view_index(uint32_t off) {
+    OutputView *v = &output_view;
+    while (off < v->text.len) {
+        const char *p = v->text.data + off;
+        const char *nl = memchr(p, '\n', v->text.len - off);
+        uint32_t len = nl ? (uint32_t)(nl - p) : (uint32_t)(v->text.len - off);
+        int in_code = v->in_code, in_file = v->in_file;
+        
+        OutputLine ln = { off, len, 0, OUT_NORMAL, 0 };
+        if (len >= 3 && strncmp(p, "```", 3) == 0) {
+            ln.hidden = 1;
+            in_code = !in_code;
+        } else if (len >= 8 && strncmp(p, "<<<FILE:", 8) == 0) {
+            ln.style = OUT_FILE;
+            in_file = 1;
+        } else if ((len >= 21 && strncmp(p, "<<<REPLACEMENT_END>>>", 21) == 0) ||
+                   (len >= 9 && strncmp(p, "<<<END>>>", 9) == 0)) {
+            ln.hidden = 1;
+            in_file = 0;
+        } else if (len >= 9 && (strncmp(p, "<<<SEARCH", 9) == 0 || strncmp(p, "<<<REPLACE", 10) == 0 ||
+                                strncmp(p, "<<<DIFF", 7) == 0)) {
+            ln.style = OUT_FILE;
+            in_file = 1;
+        } else if (in_code || in_file) {
+            ln.style = OUT_CODE;
+        }
+        
+        v->lines = grow_array(v->lines, &v->lines_cap, v->nlines + 1, sizeof(OutputLine));
+        v->lines[v->nlines] = ln;
+        output_view_wrap(v->nlines++);
+        if (!nl) break;
+        v->complete = v->nlines;
+        v->in_code = in_code;
+        v->in_file = in_file;
+        off += len + 1;
+    }
+}
+
+static void output_view_rewrap(void) {
+    output_view.nrows = 0;
+    for (uint32_t i = 0; i < output_view.nlines; i++) output_view_wrap(i);
+}
+
+// Border, timestamp and an empty body; forgets what was drawn
+static void output_view_frame(void) {
+    OutputView *v = &output_view;
     werase(output_win);
     draw_border(output_win, "AI Response");
-    
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    wmove(output_win, 1, 2);
     wattron(output_win, COLOR_PAIR(COLOR_HIGHLIGHT));
-    wprintw(output_win, "[%02d:%02d:%02d] ", tm_info->tm_hour, tm_info->tm_min, tm_info->tm_sec);
+    mvwprintw(output_win, 1, 2, "[%s] ", v->stamp);
     wattroff(output_win, COLOR_PAIR(COLOR_HIGHLIGHT));
     
-    // Parse and highlight code blocks and file changes
-    const char *p = response;
-    int in_code = 0;
-    int in_file_change = 0;
-    int y = 2, x = 2;
-    int max_y = getmaxy(output_win) - 1;
-    int max_x = getmaxx(output_win) - 2;
-    
-    while (*p && y < max_y) {
-        if (strncmp(p, "```", 3) == 0) {
-            in_code = !in_code;
-            p += 3;
-            while (*p && *p != '\n') p++;
-            if (*p == '\n') p++;
-            continue;
-        }
-        
-        if (strncmp(p, "<<<FILE:", 8) == 0) {
-            in_file_change = 1;
-            wattron(output_win, COLOR_PAIR(COLOR_SUCCESS) | A_BOLD);
-        } else if (strncmp(p, "<<<REPLACEMENT_END>>>", 20) == 0) {
-            in_file_change = 0;
-            wattroff(output_win, COLOR_PAIR(COLOR_CODE));
-            p += 20;
-            if (*p == '\n') p++;
-            continue;
+    int height = getmaxy(output_win) - 3;
+    v->shown = grow_array(v->shown, &v->shown_cap, height > 0 ? height : 1, sizeof(uint64_t));
+    memset(v->shown, 0, sizeof(uint64_t) * v->shown_cap);
+    v->drawn_top = v->top;
+    v->win = output_win;
+}
+
+static void output_view_render(void) {
+    OutputView *v = &output_view;
+    if (!output_win) return;
+    
+    int width = getmaxx(output_win) - 4;
+    int height = getmaxy(output_win) - 3;
+    if (width < 1 || height < 1) return;
+    if (width != v->width) {
+        v->width = width;
+        output_view_rewrap();
+        v->win = NULL;
+    }
+    if (v->win != output_win) output_view_frame();
+    
+    uint32_t max_top = v->nrows > (uint32_t)height ? v->nrows - height : 0;
+    uint32_t old_top = v->drawn_top;
+    if (v->follow || v->top > max_top) v->top = max_top;
+    
+    // Moving by less than a screen: scroll what is drawn and only paint the gap
+    int shift = (int)(v->top - old_top);
+    if (shift != 0 && abs(shift) < height) {
+        wsetscrreg(output_win, 2, 1 + height);
+        wscrl(output_win, shift);
+        wsetscrreg(output_win, 0, getmaxy(output_win) - 1);
+        wattron(output_win, COLOR_PAIR(COLOR_BORDER));
+        mvwvline(output_win, 2, 0, ACS_VLINE, height);
+        mvwvline(output_win, 2, getmaxx(output_win) - 1, ACS_VLINE, height);
+        wattroff(output_win, COLOR_PAIR(COLOR_BORDER));
+        if (shift > 0) {
+            memmove(v->shown, v->shown + shift, sizeof(uint64_t) * (height - shift));
+            memset(v->shown + height - shift, 0, sizeof(uint64_t) * shift);
+        } else {
+            memmove(v->shown - shift, v->shown, sizeof(uint64_t) * (height + shift));
+            memset(v->shown, 0, sizeof(uint64_t) * -shift);
         }
+    }
+    v->drawn_top = v->top;
+    
+    char cell[1024];
+    for (int i = 0; i < height; i++) {
+        uint32_t r = v->top + i;
+        const OutputRow *row = r < v->nrows ? &v->rows[r] : NULL;
+        int style = row ? v->lines[row->line].style : OUT_NORMAL;
+        uint64_t sig = row ? hash_bytes(v->text.data + row->off, row->len, HASH_SEED + style) | 1 : 2;
+        if (v->shown[i] == sig) continue;
+        v->shown[i] = sig;
         
-        if (in_code || in_file_change) {
-            wattron(output_win, COLOR_PAIR(COLOR_CODE));
+        // Draw the row (tabs as blanks), then blank the rest of it
+        size_t n = 0;
+        for (uint32_t k = 0; row && k < row->len && n < sizeof(cell) - 1; k++) {
+            char c = v->text.data[row->off + k];
+            cell[n++] = (c == '\t' || c == '\r') ? ' ' : c;
         }
+        cell[n] = '\0';
         
-        // Handle line breaks and word wrapping
-        if (*p == '\n') {
-            if (in_code || in_file_change) {
-                wattroff(output_win, COLOR_PAIR(COLOR_CODE));
-            }
-            y++;
-            x = 2;
-            wmove(output_win, y, x);
-            p++;
-        } else {
-            if (x >= max_x - 1) {
-                y++;
-                x = 2;
-                wmove(output_win, y, x);
-            }
-            waddch(output_win, *p);
-            x++;
-            p++;
+        wmove(output_win, 2 + i, 2);
+        int attr = style == OUT_FILE ? (COLOR_PAIR(COLOR_SUCCESS) | A_BOLD) :
+                   style == OUT_CODE ? COLOR_PAIR(COLOR_CODE) : 0;
+        if (attr) wattron(output_win, attr);
+        waddstr(output_win, cell);
+        if (attr) wattroff(output_win, attr);
+        int x = getcurx(output_win);
+        if (x < 2 + width) mvwhline(output_win, 2 + i, x, ' ', 2 + width - x);
+    }
+    
+    // Position on the bottom border when there is more than one screen
+    int bottom = getmaxy(output_win) - 1;
+    wattron(output_win, COLOR_PAIR(COLOR_BORDER));
+    mvwhline(output_win, bottom, 1, ACS_HLINE, getmaxx(output_win) - 2);
+    if (v->nrows > (uint32_t)height) {
+        char pos[48];
+        int len = snprintf(pos, sizeof(pos), " %u-%u/%u ", v->top + 1,
+                           v->top + height < v->nrows ? v->top + height : v->nrows, v->nrows);
+        mvwprintw(output_win, bottom, getmaxx(output_win) - len - 2, "%s", pos);
+    }
+    wattroff(output_win, COLOR_PAIR(COLOR_BORDER));
+    
+    wnoutrefresh(output_win);
+    doupdate();
+}
+
+// Show text in output_win. Text that extends what is shown only indexes
+// the new part; anything else starts a new response at the top (or at the
+// bottom, with follow, for streamed output).
+static void output_view_show(const char *text, size_t len, int follow) {
+    if (!output_win) return;
+    OutputView *v = &output_view;
+    if (!v->text.data) buffer_init(&v->text);
+    
+    if (len >= v->text.len && v->text.len > 0 && memcmp(v->text.data, text, v->text.len) == 0) {
+        // Re-index from the unfinished last line; rows follow line order
+        uint32_t from = (uint32_t)v->text.len;
+        if (v->complete < v->nlines) {
+            from = v->lines[v->complete].off;
+            v->nrows = v->lines[v->complete].first_row;
+            v->nlines = v->complete;
         }
+        buffer_append_n(&v->text, text + v->text.len, len - v->text.len);
+        output_view_index(from);
+    } else {
+        buffer_clear(&v->text);
+        buffer_append_n(&v->text, text, len);
+        v->nlines = v->complete = v->nrows = 0;
+        v->in_code = v->in_file = 0;
+        v->top = 0;
+        v->follow = follow;
+        v->width = output_win ? getmaxx(output_win) - 4 : 80;
+        v->win = NULL;
         
-        if (in_code || in_file_change) {
-            wattroff(output_win, COLOR_PAIR(COLOR_CODE));
-        }
+        time_t now = time(NULL);
+        struct tm *tm_info = localtime(&now);
+        snprintf(v->stamp, sizeof(v->stamp), "%02d:%02d:%02d", tm_info->tm_hour, tm_info->tm_min, tm_info->tm_sec);
+        output_view_index(0);
     }
-    
-    wrefresh(output_win);
+    output_view_render();
+}
+
+static void output_view_scroll(int delta) {
+    OutputView *v = &output_view;
+    v->follow = 0;
+    if (delta < 0 && (uint32_t)-delta > v->top) v->top = 0;
+    else v->top += delta;
+    output_view_render();
+}
+
+// Jump to the start, or to the end (and keep following new output)
+static void output_view_jump(int to_end) {
+    output_view.follow = to_end;
+    output_view.top = 0;
+    output_view_render();
+}
+
+static int output_view_page(void) {
+    int h = output_win ? getmaxy(output_win) - 3 : 1;
+    return h > 2 ? h - 1 : 1;
+}
+
+static void display_response_with_highlighting(const char *response) {
+    if (!output_win) return;
+    output_view_show(response, strlen(response), 0);
 }
 
 static void draw_config(void) {
+    if (!config_win) return;
     werase(config_win);
     draw_border(config_win, "Devstral Agent Configuration");
     
     wattron(config_win, COLOR_PAIR(COLOR_HEADER));
     mvwprintw(config_win, 1, 2, "Enhanced Repository Assistant v2.0");
     wattroff(config_win, COLOR_PAIR(COLOR_HEADER));
+    if (last_turn.total_ms > 0) {
+        char line[256];
+        snprintf(line, sizeof(line), "Last turn %.1fs: scan %.0f, prompt %.0f, load %.0f, eval %.0f, decode %.0f ms",
+                 last_turn.total_ms / 1000.0, last_turn.scan_ms, last_turn.prompt_ms,
+                 last_turn.load_ms, last_turn.eval_ms, last_turn.decode_ms);
+        mvwprintw(config_win, 1, 38, "%.*s", getmaxx(config_win) - 40 > 0 ? getmaxx(config_win) - 40 : 0, line);
+    }
     
     mvwprintw(config_win, 2, 2, "Workdir: %.50s", global_cfg.workdir);
-    mvwprintw(config_win, 3, 2, "Model:   %.50s", global_cfg.model);
-    mvwprintw(config_win, 4, 2, "Mode:    %-10s | Context: %zu | Predict: %zu", 
-              global_cfg.mode, global_cfg.ctx_size, global_cfg.n_predict);
+    mvwprintw(config_win, 3, 2, "Model:   %.50s [%s]", global_cfg.model,
+              global_cfg.server[0] ? "resident" : "one-shot");
+    mvwprintw(config_win, 4, 2, "Mode:    %-10s | Context: %zu | Predict: %zu | TTFT: %.0f ms (prev %.0f) | %.1f tok/s", 
+              global_cfg.mode, global_cfg.ctx_size, global_cfg.n_predict,
+              prompt_stats.ttft_ms, prompt_stats.prev_ttft_ms, last_turn.tok_per_s);
     mvwprintw(config_win, 5, 2, "Options: Apply[%c] Tests[%c] Stream[%c] Code[%c] | Focus: %.30s",
               global_cfg.apply_changes ? 'X' : ' ',
               global_cfg.run_tests ? 'X' : ' ',
@@ -824,6 +5824,10 @@ static void get_input(WINDOW *win, const char *prompt, char *buf, size_t buflen)
 }
 
 static void get_multiline_input(char *buf, size_t buflen) {
+    if (ui_busy()) {
+        buf[0] = '\0';
+        return;
+    }
     werase(prompt_win);
     draw_border(prompt_win, "Enter prompt (Ctrl+D to send, Ctrl+C to cancel)");
     wmove(prompt_win, 1, 2);
@@ -899,20 +5903,27 @@ static void get_multiline_input(char *buf, size_t buflen) {
     curs_set(0);
 }
 
+static void save_config(const Config *cfg);
+
 static void configure_settings(void) {
     char buf[PATH_MAX_LEN];
+    if (ui_busy()) return;
     
     get_input(prompt_win, "Repository workdir", buf, sizeof(buf));
-    if (strlen(buf) > 0) strncpy(global_cfg.workdir, buf, sizeof(global_cfg.workdir) - 1);
+    if (strlen(buf) > 0) snprintf(global_cfg.workdir, sizeof(global_cfg.workdir), "%s", buf);
     
     get_input(prompt_win, "Model path", buf, sizeof(buf));
-    if (strlen(buf) > 0) strncpy(global_cfg.model, buf, sizeof(global_cfg.model) - 1);
+    if (strlen(buf) > 0) snprintf(global_cfg.model, sizeof(global_cfg.model), "%s", buf);
     
     get_input(prompt_win, "CLI binary path", buf, sizeof(buf));
-    if (strlen(buf) > 0) strncpy(global_cfg.cli, buf, sizeof(global_cfg.cli) - 1);
+    if (strlen(buf) > 0) snprintf(global_cfg.cli, sizeof(global_cfg.cli), "%s", buf);
     
-    get_input(prompt_win, "Mode (overview/edit/agent)", buf, sizeof(buf));
-    if (strlen(buf) > 0) strncpy(global_cfg.mode, buf, sizeof(global_cfg.mode) - 1);
+    get_input(prompt_win, "Server binary for resident model (blank = one-shot CLI)", buf, sizeof(buf));
+    if (strlen(buf) > 0) snprintf(global_cfg.server, sizeof(global_cfg.server), "%s", buf);
+    
+    char mode[sizeof(global_cfg.mode)];
+    get_input(prompt_win, "Mode (overview/edit/agent)", mode, sizeof(mode));
+    if (strlen(mode) > 0) memcpy(global_cfg.mode, mode, sizeof(mode));
     
     get_input(prompt_win, "Context size (8192-32768)", buf, sizeof(buf));
     if (strlen(buf) > 0) {
@@ -933,8 +5944,11 @@ static void configure_settings(void) {
     global_cfg.run_tests = (buf[0] == 'y' || buf[0] == 'Y');
     
     if (global_cfg.run_tests) {
-        get_input(prompt_win, "Test command", buf, sizeof(buf));
-        if (strlen(buf) > 0) strncpy(global_cfg.test_cmd, buf, sizeof(global_cfg.test_cmd) - 1);
+        get_input(prompt_win, "Test command (';' separates commands run in parallel)", buf, sizeof(buf));
+        if (strlen(buf) > 0) snprintf(global_cfg.test_cmd, sizeof(global_cfg.test_cmd), "%s", buf);
+        
+        get_input(prompt_win, "Test timeout in seconds (blank = 300)", buf, sizeof(buf));
+        if (strlen(buf) > 0) global_cfg.test_timeout = atoi(buf);
     }
     
     get_input(prompt_win, "Include code in context? (y/n)", buf, sizeof(buf));
@@ -954,16 +5968,23 @@ static void save_config(const Config *cfg) {
     fprintf(f, "workdir=%s\n", cfg->workdir);
     fprintf(f, "model=%s\n", cfg->model);
     fprintf(f, "cli=%s\n", cfg->cli);
+    fprintf(f, "server=%s\n", cfg->server);
+    fprintf(f, "server_port=%d\n", cfg->server_port);
     fprintf(f, "mode=%s\n", cfg->mode);
     fprintf(f, "test_cmd=%s\n", cfg->test_cmd);
     fprintf(f, "focus_file=%s\n", cfg->focus_file);
     fprintf(f, "ctx_size=%zu\n", cfg->ctx_size);
     fprintf(f, "n_predict=%zu\n", cfg->n_predict);
+    fprintf(f, "history_tokens=%zu\n", cfg->history_tokens);
     fprintf(f, "max_total=%zu\n", cfg->max_total);
     fprintf(f, "max_file=%zu\n", cfg->max_file);
     fprintf(f, "apply_changes=%d\n", cfg->apply_changes);
     fprintf(f, "run_tests=%d\n", cfg->run_tests);
+    fprintf(f, "test_timeout=%d\n", cfg->test_timeout);
+    fprintf(f, "test_jobs=%d\n", cfg->test_jobs);
     fprintf(f, "include_code=%d\n", cfg->include_code);
+    fprintf(f, "stop=%s\n", cfg->stop_seq);
+    fprintf(f, "stop_grace=%d\n", cfg->stop_grace);
     
     fclose(f);
 }
@@ -991,69 +6012,925 @@ static void load_config(Config *cfg) {
         if (strcmp(key, "workdir") == 0) strncpy(cfg->workdir, value, sizeof(cfg->workdir) - 1);
         else if (strcmp(key, "model") == 0) strncpy(cfg->model, value, sizeof(cfg->model) - 1);
         else if (strcmp(key, "cli") == 0) strncpy(cfg->cli, value, sizeof(cfg->cli) - 1);
+        else if (strcmp(key, "server") == 0) strncpy(cfg->server, value, sizeof(cfg->server) - 1);
+        else if (strcmp(key, "server_port") == 0) cfg->server_port = atoi(value);
         else if (strcmp(key, "mode") == 0) strncpy(cfg->mode, value, sizeof(cfg->mode) - 1);
         else if (strcmp(key, "test_cmd") == 0) strncpy(cfg->test_cmd, value, sizeof(cfg->test_cmd) - 1);
         else if (strcmp(key, "focus_file") == 0) strncpy(cfg->focus_file, value, sizeof(cfg->focus_file) - 1);
         else if (strcmp(key, "ctx_size") == 0) cfg->ctx_size = strtoull(value, NULL, 10);
         else if (strcmp(key, "n_predict") == 0) cfg->n_predict = strtoull(value, NULL, 10);
+        else if (strcmp(key, "history_tokens") == 0) cfg->history_tokens = strtoull(value, NULL, 10);
         else if (strcmp(key, "max_total") == 0) cfg->max_total = strtoull(value, NULL, 10);
         else if (strcmp(key, "max_file") == 0) cfg->max_file = strtoull(value, NULL, 10);
         else if (strcmp(key, "apply_changes") == 0) cfg->apply_changes = atoi(value);
         else if (strcmp(key, "run_tests") == 0) cfg->run_tests = atoi(value);
+        else if (strcmp(key, "test_timeout") == 0) cfg->test_timeout = atoi(value);
+        else if (strcmp(key, "test_jobs") == 0) cfg->test_jobs = atoi(value);
         else if (strcmp(key, "include_code") == 0) cfg->include_code = atoi(value);
+        else if (strcmp(key, "stop") == 0) strncpy(cfg->stop_seq, value, sizeof(cfg->stop_seq) - 1);
+        else if (strcmp(key, "stop_grace") == 0) cfg->stop_grace = atoi(value);
+    }
+    
+    fclose(f);
+}
+
+static void refresh_stream_view(const ResponseParser *rp) {
+    if (rp->clean.len > 0) {
+        output_view_show(rp->clean.data, rp->clean.len, 1);
+    }
+    if (rp->open_file) {
+        char msg[PATH_MAX_LEN + 64];
+        snprintf(msg, sizeof(msg), "Receiving %s (file %d)...", rp->current_file, rp->file_blocks);
+        update_status(msg, COLOR_HIGHLIGHT);
+    } else if (turn_timings.first_token_at > 0) {
+        double secs = (now_ms() - turn_timings.first_token_at) / 1000.0;
+        size_t tokens = estimate_tokens(rp->clean.len);
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Generating... ~%zu tokens, %.1f tok/s (TTFT %.0f ms)",
+                 tokens, secs > 0 ? tokens / secs : 0.0, prompt_stats.ttft_ms);
+        update_status(msg, COLOR_HIGHLIGHT);
+    }
+}
+
+// Prompt-cache file for (model, workdir, prefix hash); stale prefixes are pruned
+static int prompt_cache_path(const Config *cfg, char *out, size_t len) {
+    char dir[PATH_MAX_LEN / 2];
+    if (cache_dir(dir, sizeof(dir)) != 0) return -1;
+    
+    uint64_t key = hash_bytes(cfg->model, strlen(cfg->model), HASH_SEED);
+    key = hash_bytes(cfg->workdir, strlen(cfg->workdir), key);
+    
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "prompt-%016llx-", (unsigned long long)key);
+    snprintf(out, len, "%s/%s%016llx.bin", dir, prefix,
+             (unsigned long long)prompt_stats.prefix_hash);
+    
+    DIR *d = opendir(dir);
+    if (d) {
+        struct dirent *ent;
+        while ((ent = readdir(d))) {
+            if (strncmp(ent->d_name, prefix, strlen(prefix)) != 0) continue;
+            char stale[PATH_MAX_LEN];
+            snprintf(stale, sizeof(stale), "%s/%s", dir, ent->d_name);
+            if (strcmp(stale, out) != 0) unlink(stale);
+        }
+        closedir(d);
+    }
+    return 0;
+}
+
+static void record_first_token(double start) {
+    turn_timings.first_token_at = now_ms();
+    prompt_stats.ttft_ms = turn_timings.first_token_at - start;
+}
+
+// llama.cpp's closing report, either generation:
+//   llama_print_timings:        load time =   812.34 ms
+//   llama_perf_context_print: prompt eval time = 1234.56 ms /   987 tokens (...)
+//   llama_perf_context_print:        eval time = 5678.90 ms /   255 runs   (...)
+static void parse_cli_timings(const char *text) {
+    for (const char *p = text; (p = strstr(p, " time =")) != NULL; p += 7) {
+        const char *label = p;
+        while (label > text && label[-1] != ':' && label[-1] != '\n') label--;
+        while (*label == ' ') label++;
+        double ms = 0;
+        long n = -1;
+        if (sscanf(p + 7, "%lf ms / %ld", &ms, &n) < 1) continue;
+        size_t len = (size_t)(p - label);
+        if (len == 4 && strncmp(label, "load", 4) == 0) {
+            turn_timings.load_ms = ms;
+        } else if (len == 11 && strncmp(label, "prompt eval", 11) == 0) {
+            turn_timings.eval_ms = ms;
+            turn_timings.prompt_n = n;
+        } else if (len == 4 && strncmp(label, "eval", 4) == 0) {
+            turn_timings.decode_ms = ms;
+            turn_timings.decode_n = n;
+        }
+    }
+}
+
+// JSON helpers for the server protocol
+static void buffer_append_json_string(Buffer *b, const char *s) {
+    buffer_append(b, "\"");
+    for (const char *p = s; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        switch (c) {
+            case '"':  buffer_append(b, "\\\""); break;
+            case '\\': buffer_append(b, "\\\\"); break;
+            case '\n': buffer_append(b, "\\n"); break;
+            case '\r': buffer_append(b, "\\r"); break;
+            case '\t': buffer_append(b, "\\t"); break;
+            default:
+                if (c < 0x20) {
+                    buffer_append_fmt(b, "\\u%04x", c);
+                } else {
+                    buffer_ensure_capacity(b, 1);
+                    b->data[b->len++] = (char)c;
+                    b->data[b->len] = '\0';
+                }
+        }
+    }
+    buffer_append(b, "\"");
+}
+
+static void buffer_append_utf8(Buffer *b, unsigned cp) {
+    char u[5] = {0};
+    if (cp < 0x80) {
+        u[0] = (char)cp;
+    } else if (cp < 0x800) {
+        u[0] = (char)(0xC0 | (cp >> 6));
+        u[1] = (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        u[0] = (char)(0xE0 | (cp >> 12));
+        u[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        u[2] = (char)(0x80 | (cp & 0x3F));
+    } else {
+        u[0] = (char)(0xF0 | (cp >> 18));
+        u[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        u[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        u[3] = (char)(0x80 | (cp & 0x3F));
+    }
+    buffer_append(b, u);
+}
+
+// Find "key": in a flat JSON object and return a pointer to its value
+static const char *json_find_value(const char *json, const char *key) {
+    char pat[128];
+    snprintf(pat, sizeof(pat), "\"%s\"", key);
+    const char *p = json;
+    while ((p = strstr(p, pat)) != NULL) {
+        p += strlen(pat);
+        while (*p == ' ') p++;
+        if (*p == ':') {
+            p++;
+            while (*p == ' ') p++;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Append the unescaped string value of key to out; returns 0 if found
+static int json_get_string(const char *json, const char *key, Buffer *out) {
+    const char *p = json_find_value(json, key);
+    if (!p || *p != '"') return -1;
+    p++;
+    while (*p && *p != '"') {
+        if (*p != '\\') {
+            const char *run = p;
+            while (*p && *p != '"' && *p != '\\') p++;
+            buffer_append_n(out, run, p - run);
+            continue;
+        }
+        p++;
+        switch (*p) {
+            case 'n': buffer_append(out, "\n"); break;
+            case 'r': buffer_append(out, "\r"); break;
+            case 't': buffer_append(out, "\t"); break;
+            case 'b': buffer_append(out, "\b"); break;
+            case 'f': buffer_append(out, "\f"); break;
+            case 'u': {
+                unsigned cp = 0;
+                if (sscanf(p + 1, "%4x", &cp) != 1) return -1;
+                p += 4;
+                // Surrogate pair
+                if (cp >= 0xD800 && cp < 0xDC00 && p[1] == '\\' && p[2] == 'u') {
+                    unsigned lo = 0;
+                    if (sscanf(p + 3, "%4x", &lo) == 1 && lo >= 0xDC00 && lo < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        p += 6;
+                    }
+                }
+                buffer_append_utf8(out, cp);
+                break;
+            }
+            case '\0': return -1;
+            default: {
+                char c[2] = { *p, '\0' };
+                buffer_append(out, c);
+            }
+        }
+        p++;
+    }
+    return 0;
+}
+
+static int json_get_number(const char *json, const char *key, double *out) {
+    const char *p = json_find_value(json, key);
+    if (!p) return -1;
+    char *end;
+    double v = strtod(p, &end);
+    if (end == p) return -1;
+    *out = v;
+    return 0;
+}
+
+static int json_get_bool(const char *json, const char *key) {
+    const char *p = json_find_value(json, key);
+    return p && strncmp(p, "true", 4) == 0;
+}
+
+// Minimal HTTP client for the resident llama-server on 127.0.0.1
+static int http_connect(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int http_send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int http_send_request(int fd, const char *method, const char *path, const char *body) {
+    Buffer req;
+    buffer_init(&req);
+    buffer_append_fmt(&req, "%s %s HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n", method, path);
+    if (body) {
+        buffer_append_fmt(&req, "Content-Type: application/json\r\nContent-Length: %zu\r\n", strlen(body));
+    }
+    buffer_append(&req, "\r\n");
+    int rc = http_send_all(fd, req.data, req.len);
+    buffer_free(&req);
+    if (rc == 0 && body) rc = http_send_all(fd, body, strlen(body));
+    return rc;
+}
+
+static void http_stream_init(HttpStream *hs) {
+    memset(hs, 0, sizeof(*hs));
+    buffer_init(&hs->line);
+    buffer_init(&hs->event);
+}
+
+static void http_stream_free(HttpStream *hs) {
+    buffer_free(&hs->line);
+    buffer_free(&hs->event);
+}
+
+// One complete SSE line: "data: {...}" carries the next piece of text
+static void http_stream_event(HttpStream *hs, Buffer *content) {
+    const char *line = hs->event.data;
+    if (strncmp(line, "data:", 5) != 0) return;
+    line += 5;
+    while (*line == ' ') line++;
+    json_get_string(line, "content", content);
+    if (json_get_bool(line, "stop")) {
+        hs->done = 1;
+        // The final event carries the server's own timings
+        double v;
+        if (json_get_number(line, "prompt_n", &v) == 0) turn_timings.prompt_n = (long)v;
+        if (json_get_number(line, "prompt_ms", &v) == 0) turn_timings.eval_ms = v;
+        if (json_get_number(line, "predicted_n", &v) == 0) turn_timings.decode_n = (long)v;
+        if (json_get_number(line, "predicted_ms", &v) == 0) turn_timings.decode_ms = v;
+        if (json_get_number(line, "tokens_cached", &v) == 0) turn_timings.cached_n = (long)v;
+    }
+}
+
+static void http_stream_body(HttpStream *hs, const char *data, size_t len, Buffer *content) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == '\n') {
+            if (hs->event.len > 0 && hs->event.data[hs->event.len - 1] == '\r') {
+                hs->event.data[--hs->event.len] = '\0';
+            }
+            http_stream_event(hs, content);
+            buffer_clear(&hs->event);
+        } else {
+            buffer_ensure_capacity(&hs->event, 1);
+            hs->event.data[hs->event.len++] = data[i];
+            hs->event.data[hs->event.len] = '\0';
+        }
+    }
+}
+
+// Feed raw socket bytes; decoded SSE text is appended to content
+static void http_stream_feed(HttpStream *hs, const char *data, size_t len, Buffer *content) {
+    size_t i = 0;
+    while (i < len && !hs->done) {
+        if (!hs->in_body) {
+            // Headers, one line at a time
+            char c = data[i++];
+            if (c != '\n') {
+                buffer_ensure_capacity(&hs->line, 1);
+                hs->line.data[hs->line.len++] = c;
+                hs->line.data[hs->line.len] = '\0';
+                continue;
+            }
+            if (hs->line.len > 0 && hs->line.data[hs->line.len - 1] == '\r') {
+                hs->line.data[--hs->line.len] = '\0';
+            }
+            if (hs->status == 0) {
+                sscanf(hs->line.data, "HTTP/%*s %d", &hs->status);
+            } else if (hs->line.len == 0) {
+                hs->in_body = 1;
+            } else if (strncasecmp(hs->line.data, "Transfer-Encoding:", 18) == 0 &&
+                       strstr(hs->line.data + 18, "chunked")) {
+                hs->chunked = 1;
+            }
+            buffer_clear(&hs->line);
+        } else if (!hs->chunked) {
+            http_stream_body(hs, data + i, len - i, content);
+            i = len;
+        } else if (hs->chunk_state == 1) {
+            size_t n = len - i < hs->chunk_left ? len - i : hs->chunk_left;
+            http_stream_body(hs, data + i, n, content);
+            i += n;
+            hs->chunk_left -= n;
+            if (hs->chunk_left == 0) hs->chunk_state = 2;
+        } else {
+            // Chunk-size line or the CRLF after chunk data
+            char c = data[i++];
+            if (c != '\n') {
+                buffer_ensure_capacity(&hs->line, 1);
+                hs->line.data[hs->line.len++] = c;
+                hs->line.data[hs->line.len] = '\0';
+                continue;
+            }
+            if (hs->chunk_state == 2) {
+                hs->chunk_state = 0;
+            } else {
+                hs->chunk_left = strtoul(hs->line.data, NULL, 16);
+                if (hs->chunk_left == 0) hs->done = 1;
+                else hs->chunk_state = 1;
+            }
+            buffer_clear(&hs->line);
+        }
+    }
+}
+
+// Returns the HTTP status of a simple request, or -1 if unreachable
+static int http_get_status(int port, const char *path) {
+    int fd = http_connect(port);
+    if (fd < 0) return -1;
+    
+    int status = -1;
+    if (http_send_request(fd, "GET", path, NULL) == 0) {
+        char buf[256];
+        ssize_t n = recv(fd, buf, sizeof(buf) - 1, 0);
+        if (n > 0) {
+            buf[n] = '\0';
+            sscanf(buf, "HTTP/%*s %d", &status);
+        }
+    }
+    close(fd);
+    return status;
+}
+
+// Body of a 200 response to a simple request into body; -1 otherwise
+static int http_get_body(int port, const char *path, Buffer *body) {
+    int fd = http_connect(port);
+    if (fd < 0) return -1;
+    
+    Buffer raw;
+    buffer_init(&raw);
+    if (http_send_request(fd, "GET", path, NULL) == 0) {
+        char buf[4096];
+        ssize_t n;
+        while (raw.len < 1024 * 1024 && ((n = recv(fd, buf, sizeof(buf), 0)) > 0 || (n < 0 && errno == EINTR))) {
+            if (n > 0) buffer_append_n(&raw, buf, (size_t)n);
+        }
+    }
+    close(fd);
+    
+    int status = -1;
+    const char *start = strstr(raw.data, "\r\n\r\n");
+    if (sscanf(raw.data, "HTTP/%*s %d", &status) == 1 && status == 200 && start) {
+        buffer_append(body, start + 4);
+    }
+    buffer_free(&raw);
+    return status == 200 && start ? 0 : -1;
+}
+
+// Resident model server lifecycle
+static void sleep_ms(long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+}
+
+// A port nothing listens on right now, as the kernel picks for a port-0
+// bind, so that instances never share (or answer for) each other's server
+static int server_free_port(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    int port = -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        getsockname(fd, (struct sockaddr *)&addr, &len) == 0) {
+        port = ntohs(addr.sin_port);
+    }
+    close(fd);
+    return port;
+}
+
+// Whether the server on port loaded model: a healthy /health alone could
+// come from another llama-server that got the port first
+static int server_serves_model(int port, const char *model) {
+    Buffer body, path;
+    buffer_init(&body);
+    buffer_init(&path);
+    int ok = http_get_body(port, "/props", &body) == 0 &&
+             json_get_string(body.data, "model_path", &path) == 0 && strcmp(path.data, model) == 0;
+    buffer_free(&body);
+    buffer_free(&path);
+    return ok;
+}
+
+static int server_child_alive(void) {
+    if (model_server.pid <= 0) return 0;
+    int status;
+    pid_t r = waitpid(model_server.pid, &status, WNOHANG);
+    if (r == 0) return 1;
+    model_server.pid = -1; // exited or crashed
+    return 0;
+}
+
+static void server_stop(void) {
+    if (model_server.pid <= 0) return;
+    kill(model_server.pid, SIGTERM);
+    for (int i = 0; i < 20; i++) {
+        if (waitpid(model_server.pid, NULL, WNOHANG) != 0) {
+            model_server.pid = -1;
+            return;
+        }
+        sleep_ms(50);
+    }
+    kill(model_server.pid, SIGKILL);
+    waitpid(model_server.pid, NULL, 0);
+    model_server.pid = -1;
+}
+
+static int server_start(const Config *cfg) {
+    int port_num = cfg->server_port > 0 ? cfg->server_port : server_free_port();
+    if (port_num <= 0) return -1;
+    char ctx[32], port[16];
+    snprintf(ctx, sizeof(ctx), "%zu", cfg->ctx_size);
+    snprintf(port, sizeof(port), "%d", port_num);
+    
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        setpgid(0, 0);
+        int devnull = open("/dev/null", O_RDWR);
+        if (devnull >= 0) {
+            dup2(devnull, STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            if (devnull > STDERR_FILENO) close(devnull);
+        }
+        execlp(cfg->server, cfg->server, "-m", cfg->model, "-c", ctx,
+               "--host", "127.0.0.1", "--port", port,
+               "--threads", "4", "--batch-size", "512", (char *)NULL);
+        _exit(127);
+    }
+    
+    model_server.pid = pid;
+    model_server.port = port_num;
+    memcpy(model_server.model, cfg->model, sizeof(model_server.model));
+    model_server.ctx_size = cfg->ctx_size;
+    if (!model_server.atexit_registered) {
+        atexit(server_stop);
+        model_server.atexit_registered = 1;
+    }
+    
+    // Wait for the model to finish loading
+    update_status("Loading model into resident server...", COLOR_HIGHLIGHT);
+    for (int i = 0; i < SERVER_START_TIMEOUT * 4; i++) {
+        if (!server_child_alive()) return -1;
+        if (http_get_status(model_server.port, "/health") == 200) {
+            if (server_serves_model(model_server.port, cfg->model)) return 0;
+            update_status("Another server answers on the model server's port", COLOR_ERROR);
+            break;
+        }
+        sleep_ms(250);
+    }
+    server_stop();
+    return -1;
+}
+
+// Make sure a healthy resident server is running for the current config
+static int server_ensure(const Config *cfg) {
+    if (server_child_alive() &&
+        (strcmp(model_server.model, cfg->model) != 0 ||
+         model_server.ctx_size != cfg->ctx_size ||
+         (cfg->server_port > 0 && model_server.port != cfg->server_port))) {
+        server_stop(); // config changed, reload
+    }
+    
+    if (server_child_alive()) {
+        if (http_get_status(model_server.port, "/health") == 200) return 0;
+        server_stop(); // hung
+    }
+    
+    if (model_server.failures >= SERVER_MAX_RESTARTS) return -1;
+    if (server_start(cfg) != 0) {
+        model_server.failures++;
+        return -1;
+    }
+    return 0;
+}
+
+// Start the one-shot CLI; it echoes the prompt, then the reply
+static int gen_start_cli(void) {
+    const Config *cfg = gen.cfg;
+    snprintf(gen.tmpfile, sizeof(gen.tmpfile), "/tmp/devstral_%d.txt", getpid());
+    
+    FILE *f = fopen(gen.tmpfile, "w");
+    if (!f) return -1;
+    fwrite(gen.prompt, 1, gen.prompt_len, f);
+    fclose(f);
+    
+    char cache[PATH_MAX_LEN] = "";
+    char cache_arg[PATH_MAX_LEN + 32] = "";
+    if (prompt_cache_path(cfg, cache, sizeof(cache)) == 0) {
+        snprintf(cache_arg, sizeof(cache_arg), "--prompt-cache %s ", cache);
+    }
+    
+    // stderr carries llama.cpp's timing report
+    snprintf(gen.errfile, sizeof(gen.errfile), "/tmp/devstral_%d.err", getpid());
+    
+    char cmd[PATH_MAX_LEN * 6];
+    snprintf(cmd, sizeof(cmd), 
+        "%s -m %s -c %zu -n %zu --temp 0.3 --top-k 20 --top-p 0.95 "
+        "--threads 4 --batch-size 512 %s--file %s 2>%s",
+        cfg->cli, cfg->model, cfg->ctx_size, cfg->n_predict, cache_arg, gen.tmpfile, gen.errfile);
+    
+    int fds[2];
+    if (pipe(fds) != 0) {
+        unlink(gen.tmpfile);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        unlink(gen.tmpfile);
+        return -1;
+    }
+    if (pid == 0) {
+        // Own process group, so a stop reaches the model behind the shell.
+        // Keep the child off the terminal: the UI reads keys meanwhile.
+        setpgid(0, 0);
+        int devnull = open("/dev/null", O_RDONLY);
+        if (devnull >= 0) dup2(devnull, STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    setpgid(pid, pid); // also here, so no kill can race the child's call
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    
+    gen.fd = fds[0];
+    gen.pid = pid;
+    gen.server = 0;
+    gen.first_token = 0;
+    gen.skip = gen.prompt_len;
+    gen.start = now_ms();
+    buffer_clear(gen.out);
+    response_parser_reset(gen.rp, gen.prompt_len);
+    turn_timings.backend = "cli";
+    turn_timings.load_ms = 0;
+    turn_timings.first_token_at = 0;
+    return 0;
+}
+
+// Send the prompt to the resident server; the SSE reply follows on the socket
+static int gen_start_server(void) {
+    int fd = http_connect(model_server.port);
+    if (fd < 0) return -1;
+    
+    Buffer body;
+    buffer_init(&body);
+    buffer_append(&body, "{\"prompt\":");
+    buffer_append_json_string(&body, gen.prompt);
+    buffer_append_fmt(&body, ",\"n_predict\":%zu,\"temperature\":0.3,\"top_k\":20,"
+                      "\"top_p\":0.95,\"stream\":true,\"cache_prompt\":true", gen.cfg->n_predict);
+    if (gen.cfg->stop_seq[0]) {
+        buffer_append(&body, ",\"stop\":[");
+        buffer_append_json_string(&body, gen.cfg->stop_seq);
+        buffer_append(&body, "]");
+    }
+    buffer_append(&body, "}");
+    int rc = http_send_request(fd, "POST", "/completion", body.data);
+    buffer_free(&body);
+    if (rc != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    
+    // The CLI echoes the prompt; mimic its final marker so extraction behaves the same
+    buffer_clear(gen.out);
+    buffer_append(gen.out, "<|assistant|>\n");
+    response_parser_reset(gen.rp, 0);
+    http_stream_init(&gen.hs);
+    
+    gen.fd = fd;
+    gen.pid = -1;
+    gen.server = 1;
+    gen.first_token = 0;
+    gen.skip = gen.out->len;
+    gen.start = now_ms();
+    return 0;
+}
+
+// The run is over: finish parsing and fill in what the backend did not report
+static void gen_finish(int rc) {
+    response_parser_finish(gen.rp, gen.out);
+    if (gen.rp->open_file && !gen.cancelled) gen.truncated = 1;
+    
+    double end = now_ms();
+    turn_timings.ttft_ms = prompt_stats.ttft_ms;
+    if (turn_timings.decode_ms <= 0 && turn_timings.first_token_at > 0) {
+        turn_timings.decode_ms = end - turn_timings.first_token_at;
+    }
+    if (turn_timings.decode_n < 0) turn_timings.decode_n = (long)estimate_tokens(gen.rp->clean.len);
+    if (turn_timings.eval_ms <= 0 && turn_timings.ttft_ms > 0) {
+        turn_timings.eval_ms = turn_timings.ttft_ms > turn_timings.load_ms ? turn_timings.ttft_ms - turn_timings.load_ms : 0;
+    }
+    if (turn_timings.decode_ms > 0) turn_timings.tok_per_s = turn_timings.decode_n * 1000.0 / turn_timings.decode_ms;
+    
+    gen.rc = rc;
+    gen.active = 0;
+}
+
+// Stop the backend now: hang up on the server, which cancels the task, or
+// terminate the CLI's process group, escalating after GEN_KILL_GRACE_MS
+static int gen_terminate(void) {
+    if (gen.fd >= 0) close(gen.fd);
+    gen.fd = -1;
+    if (gen.pid <= 0) return 0;
+    
+    int status = -1;
+    killpg(gen.pid, SIGTERM);
+    double deadline = now_ms() + GEN_KILL_GRACE_MS;
+    while (waitpid(gen.pid, &status, WNOHANG) == 0) {
+        if (now_ms() >= deadline) {
+            killpg(gen.pid, SIGKILL);
+            waitpid(gen.pid, &status, 0);
+            break;
+        }
+        sleep_ms(10);
+    }
+    killpg(gen.pid, SIGKILL); // stragglers the shell left behind
+    gen.pid = -1;
+    return status;
+}
+
+// End of the run: reap the backend, or fall back from the server to the
+// CLI. stopped = we ended it because the rest of the reply is not needed.
+static void gen_end(int stopped) {
+    if (stopped) {
+        gen_terminate();
+        gen.stopped = 1;
+        gen.rp->done = 1; // nothing after this point belongs to the reply
+    }
+    if (gen.fd >= 0) close(gen.fd);
+    gen.fd = -1;
+    
+    if (gen.server) {
+        int ok = gen.hs.status == 200 && (gen.hs.done || stopped);
+        http_stream_free(&gen.hs);
+        if (ok) {
+            model_server.failures = 0;
+            gen_finish(0);
+            return;
+        }
+        update_status("Resident model unavailable, falling back to one-shot CLI...", COLOR_ERROR);
+        if (gen_start_cli() != 0) gen_finish(-1);
+        return;
     }
     
-    fclose(f);
+    int status = 0;
+    if (gen.pid > 0) {
+        while (waitpid(gen.pid, &status, 0) < 0 && errno == EINTR) {}
+        gen.pid = -1;
+    }
+    unlink(gen.tmpfile);
+    
+    char *err = read_file_content(gen.errfile, 1024 * 1024);
+    if (err) {
+        parse_cli_timings(err);
+        free(err);
+    }
+    unlink(gen.errfile);
+    gen_finish(status);
 }
 
-// Run llama.cpp with streaming support
-static int run_llama_streaming(const Config *cfg, const char *prompt, Buffer *out) {
-    char tmpfile[PATH_MAX_LEN];
-    snprintf(tmpfile, sizeof(tmpfile), "/tmp/devstral_%d.txt", getpid());
+// Whether the rest of the reply can be dropped: the model wrote <<<DONE>>>
+// or closed the block of the last file it announced, the configured stop
+// sequence appeared, or (when cfg->stop_grace is set) only trailing text
+// has followed the last block for that many bytes. The last is a guess for
+// replies without an announcement; all of them count as stopped early.
+static int gen_should_stop(void) {
+    ResponseParser *rp = gen.rp;
+    if (rp->complete && !rp->open_file) return 1;
     
-    FILE *f = fopen(tmpfile, "w");
-    if (!f) return -1;
-    fputs(prompt, f);
-    fclose(f);
+    const char *stop = gen.cfg->stop_seq;
+    size_t sl = strlen(stop);
+    if (sl > 0 && rp->clean.len >= sl) {
+        size_t from = gen.stop_scan > sl - 1 ? gen.stop_scan - (sl - 1) : 0;
+        const char *hit = find_bytes(rp->clean.data + from, rp->clean.len - from, stop, sl);
+        gen.stop_scan = rp->clean.len;
+        if (hit) {
+            rp->clean.len = (size_t)(hit - rp->clean.data);
+            rp->clean.data[rp->clean.len] = '\0';
+            if (rp->scan > rp->clean.len) rp->scan = rp->clean.len;
+            return 1;
+        }
+    }
     
-    char cmd[PATH_MAX_LEN * 4];
-    snprintf(cmd, sizeof(cmd), 
-        "%s -m %s -c %zu -n %zu --temp 0.3 --top-k 20 --top-p 0.95 "
-        "--threads 4 --batch-size 512 --file %s 2>/dev/null",
-        cfg->cli, cfg->model, cfg->ctx_size, cfg->n_predict, tmpfile);
+    int grace = gen.cfg->stop_grace;
+    if (grace <= 0 || rp->closed_blocks == 0 || rp->open_file ||
+        rp->clean.len - rp->edits_end < (size_t)grace) return 0;
+    return 1;
+}
+
+// Prefer the resident server; fall back to a one-shot CLI run. Returns at
+// once; drive the run with gen_pump() or gen_wait(). prompt and out must
+// outlive the run. When it is over, rp holds the cleaned response (free it
+// with response_parser_free).
+static void gen_start(const Config *cfg, const char *prompt, Buffer *out, ResponseParser *rp) {
+    gen.cfg = cfg;
+    gen.out = out;
+    gen.rp = rp;
+    gen.rc = -1;
+    gen.stopped = gen.cancelled = gen.truncated = 0;
+    gen.last_refresh = gen.stop_scan = 0;
+    gen.last_draw = 0;
+    gen.prompt = prompt;
+    gen.prompt_len = strlen(prompt);
     
-    FILE *pipe = popen(cmd, "r");
-    if (!pipe) {
-        unlink(tmpfile);
-        return -1;
-    }
+    prompt_stats.prev_ttft_ms = prompt_stats.ttft_ms;
+    prompt_stats.ttft_ms = 0;
+    response_parser_init(rp);
+    gen.active = 1;
     
-    buffer_clear(out);
-    char buf[256];
+    if (cfg->server[0]) {
+        double load_start = now_ms();
+        int up = server_ensure(cfg) == 0;
+        turn_timings.load_ms = now_ms() - load_start;
+        turn_timings.backend = "server";
+        if (up && gen_start_server() == 0) return;
+        update_status("Resident model unavailable, falling back to one-shot CLI...", COLOR_ERROR);
+    }
+    if (gen_start_cli() != 0) gen_finish(-1);
+}
+
+// Consume whatever the backend has ready without blocking; 1 once finished
+static int gen_pump(void) {
+    if (!gen.active) return 1;
     
-    // Stream output
-    while (fgets(buf, sizeof(buf), pipe)) {
-        buffer_append(out, buf);
+    char buf[4096];
+    for (;;) {
+        ssize_t n = read(gen.fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            gen_end(0);
+            break;
+        }
+        if (gen.server) http_stream_feed(&gen.hs, buf, (size_t)n, gen.out);
+        else buffer_append_n(gen.out, buf, (size_t)n);
+        response_parser_feed(gen.rp, gen.out, 0);
         
-        // Update display periodically if streaming
-        if (cfg->stream_output && out->len % 1024 == 0) {
-            Buffer clean;
-            buffer_init(&clean);
-            extract_clean_response(out->data, &clean);
-            if (clean.len > 0) {
-                display_response_with_highlighting(clean.data);
-            }
-            buffer_free(&clean);
+        if (!gen.first_token && gen.out->len > gen.skip) {
+            record_first_token(gen.start);
+            gen.first_token = 1;
+        }
+        if (gen.server && gen.hs.done) {
+            gen_end(0);
+            break;
+        }
+        if (gen_should_stop()) {
+            gen_end(1);
+            break;
         }
     }
     
-    int rc = pclose(pipe);
-    unlink(tmpfile);
-    return rc;
+    // Redraw every KB, or every GEN_REFRESH_MS while tokens trickle in
+    if (gen.active && gen.cfg->stream_output && !ui_overlay && gen.rp->clean.len > gen.last_refresh) {
+        double now = now_ms();
+        if (gen.rp->clean.len - gen.last_refresh >= 1024 || now - gen.last_draw >= GEN_REFRESH_MS) {
+            refresh_stream_view(gen.rp);
+            gen.last_refresh = gen.rp->clean.len;
+            gen.last_draw = now;
+        }
+    }
+    return !gen.active;
+}
+
+// Block until the run is over (batch mode, or when no UI is waiting)
+static void gen_wait(void) {
+    while (gen.active) {
+        struct pollfd pfd = { gen.fd, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) break;
+        gen_pump();
+    }
+}
+
+// Cancel the run in flight; the partial reply is kept but not used
+static void gen_abort(void) {
+    if (!gen.active) return;
+    gen_terminate();
+    if (gen.server) {
+        http_stream_free(&gen.hs);
+    } else {
+        unlink(gen.tmpfile);
+        unlink(gen.errfile);
+    }
+    gen.cancelled = 1;
+    gen.rp->done = 1;
+    gen_finish(-1);
+}
+
+// Fatal signal: take the model's process group and temp files down too.
+// Only async-signal-safe calls.
+static void gen_signal_cleanup(void) {
+    if (!gen.active || gen.server) return;
+    if (gen.pid > 0) killpg(gen.pid, SIGTERM);
+    unlink(gen.tmpfile);
+    unlink(gen.errfile);
+}
+
+// Per-phase timing fields, without the enclosing braces
+static void append_timings_json(Buffer *b, const TurnTimings *t) {
+    buffer_append_fmt(b, "\"scan_ms\":%.1f,\"prompt_ms\":%.1f,\"load_ms\":%.1f,\"eval_ms\":%.1f,"
+                      "\"ttft_ms\":%.1f,\"decode_ms\":%.1f,\"apply_ms\":%.1f,\"test_ms\":%.1f,"
+                      "\"total_ms\":%.1f,\"prompt_n\":%ld,\"cached_n\":%ld,\"decode_n\":%ld,"
+                      "\"tok_per_s\":%.2f",
+                      t->scan_ms, t->prompt_ms, t->load_ms, t->eval_ms, t->ttft_ms, t->decode_ms,
+                      t->apply_ms, t->test_ms, t->total_ms, t->prompt_n, t->cached_n, t->decode_n,
+                      t->tok_per_s);
+}
+
+// Append the finished turn to ~/.devstral_cache/metrics.jsonl, one JSON
+// object per line, for aggregating across runs and machines
+static void metrics_log_append(const Config *cfg, const TurnTimings *t) {
+    char dir[PATH_MAX_LEN / 2], path[PATH_MAX_LEN];
+    if (cache_dir(dir, sizeof(dir)) != 0) return;
+    snprintf(path, sizeof(path), "%s/metrics.jsonl", dir);
+    
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    const char *model = strrchr(cfg->model, '/');
+    model = model ? model + 1 : cfg->model;
+    
+    Buffer line;
+    buffer_init(&line);
+    buffer_append_fmt(&line, "{\"time\":%lld,\"host\":", (long long)time(NULL));
+    buffer_append_json_string(&line, host);
+    buffer_append(&line, ",\"model\":");
+    buffer_append_json_string(&line, model);
+    buffer_append(&line, ",\"mode\":");
+    buffer_append_json_string(&line, cfg->mode);
+    buffer_append_fmt(&line, ",\"backend\":\"%s\",\"ok\":%s,\"ctx_size\":%zu,"
+                      "\"prompt_bytes\":%zu,\"prompt_tokens_est\":%zu,",
+                      t->backend ? t->backend : "none", t->ok ? "true" : "false", cfg->ctx_size,
+                      prompt_stats.prompt_bytes, prompt_stats.prompt_tokens);
+    append_timings_json(&line, t);
+    buffer_append_fmt(&line, ",\"arena_allocs\":%zu,\"arena_kb\":%zu,\"arena_blocks\":%zu}\n",
+                      turn_arena.allocs, turn_arena.bytes / 1024, turn_arena.blocks);
+    
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        if (write(fd, line.data, line.len) < 0) {
+            // Metrics are best effort
+        }
+        close(fd);
+    }
+    buffer_free(&line);
 }
 
 // Display history browser
 static void show_history(void) {
+    history_open(global_cfg.workdir);
     if (history.count == 0) {
         update_status("No conversation history yet", COLOR_ERROR);
         return;
@@ -1065,7 +6942,12 @@ static void show_history(void) {
     int selected = history.count - 1;
     int ch;
     
-    while ((ch = wgetch(hist_win)) != 'q' && ch != 27) { // q or ESC
+    ui_overlay = 1; // keep a streaming reply from painting over the list
+    while ((ch = ui_getch(hist_win)) != 'q' && ch != 27) { // q or ESC
+        if (ch == KEY_RESIZE) {
+            ui_resize();
+            wresize(hist_win, LINES - 2, COLS);
+        }
         werase(hist_win);
         draw_border(hist_win, "Conversation History (↑↓ navigate, Enter to view, q to exit)");
         
@@ -1081,10 +6963,12 @@ static void show_history(void) {
             }
             
             // Show truncated prompt
+            const char *prompt, *response;
+            history_get(i, &prompt, &response);
             char truncated[80];
-            strncpy(truncated, history.prompts[i], 77);
+            strncpy(truncated, prompt, 77);
             truncated[77] = '\0';
-            if (strlen(history.prompts[i]) > 77) strcat(truncated, "...");
+            if (strlen(prompt) > 77) strcat(truncated, "...");
             
             mvwprintw(hist_win, y, 2, "[%d] %s", i + 1, truncated);
             
@@ -1095,7 +6979,9 @@ static void show_history(void) {
         
         // Show selected entry details at bottom
         mvwhline(hist_win, max_y, 1, '-', COLS - 2);
-        mvwprintw(hist_win, max_y + 1, 2, "Prompt: %.100s", history.prompts[selected]);
+        const char *prompt, *response;
+        history_get(selected, &prompt, &response);
+        mvwprintw(hist_win, max_y + 1, 2, "Prompt: %.100s", prompt);
         
         wrefresh(hist_win);
         
@@ -1109,13 +6995,15 @@ static void show_history(void) {
             case '\n':
             case KEY_ENTER:
                 // Display full response
-                display_response_with_highlighting(history.responses[selected]);
+                history_get(selected, &prompt, &response);
+                display_response_with_highlighting(response);
                 update_status("Press any key to return to history", COLOR_HIGHLIGHT);
-                getch();
+                ui_getch(stdscr);
                 break;
         }
     }
     
+    ui_overlay = 0;
     delwin(hist_win);
 }
 
@@ -1125,11 +7013,11 @@ static void browse_files(void) {
     init_windows();
     
     // Refresh file list
-    file_list.count = 0;
-    scan_directory(global_cfg.workdir, &file_list, global_cfg.workdir, 0);
+    repo_index_refresh(&global_cfg);
     
     int ch;
-    while ((ch = wgetch(file_win)) != 'q' && ch != 27) {
+    while ((ch = ui_getch(file_win)) != 'q' && ch != 27) {
+        if (ch == KEY_RESIZE) ui_resize();
         display_file_browser();
         
         switch (ch) {
@@ -1151,14 +7039,16 @@ static void browse_files(void) {
             case 'v': { // View file
                 FileEntry *fe = &file_list.files[file_list.selected];
                 if (!fe->is_dir) {
-                    char full_path[PATH_MAX_LEN];
+                    char full_path[2 * PATH_MAX_LEN];
                     snprintf(full_path, sizeof(full_path), "%s/%s", global_cfg.workdir, fe->path);
                     char *content = read_file_content(full_path, DEFAULT_MAX_FILE);
                     if (content) {
                         display_response_with_highlighting(content);
                         free(content);
                         update_status("Press any key to return", COLOR_HIGHLIGHT);
-                        getch();
+                        ui_overlay = 1;
+                        ui_getch(stdscr);
+                        ui_overlay = 0;
                     }
                 }
                 break;
@@ -1170,89 +7060,688 @@ static void browse_files(void) {
     init_windows();
 }
 
-// Process user prompt
-static void process_prompt(const char *prompt_text) {
-    if (strlen(prompt_text) == 0) return;
-    
-    // Save to history
-    if (history.count < MAX_HISTORY) {
-        strncpy(history.prompts[history.count], prompt_text, sizeof(history.prompts[0]) - 1);
+// Test runner. cfg->test_cmd is a ';'-separated list of commands; each is
+// a shard run in parallel without a shell, with output streamed into the
+// output view. The run is bounded in time and in kept output.
+typedef struct {
+    char *cmd;             // points into the runner's copy of test_cmd
+    pid_t pid;
+    int fd;                // read end of stdout+stderr, -1 once drained
+    int status;
+    int done, timed_out;
+    double start_ms, end_ms;
+    Buffer partial;        // incomplete last line
+} TestShard;
+
+// Split cmd into argv in place: whitespace separates words, quotes and
+// backslashes work as in the shell. Returns the count, -1 if the command
+// needs a shell (pipes, redirections, variables, globs).
+static int split_command(char *cmd, char **argv, int max) {
+    int argc = 0;
+    char *src = cmd, *dst = cmd;
+    while (*src) {
+        while (*src == ' ' || *src == '\t') src++;
+        if (!*src) break;
+        if (argc + 1 >= max) return -1;
+        argv[argc++] = dst;
+        char quote = 0;
+        while (*src && (quote || (*src != ' ' && *src != '\t'))) {
+            char c = *src++;
+            if (quote) {
+                if (c == quote) quote = 0;
+                else if (c == '\\' && quote == '"' && *src && strchr("\"\\$`", *src)) *dst++ = *src++;
+                else *dst++ = c;
+            } else if (c == '\'' || c == '"') {
+                quote = c;
+            } else if (c == '\\' && *src) {
+                *dst++ = *src++;
+            } else if (strchr("|&<>$`*?(){}~", c)) {
+                return -1;
+            } else {
+                *dst++ = c;
+            }
+        }
+        if (quote) return -1;
+        if (*src) src++;
+        *dst++ = '\0';
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+static int test_shard_spawn(const Config *cfg, TestShard *ts) {
+    char copy[PATH_MAX_LEN];
+    snprintf(copy, sizeof(copy), "%s", ts->cmd);
+    char *argv[TEST_MAX_ARGS];
+    if (split_command(copy, argv, TEST_MAX_ARGS) < 0) {
+        // Shell syntax: keep it working, but through /bin/sh
+        argv[0] = "/bin/sh";
+        argv[1] = "-c";
+        argv[2] = ts->cmd;
+        argv[3] = NULL;
     }
+    if (!argv[0]) return -1;
     
-    update_status("Generating response... Please wait.", COLOR_HIGHLIGHT);
+    int fds[2];
+    if (pipe(fds) != 0) return -1;
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        setpgid(0, 0); // the timeout kills the whole group
+        int devnull = open("/dev/null", O_RDONLY);
+        if (devnull >= 0) dup2(devnull, STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        if (chdir(cfg->workdir) != 0) _exit(126);
+        execvp(argv[0], argv);
+        fprintf(stderr, "cannot run %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    setpgid(pid, pid);
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    ts->pid = pid;
+    ts->fd = fds[0];
+    ts->start_ms = now_ms();
+    return 0;
+}
+
+// Move complete lines of ts->partial into out, prefixed when sharded
+static void test_shard_flush(TestShard *ts, int index, int prefix, Buffer *out, size_t *kept, int final) {
+    char *start = ts->partial.data;
+    char *end = start + ts->partial.len;
+    while (start < end) {
+        char *nl = memchr(start, '\n', (size_t)(end - start));
+        if (!nl && !final && end - start < MAX_LINE) break;
+        size_t len = nl ? (size_t)(nl - start) : (size_t)(end - start);
+        if (*kept < TEST_OUTPUT_MAX) {
+            if (prefix) buffer_append_fmt(out, "[%d] ", index + 1);
+            buffer_append_n(out, start, len);
+            buffer_append(out, "\n");
+            *kept += len + 1;
+            if (*kept >= TEST_OUTPUT_MAX) buffer_append(out, "... (output truncated)\n");
+        }
+        start += len + (nl ? 1 : 0);
+    }
+    size_t rest = (size_t)(end - start);
+    memmove(ts->partial.data, start, rest);
+    ts->partial.len = rest;
+    ts->partial.data[rest] = '\0';
+}
+
+static int test_shard_failed(const TestShard *ts) {
+    return ts->timed_out || !WIFEXITED(ts->status) || WEXITSTATUS(ts->status) != 0;
+}
+
+// Lines from a failed run worth repeating in the summary
+static int is_failure_line(const char *line, size_t len) {
+    static const char *markers[] = {"FAIL", "Error", "error:", "ERROR", "failed", "assert", "panicked", "Traceback"};
+    for (size_t i = 0; i < sizeof(markers) / sizeof(markers[0]); i++) {
+        size_t m = strlen(markers[i]);
+        for (size_t j = 0; j + m <= len; j++) {
+            if (memcmp(line + j, markers[i], m) == 0) return 1;
+        }
+    }
+    return 0;
+}
+
+static void summarize_tests(TestShard *shards, int n, const Buffer *log, size_t body, Buffer *output) {
+    buffer_append(output, "─────────────────────────────\n");
+    int failed = 0;
+    for (int i = 0; i < n; i++) {
+        TestShard *ts = &shards[i];
+        const char *what = ts->timed_out ? "TIMED OUT" : test_shard_failed(ts) ? "FAILED" : "passed";
+        buffer_append_fmt(output, "[%d] %-9s %6.1fs  %s", i + 1, what, (ts->end_ms - ts->start_ms) / 1000.0, ts->cmd);
+        if (WIFEXITED(ts->status) && WEXITSTATUS(ts->status) != 0) {
+            buffer_append_fmt(output, "  (exit %d)", WEXITSTATUS(ts->status));
+        } else if (WIFSIGNALED(ts->status) && !ts->timed_out) {
+            buffer_append_fmt(output, "  (signal %d)", WTERMSIG(ts->status));
+        }
+        buffer_append(output, "\n");
+        failed += test_shard_failed(ts);
+    }
+    if (!failed) return;
     
-    Buffer prompt_buf, output_buf, clean_response;
-    buffer_init(&prompt_buf);
-    buffer_init(&output_buf);
-    buffer_init(&clean_response);
+    // Repeat the lines that explain the failures, so they are not lost in the log
+    int shown = 0;
+    const char *p = log->data + body, *end = log->data + log->len;
+    while (p < end && shown < 20) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        size_t len = nl ? (size_t)(nl - p) : (size_t)(end - p);
+        int shard = n > 1 ? (*p == '[' ? atoi(p + 1) - 1 : -1) : 0;
+        if (shard >= 0 && shard < n && test_shard_failed(&shards[shard]) && is_failure_line(p, len)) {
+            if (!shown++) buffer_append(output, "Failures:\n");
+            buffer_append(output, "  ");
+            buffer_append_n(output, p, len);
+            buffer_append(output, "\n");
+        }
+        p += len + 1;
+    }
+}
+
+// Run the configured tests; output gets the log followed by a summary.
+// Returns 0 when every command passed.
+static int run_tests(const Config *cfg, Buffer *output) {
+    if (strlen(cfg->test_cmd) == 0) {
+        buffer_append(output, "No test command configured.\n");
+        return -1;
+    }
     
-    build_enhanced_prompt(&global_cfg, prompt_text, &prompt_buf);
+    // Split on ';' outside quotes
+    char cmds[PATH_MAX_LEN];
+    snprintf(cmds, sizeof(cmds), "%s", cfg->test_cmd);
+    TestShard shards[TEST_MAX_SHARDS];
+    int n = 0;
+    char quote = 0;
+    for (char *c = cmds, *start = cmds; n < TEST_MAX_SHARDS; c++) {
+        if (*c && quote) {
+            if (*c == quote) quote = 0;
+            else if (*c == '\\' && quote == '"' && c[1]) c++;
+            continue;
+        }
+        if (*c == '\'' || *c == '"') quote = *c;
+        if (*c == '\\' && c[1]) c++;
+        else if (*c == ';' || !*c) {
+            int last = !*c;
+            *c = '\0';
+            while (*start == ' ' || *start == '\t') start++;
+            for (char *t = c; t > start && (t[-1] == ' ' || t[-1] == '\t'); t--) t[-1] = '\0';
+            if (*start) {
+                memset(&shards[n], 0, sizeof(TestShard));
+                shards[n].cmd = start;
+                shards[n].fd = -1;
+                buffer_init(&shards[n].partial);
+                n++;
+            }
+            if (last) break;
+            start = c + 1;
+        }
+    }
     
-    int result;
-    if (global_cfg.stream_output) {
-        result = run_llama_streaming(&global_cfg, prompt_buf.data, &output_buf);
-    } else {
-        result = run_llama_streaming(&global_cfg, prompt_buf.data, &output_buf);
+    int jobs = cfg->test_jobs;
+    if (jobs <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (int)cpus : 1;
     }
+    double deadline = now_ms() + 1000.0 * (cfg->test_timeout > 0 ? cfg->test_timeout : TEST_DEFAULT_TIMEOUT);
+    
+    Buffer log;
+    buffer_init(&log);
+    buffer_append_fmt(&log, "Running tests: %s\n", cfg->test_cmd);
+    buffer_append(&log, "─────────────────────────────\n");
+    size_t body = log.len, kept = 0;
+    int next = 0, running = 0, finished = 0, killed = 0;
+    double last_draw = 0;
     
-    if (result == 0 && output_buf.len > 0) {
-        extract_clean_response(output_buf.data, &clean_response);
+    while (finished < n) {
+        while (next < n && running < jobs && !killed) {
+            TestShard *ts = &shards[next];
+            if (test_shard_spawn(cfg, ts) == 0) {
+                running++;
+            } else {
+                buffer_append_fmt(&log, "[%d] cannot start %s\n", next + 1, ts->cmd);
+                ts->status = 127 << 8;
+                ts->done = 1;
+                ts->start_ms = ts->end_ms = now_ms();
+                finished++;
+            }
+            next++;
+        }
+        if (killed && next < n) {
+            // Out of time: what never started counts as timed out
+            for (; next < n; next++) {
+                shards[next].done = shards[next].timed_out = 1;
+                shards[next].start_ms = shards[next].end_ms = now_ms();
+                finished++;
+            }
+        }
+        if (finished >= n) break;
         
-        if (clean_response.len > 0) {
-            display_response_with_highlighting(clean_response.data);
-            
-            // Save to history
-            if (history.count < MAX_HISTORY) {
-                strncpy(history.responses[history.count], clean_response.data,
-                       sizeof(history.responses[0]) - 1);
-                history.count++;
+        struct pollfd pfds[TEST_MAX_SHARDS];
+        int map[TEST_MAX_SHARDS], npfds = 0;
+        for (int i = 0; i < next; i++) {
+            if (shards[i].fd >= 0) {
+                pfds[npfds] = (struct pollfd){ .fd = shards[i].fd, .events = POLLIN };
+                map[npfds++] = i;
             }
-            
-            // Parse and apply changes if configured
-            if (global_cfg.apply_changes) {
-                FileChange *changes;
-                int num_changes;
-                if (parse_file_changes(clean_response.data, &changes, &num_changes) == 0) {
-                    update_status("Found file changes. Applying...", COLOR_HIGHLIGHT);
-                    int applied = apply_file_changes(&global_cfg, changes, num_changes);
-                    
-                    char msg[256];
-                    snprintf(msg, sizeof(msg), "Applied %d/%d file changes", applied, num_changes);
-                    update_status(msg, applied == num_changes ? COLOR_SUCCESS : COLOR_ERROR);
-                    
-                    // Free changes
-                    for (int i = 0; i < num_changes; i++) {
-                        free(changes[i].content);
-                    }
-                    free(changes);
-                    
-                    // Run tests if configured
-                    if (global_cfg.run_tests && applied > 0) {
-                        Buffer test_output;
-                        buffer_init(&test_output);
-                        int test_result = run_tests(&global_cfg, &test_output);
-                        
-                        display_response_with_highlighting(test_output.data);
-                        update_status(test_result == 0 ? "Tests passed!" : "Tests failed!", 
-                                    test_result == 0 ? COLOR_SUCCESS : COLOR_ERROR);
-                        buffer_free(&test_output);
-                    }
-                } else {
-                    update_status("Response generated (no file changes detected)", COLOR_SUCCESS);
+        }
+        poll(pfds, npfds, 100);
+        
+        for (int k = 0; k < npfds; k++) {
+            if (!(pfds[k].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            TestShard *ts = &shards[map[k]];
+            char buf[4096];
+            ssize_t r;
+            while ((r = read(ts->fd, buf, sizeof(buf))) > 0) buffer_append_n(&ts->partial, buf, (size_t)r);
+            test_shard_flush(ts, map[k], n > 1, &log, &kept, 0);
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+                close(ts->fd);
+                ts->fd = -1;
+            }
+        }
+        
+        for (int i = 0; i < next; i++) {
+            TestShard *ts = &shards[i];
+            if (ts->done || waitpid(ts->pid, &ts->status, WNOHANG) != ts->pid) continue;
+            // Exited; a background grandchild may still hold the pipe, so drain what is there
+            if (ts->fd >= 0) {
+                char buf[4096];
+                ssize_t r;
+                while ((r = read(ts->fd, buf, sizeof(buf))) > 0) buffer_append_n(&ts->partial, buf, (size_t)r);
+                close(ts->fd);
+                ts->fd = -1;
+            }
+            test_shard_flush(ts, i, n > 1, &log, &kept, 1);
+            ts->done = 1;
+            ts->end_ms = now_ms();
+            running--;
+            finished++;
+        }
+        
+        if (!killed && now_ms() > deadline) {
+            killed = 1;
+            buffer_append(&log, "... time limit reached, stopping tests\n");
+            for (int i = 0; i < next; i++) {
+                if (shards[i].done) continue;
+                shards[i].timed_out = 1;
+                killpg(shards[i].pid, SIGTERM);
+            }
+            deadline = now_ms() + 2000; // then SIGKILL what is left
+        } else if (killed && now_ms() > deadline) {
+            for (int i = 0; i < next; i++) {
+                if (!shards[i].done) killpg(shards[i].pid, SIGKILL);
+            }
+            deadline = now_ms() + 60000;
+        }
+        
+        if (now_ms() - last_draw >= 100) {
+            output_view_show(log.data, log.len, 1);
+            char msg[96];
+            snprintf(msg, sizeof(msg), "Running tests: %d/%d done, %d running...", finished, n, running);
+            update_status(msg, COLOR_HIGHLIGHT);
+            last_draw = now_ms();
+        }
+    }
+    
+    buffer_append_n(output, log.data, log.len);
+    summarize_tests(shards, n, &log, body, output);
+    
+    int rc = 0;
+    for (int i = 0; i < n; i++) {
+        if (!rc && test_shard_failed(&shards[i])) {
+            rc = shards[i].timed_out ? -1 : WIFEXITED(shards[i].status) ? WEXITSTATUS(shards[i].status) : -1;
+        }
+        buffer_free(&shards[i].partial);
+    }
+    buffer_free(&log);
+    return rc;
+}
+
+// One agent turn, shared by the UI and batch mode: build the prompt, run
+// the model, record the exchange, then apply changes and run tests as
+// configured. turn_begin() starts the generation and turn_finish() picks
+// up once it is over. The result owns the response, changes and test output.
+typedef struct {
+    int rc;                 // the generation's gen.rc
+    char *prompt;
+    ResponseParser response;
+    FileChange *changes;
+    int num_changes;        // -1 = no file changes in the response
+    int applied;
+    int tests_run;
+    int test_rc;
+    Buffer test_output;
+} TurnResult;
+
+static void turn_result_free(TurnResult *r) {
+    free(r->prompt);
+    response_parser_free(&r->response);
+    if (r->test_output.data) buffer_free(&r->test_output);
+    memset(r, 0, sizeof(*r));
+    arena_reset(&turn_arena); // the turn is over
+}
+
+static void turn_begin(const Config *cfg, const char *prompt_text, TurnResult *r) {
+    memset(r, 0, sizeof(*r));
+    r->num_changes = -1;
+    r->prompt = strdup(prompt_text);
+    if (!r->prompt) die("strdup");
+    memset(&turn_timings, 0, sizeof(turn_timings));
+    turn_timings.start = now_ms();
+    turn_timings.prompt_n = turn_timings.cached_n = turn_timings.decode_n = -1;
+    
+    history_open(cfg->workdir);
+    update_status("Building prompt...", COLOR_HIGHLIGHT);
+    
+    // The prompt and the raw output are kept across turns: after the first
+    // turn they are already big enough
+    static Buffer prompt_buf, output_buf;
+    if (!prompt_buf.data) {
+        buffer_init(&prompt_buf);
+        buffer_init(&output_buf);
+    }
+    buffer_clear(&prompt_buf);
+    build_enhanced_prompt(cfg, prompt_text, &prompt_buf);
+    turn_timings.prompt_ms = now_ms() - turn_timings.start - turn_timings.scan_ms;
+    
+    char msg[512];
+    snprintf(msg, sizeof(msg), "Generating response... Please wait. (prompt ~%zu/%zu tokens, %zu KB, peak RSS %ld MB)",
+             prompt_stats.prompt_tokens, prompt_stats.budget_tokens,
+             prompt_stats.prompt_bytes / 1024, prompt_stats.peak_rss_kb / 1024);
+    if (prompt_stats.dropped_files || prompt_stats.dropped_history) {
+        snprintf(msg + strlen(msg), sizeof(msg) - strlen(msg), " dropped %d files [%s], %d history",
+                 prompt_stats.dropped_files, prompt_stats.dropped, prompt_stats.dropped_history);
+    }
+    if (prompt_stats.skipped_files) {
+        snprintf(msg + strlen(msg), sizeof(msg) - strlen(msg), " skipped %d binary/generated",
+                 prompt_stats.skipped_files);
+    }
+    if (prompt_stats.aliased_files) {
+        snprintf(msg + strlen(msg), sizeof(msg) - strlen(msg), " %d duplicates as aliases",
+                 prompt_stats.aliased_files);
+    }
+    update_status(msg, COLOR_HIGHLIGHT);
+    
+    gen_start(cfg, prompt_buf.data, &output_buf, &r->response);
+}
+
+static void turn_finish(const Config *cfg, TurnResult *r) {
+    r->rc = gen.rc;
+    turn_timings.ok = r->rc == 0 && r->response.clean.len > 0;
+    draw_config();
+    
+    if (turn_timings.ok) {
+        history_add(r->prompt, r->response.clean.data);
+        
+        if (cfg->apply_changes) {
+            double apply_start = now_ms();
+            if (parse_file_changes(r->response.clean.data, &r->changes, &r->num_changes) == 0) {
+                update_status("Found file changes. Applying...", COLOR_HIGHLIGHT);
+                r->applied = apply_file_changes(cfg, r->changes, r->num_changes);
+                turn_timings.apply_ms = now_ms() - apply_start;
+                
+                if (cfg->run_tests && r->applied > 0) {
+                    double test_start = now_ms();
+                    buffer_init(&r->test_output);
+                    r->test_rc = run_tests(cfg, &r->test_output);
+                    r->tests_run = 1;
+                    turn_timings.test_ms = now_ms() - test_start;
                 }
             } else {
-                update_status("Response generated. Press 'a' to apply changes if any.", COLOR_SUCCESS);
+                r->num_changes = -1;
             }
-        } else {
-            update_status("Warning: Empty response from model", COLOR_ERROR);
         }
+    }
+    
+    turn_timings.total_ms = now_ms() - turn_timings.start;
+    last_turn = turn_timings;
+    metrics_log_append(cfg, &last_turn);
+    draw_config();
+}
+
+static void run_turn(const Config *cfg, const char *prompt_text, TurnResult *r) {
+    turn_begin(cfg, prompt_text, r);
+    gen_wait();
+    turn_finish(cfg, r);
+}
+
+// Process user prompt. Generation continues in the background of the main
+// loop (see ui_getch); process_prompt_finish() completes the turn.
+static TurnResult ui_turn;
+
+static void process_prompt(const char *prompt_text) {
+    if (strlen(prompt_text) == 0) return;
+    if (ui_busy()) return;
+    
+    turn_begin(&global_cfg, prompt_text, &ui_turn);
+    ui_turn_pending = 1;
+}
+
+// "Applied n/m file changes", with the first error if any
+static void apply_status(char *msg, size_t len, const FileChange *changes, int num_changes, int applied) {
+    snprintf(msg, len, "Applied %d/%d file changes", applied, num_changes);
+    for (int i = 0; i < num_changes; i++) {
+        if (changes[i].error[0]) {
+            snprintf(msg, len, "Applied %d/%d file changes (%s)", applied, num_changes, changes[i].error);
+            break;
+        }
+    }
+}
+
+static void process_prompt_finish(void) {
+    TurnResult *r = &ui_turn;
+    ui_turn_pending = 0;
+    turn_finish(&global_cfg, r);
+    
+    if (gen.cancelled || r->rc != 0 || r->response.clean.len == 0) {
+        if (gen.cancelled && r->response.clean.len > 0) display_response_with_highlighting(r->response.clean.data);
+        update_status(gen.cancelled ? "Generation cancelled" :
+                      r->rc != 0 ? "Error: Failed to generate response" : "Warning: Empty response from model",
+                      COLOR_ERROR);
+        turn_result_free(r);
+        return;
+    }
+    
+    char msg[512];
+    int color = COLOR_SUCCESS;
+    if (!global_cfg.apply_changes) {
+        display_response_with_highlighting(r->response.clean.data);
+        snprintf(msg, sizeof(msg), "Response generated. Press 'a' to apply changes if any.");
+    } else if (r->num_changes < 0) {
+        display_response_with_highlighting(r->response.clean.data);
+        snprintf(msg, sizeof(msg), "Response generated (no file changes detected)");
+    } else if (r->tests_run) {
+        display_response_with_highlighting(r->test_output.data);
+        snprintf(msg, sizeof(msg), "%s", r->test_rc == 0 ? "Tests passed!" : "Tests failed!");
+        color = r->test_rc == 0 ? COLOR_SUCCESS : COLOR_ERROR;
+    } else {
+        display_response_with_highlighting(r->response.clean.data);
+        apply_status(msg, sizeof(msg), r->changes, r->num_changes, r->applied);
+        color = r->applied == r->num_changes ? COLOR_SUCCESS : COLOR_ERROR;
+    }
+    if (gen.truncated) {
+        size_t len = strlen(msg);
+        snprintf(msg + len, sizeof(msg) - len, " - reply truncated, edits may be missing");
+        color = COLOR_ERROR;
+    }
+    update_status(msg, color);
+    
+    turn_result_free(r);
+}
+
+// 'a': apply the edits of the last response, for turns run without
+// auto-apply
+static void apply_last_response(void) {
+    if (ui_busy()) return;
+    history_open(global_cfg.workdir);
+    const char *prompt, *response;
+    history_get(history.count - 1, &prompt, &response);
+    
+    FileChange *changes;
+    int num_changes;
+    if (parse_file_changes(response, &changes, &num_changes) != 0) {
+        update_status("No file changes in the last response", COLOR_ERROR);
+    } else {
+        char msg[512];
+        int applied = apply_file_changes(&global_cfg, changes, num_changes);
+        apply_status(msg, sizeof(msg), changes, num_changes, applied);
+        update_status(msg, applied == num_changes ? COLOR_SUCCESS : COLOR_ERROR);
+    }
+    arena_reset(&turn_arena);
+}
+
+// 't': run the configured tests into the output view
+static void run_tests_now(void) {
+    if (ui_busy()) return;
+    update_status("Running tests...", COLOR_HIGHLIGHT);
+    Buffer output;
+    buffer_init(&output);
+    int rc = run_tests(&global_cfg, &output);
+    display_response_with_highlighting(output.data);
+    update_status(rc == 0 ? "Tests passed!" : "Tests failed!", rc == 0 ? COLOR_SUCCESS : COLOR_ERROR);
+    buffer_free(&output);
+}
+
+// Batch mode (loveme --batch ...): no terminal UI. Prompts come from the
+// command line, a JSONL file ({"id": ..., "prompt": ...} per line) or stdin
+// (one prompt per line, or JSONL); each turn prints one JSON object on
+// stdout. Jobs share the repository index and the resident model. Status
+// goes to stderr with -v.
+static void batch_emit(const char *id, const char *prompt, const TurnResult *r) {
+    Buffer out;
+    buffer_init(&out);
+    buffer_append(&out, "{\"id\":");
+    buffer_append_json_string(&out, id);
+    buffer_append(&out, ",\"prompt\":");
+    buffer_append_json_string(&out, prompt);
+    buffer_append_fmt(&out, ",\"ok\":%s,\"stopped_early\":%s,\"truncated\":%s,\"response\":",
+                      turn_timings.ok ? "true" : "false", gen.stopped ? "true" : "false",
+                      gen.truncated ? "true" : "false");
+    buffer_append_json_string(&out, r->response.clean.data ? r->response.clean.data : "");
+    
+    buffer_append(&out, ",\"changes\":[");
+    for (int i = 0; i < r->num_changes; i++) {
+        buffer_append(&out, i ? ",{\"file\":" : "{\"file\":");
+        buffer_append_json_string(&out, r->changes[i].filepath);
+        buffer_append_fmt(&out, ",\"applied\":%s,\"error\":", r->changes[i].applied ? "true" : "false");
+        buffer_append_json_string(&out, r->changes[i].error);
+        buffer_append(&out, "}");
+    }
+    buffer_append_fmt(&out, "],\"applied\":%d", r->applied);
+    
+    if (r->tests_run) {
+        buffer_append_fmt(&out, ",\"tests\":{\"rc\":%d,\"output\":", r->test_rc);
+        buffer_append_json_string(&out, r->test_output.data);
+        buffer_append(&out, "}");
+    }
+    buffer_append_fmt(&out, ",\"timings\":{\"backend\":\"%s\",",
+                      last_turn.backend ? last_turn.backend : "none");
+    append_timings_json(&out, &last_turn);
+    buffer_append(&out, "}}\n");
+    
+    fwrite(out.data, 1, out.len, stdout);
+    fflush(stdout);
+    buffer_free(&out);
+}
+
+static int batch_run_one(const char *id, const char *prompt) {
+    if (!prompt[0]) return 0;
+    TurnResult r;
+    run_turn(&global_cfg, prompt, &r);
+    batch_emit(id, prompt, &r);
+    int failed = !turn_timings.ok ||
+                 (r.num_changes > 0 && r.applied != r.num_changes) ||
+                 (r.tests_run && r.test_rc != 0);
+    turn_result_free(&r);
+    return failed;
+}
+
+// A line of input: JSONL when it looks like an object, else the prompt itself
+static int batch_run_line(char *line, int n) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!line[0]) return 0;
+    
+    char id[32];
+    snprintf(id, sizeof(id), "%d", n);
+    if (line[0] != '{') return batch_run_one(id, line);
+    
+    Buffer prompt, jid;
+    buffer_init(&prompt);
+    buffer_init(&jid);
+    int failed = 1;
+    if (json_get_string(line, "prompt", &prompt) == 0) {
+        if (json_get_string(line, "id", &jid) != 0) buffer_append(&jid, id);
+        failed = batch_run_one(jid.data, prompt.data);
     } else {
-        update_status("Error: Failed to generate response", COLOR_ERROR);
+        fprintf(stderr, "line %d: no \"prompt\" field\n", n);
+    }
+    buffer_free(&prompt);
+    buffer_free(&jid);
+    return failed;
+}
+
+// Fill in what neither the config file nor the command line set
+static void config_defaults(Config *cfg) {
+    if (!cfg->mode[0]) snprintf(cfg->mode, sizeof(cfg->mode), "edit");
+    if (!cfg->max_total) cfg->max_total = DEFAULT_MAX_TOTAL;
+    if (!cfg->max_file) cfg->max_file = DEFAULT_MAX_FILE;
+    if (!cfg->ctx_size) cfg->ctx_size = 16384;
+    if (!cfg->n_predict) cfg->n_predict = 2048;
+}
+
+static int batch_main(int argc, char **argv) {
+    load_config(&global_cfg);
+    
+    const char *jsonl = NULL;
+    int first_prompt = argc;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(a, "--workdir") == 0 && v) { snprintf(global_cfg.workdir, sizeof(global_cfg.workdir), "%s", v); i++; }
+        else if (strcmp(a, "--model") == 0 && v) { snprintf(global_cfg.model, sizeof(global_cfg.model), "%s", v); i++; }
+        else if (strcmp(a, "--cli") == 0 && v) { snprintf(global_cfg.cli, sizeof(global_cfg.cli), "%s", v); i++; }
+        else if (strcmp(a, "--server") == 0 && v) { snprintf(global_cfg.server, sizeof(global_cfg.server), "%s", v); i++; }
+        else if (strcmp(a, "--mode") == 0 && v) { snprintf(global_cfg.mode, sizeof(global_cfg.mode), "%s", v); i++; }
+        else if (strcmp(a, "--test-cmd") == 0 && v) {
+            snprintf(global_cfg.test_cmd, sizeof(global_cfg.test_cmd), "%s", v);
+            global_cfg.run_tests = 1;
+            i++;
+        }
+        else if (strcmp(a, "--ctx") == 0 && v) { global_cfg.ctx_size = strtoull(v, NULL, 10); i++; }
+        else if (strcmp(a, "--predict") == 0 && v) { global_cfg.n_predict = strtoull(v, NULL, 10); i++; }
+        else if (strcmp(a, "--jsonl") == 0 && v) { jsonl = v; i++; }
+        else if (strcmp(a, "--stop") == 0 && v) { snprintf(global_cfg.stop_seq, sizeof(global_cfg.stop_seq), "%s", v); i++; }
+        else if (strcmp(a, "--apply") == 0) global_cfg.apply_changes = 1;
+        else if (strcmp(a, "--no-apply") == 0) global_cfg.apply_changes = 0;
+        else if (strcmp(a, "--no-tests") == 0) global_cfg.run_tests = 0;
+        else if (strcmp(a, "-v") == 0) batch_verbose = 1;
+        else if (strcmp(a, "--") == 0) { first_prompt = i + 1; break; }
+        else if (a[0] == '-') {
+            fprintf(stderr, "Usage: loveme --batch [--workdir DIR] [--model PATH] [--cli PATH] [--server PATH]\n"
+                            "       [--mode overview|edit|agent] [--ctx N] [--predict N] [--apply|--no-apply]\n"
+                            "       [--test-cmd CMD|--no-tests] [--stop SEQ] [--jsonl FILE] [-v] [--] [prompt...]\n");
+            return 2;
+        } else {
+            first_prompt = i;
+            break;
+        }
+    }
+    
+    char real[PATH_MAX];
+    if (!realpath(global_cfg.workdir[0] ? global_cfg.workdir : ".", real)) {
+        fprintf(stderr, "bad workdir %s: %s\n", global_cfg.workdir, strerror(errno));
+        return 2;
+    }
+    snprintf(global_cfg.workdir, sizeof(global_cfg.workdir), "%s", real);
+    config_defaults(&global_cfg);
+    global_cfg.stream_output = 0;
+    
+    int failed = 0, n = 0;
+    for (int i = first_prompt; i < argc; i++) {
+        char id[32];
+        snprintf(id, sizeof(id), "%d", ++n);
+        failed += batch_run_one(id, argv[i]);
+    }
+    if (jsonl || first_prompt >= argc) {
+        FILE *f = jsonl ? fopen(jsonl, "r") : stdin;
+        if (!f) {
+            fprintf(stderr, "cannot open %s\n", jsonl);
+            return 2;
+        }
+        char *line = NULL;
+        size_t cap = 0;
+        while (getline(&line, &cap, f) > 0) failed += batch_run_line(line, ++n);
+        free(line);
+        if (f != stdin) fclose(f);
     }
     
-    buffer_free(&prompt_buf);
-    buffer_free(&output_buf);
-    buffer_free(&clean_response);
+    server_stop();
+    return failed ? 1 : 0;
 }
 
 // Main loop
@@ -1262,12 +7751,120 @@ static void main_loop(void) {
     
     int ch;
     while (!should_exit) {
-        ch = getch();
+        if (ui_turn_pending && !gen.active) process_prompt_finish();
+        ch = ui_getch(stdscr);
         
         switch (ch) {
+            case KEY_RESIZE:
+                ui_resize();
+                break;
+                
+            case KEY_PPAGE:
+                output_view_scroll(-output_view_page());
+                break;
+                
+            case KEY_NPAGE:
+                output_view_scroll(output_view_page());
+                break;
+                
+            case KEY_HOME:
+                output_view_jump(0);
+                break;
+                
+            case KEY_END:
+                output_view_jump(1);
+                break;
+                
+            case 27: // Esc: cancel the generation in flight
+                if (gen.active) gen_abort();
+                break;
+                
+            case 'u': // Undo the last applied changes
+            case 'U': { // Redo
+                if (ui_busy()) break;
+                char msg[256];
+                int rc = journal_step(&global_cfg, ch == 'U', msg, sizeof(msg));
+                update_status(msg, rc == 0 ? COLOR_SUCCESS : COLOR_ERROR);
+                break;
+            }
+                
             case 'q':
             case 'Q':
+                gen_abort();
                 should_exit = 1;
                 break;
                 
-            case 'c
+            case 'c':
+            case 'C':
+                configure_settings();
+                draw_config();
+                break;
+                
+            case 'p':
+            case 'P':
+            case '\n':
+            case KEY_ENTER: {
+                char *buf = malloc(MAX_PROMPT_LEN);
+                if (!buf) die("malloc");
+                get_multiline_input(buf, MAX_PROMPT_LEN);
+                process_prompt(buf);
+                free(buf);
+                break;
+            }
+                
+            case 'h':
+            case 'H':
+                show_history();
+                clear();
+                ui_resize();
+                break;
+                
+            case 'f':
+            case 'F':
+                browse_files();
+                draw_config();
+                break;
+                
+            case 'a':
+            case 'A':
+                apply_last_response();
+                break;
+                
+            case 't':
+            case 'T':
+                run_tests_now();
+                break;
+                
+            case '?':
+                update_status("p/Enter prompt  c config  f files  h history  a apply  t test  u/U undo/redo  "
+                              "PgUp/PgDn scroll  Esc cancel  q quit", COLOR_HIGHLIGHT);
+                break;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0) return batch_main(argc - 1, argv + 1);
+    
+    load_config(&global_cfg);
+    if (!global_cfg.workdir[0] && !getcwd(global_cfg.workdir, sizeof(global_cfg.workdir))) die("getcwd");
+    config_defaults(&global_cfg);
+    global_cfg.stream_output = 1;
+    
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    
+    initscr();
+    raw(); // Ctrl+C and Ctrl+D reach the prompt editor as keys
+    noecho();
+    keypad(stdscr, TRUE);
+    curs_set(0);
+    init_colors();
+    init_windows();
+    
+    main_loop();
+    
+    cleanup_ncurses();
+    history_close();
+    return 0;
+}